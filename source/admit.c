@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <time.h>
+#include "admit.h"
+#include "index.h"
+#include "duckchat.h"
+#include "wire.h"
+
+/* See admit.h for usage information */
+
+#define BUCKET_CONTROL 0
+#define BUCKET_DATA 1
+#define BUCKETS 2
+
+typedef struct Source {
+    struct Source *prev;
+    struct Source *next;
+    uint64_t key;
+    double tokens[BUCKETS];
+    uint64_t stamp;                   //when tokens was last brought up to date, ns
+} Source;
+
+static int enabled = 0;
+static double rate[BUCKETS] = {ADMIT_CONTROL_RATE, 0};
+static double burst[BUCKETS] = {ADMIT_CONTROL_BURST, 0};
+static int high_watermark = ADMIT_DEFAULT_WATERMARK;
+
+static AddrIndex sources = {NULL, 0, 0};
+//every source, so admit_expire() can walk them
+static Source *sources_head = NULL;
+//charged for addresses that arrive once the index is full
+static Source overflow;
+
+static uint64_t now;
+static AdmitStats stats;
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void admit_init(double say_rate, double say_burst, int watermark) {
+    enabled = say_rate > 0;
+    rate[BUCKET_DATA] = say_rate;
+    burst[BUCKET_DATA] = say_burst >= 1 ? say_burst : 1;
+    high_watermark = watermark;
+    now = clock_ns();
+    overflow.tokens[BUCKET_CONTROL] = burst[BUCKET_CONTROL];
+    overflow.tokens[BUCKET_DATA] = burst[BUCKET_DATA];
+    overflow.stamp = now;
+}
+
+int admit_enabled(void) {
+    return enabled;
+}
+
+int admit_class(int type, int from_neighbor) {
+    switch (type) {
+        case REQ_SAY:
+        case S2S_SAY:
+            return ADMIT_DATA;
+        case S2S_JOIN:
+        case S2S_LEAVE:
+        case WIRE_HELLO:
+        case WIRE_TREE:
+        case WIRE_BUNDLE:
+        case WIRE_REACH:
+            //anyone can send these, only a neighbor's are worth hurrying
+            return from_neighbor ? ADMIT_S2S_CONTROL : ADMIT_CLIENT_CONTROL;
+        default:
+            return ADMIT_CLIENT_CONTROL;
+    }
+}
+
+void admit_begin_batch(int fill_percent) {
+    now = clock_ns();
+    stats.fill = fill_percent;
+    if (!stats.shedding && fill_percent >= high_watermark) {
+        stats.shedding = 1;
+        stats.shed_periods++;
+    } else if (stats.shedding && fill_percent < high_watermark / 2) {
+        stats.shedding = 0;
+    }
+}
+
+static void refill(Source *source) {
+    double elapsed = (double)(now - source->stamp) / 1e9;
+    for (int b = 0; b < BUCKETS; b++) {
+        source->tokens[b] += elapsed * rate[b];
+        if (source->tokens[b] > burst[b]) {
+            source->tokens[b] = burst[b];
+        }
+    }
+    source->stamp = now;
+}
+
+static Source *source_for(const struct sockaddr_in *addr) {
+    uint64_t key = addr_key(addr);
+    Source *source = (Source *)addr_index_find(&sources, key);
+    if (source) {
+        return source;
+    }
+    if (stats.sources >= ADMIT_MAX_SOURCES || !(source = (Source *)malloc(sizeof(Source)))) {
+        stats.overflowed++;
+        return &overflow;
+    }
+    if (addr_index_insert(&sources, key, source) < 0) {
+        free(source);
+        stats.overflowed++;
+        return &overflow;
+    }
+    source->key = key;
+    source->tokens[BUCKET_CONTROL] = burst[BUCKET_CONTROL];
+    source->tokens[BUCKET_DATA] = burst[BUCKET_DATA];
+    source->stamp = now;
+    source->prev = NULL;
+    source->next = sources_head;
+    if (sources_head) {
+        sources_head->prev = source;
+    }
+    sources_head = source;
+    stats.sources++;
+    return source;
+}
+
+int admit(const struct sockaddr_in *source, int klass, int from_neighbor) {
+    if (klass == ADMIT_DATA && stats.shedding) {
+        stats.shed[klass]++;
+        return 0;
+    }
+    if (!from_neighbor) {
+        Source *bucket = source_for(source);
+        int b = klass == ADMIT_DATA ? BUCKET_DATA : BUCKET_CONTROL;
+        refill(bucket);
+        if (bucket->tokens[b] < 1) {
+            stats.limited[klass]++;
+            return 0;
+        }
+        bucket->tokens[b] -= 1;
+    }
+    stats.admitted[klass]++;
+    return 1;
+}
+
+void admit_expire(void) {
+    now = clock_ns();
+    Source *source = sources_head;
+    while (source) {
+        Source *next = source->next;
+        refill(source);
+        //a full bucket is the same as no bucket
+        if (source->tokens[BUCKET_CONTROL] >= burst[BUCKET_CONTROL] && source->tokens[BUCKET_DATA] >= burst[BUCKET_DATA]) {
+            if (source->prev) {
+                source->prev->next = next;
+            } else {
+                sources_head = next;
+            }
+            if (next) {
+                next->prev = source->prev;
+            }
+            addr_index_remove(&sources, source->key);
+            free(source);
+            stats.sources--;
+        }
+        source = next;
+    }
+}
+
+const char *admit_class_name(int klass) {
+    switch (klass) {
+        case ADMIT_S2S_CONTROL: return "s2s_control";
+        case ADMIT_CLIENT_CONTROL: return "client_control";
+        default: return "data";
+    }
+}
+
+void admit_get_stats(AdmitStats *out) {
+    *out = stats;
+}
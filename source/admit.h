@@ -0,0 +1,82 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/* Admission control between the socket and the request handlers,
+ * turned on with admit_init().
+ *
+ * Every received datagram gets a class from its type and sender:
+ *
+ *   ADMIT_S2S_CONTROL     JOIN, LEAVE, HELLO, TREE, REACH and BUNDLE
+ *                         from a neighbor
+ *   ADMIT_CLIENT_CONTROL  LOGIN, LOGOUT, JOIN, LEAVE, LIST, WHO,
+ *                         KEEP_ALIVE, and anything else that is not a
+ *                         SAY
+ *   ADMIT_DATA            SAY and S2S_SAY
+ *
+ * The server handles a receive batch a class at a time in that order, so
+ * a soft-state refresh that arrived behind a burst of SAYs is not kept
+ * waiting by it.  A datagram never goes ahead of an earlier one from the
+ * same sender, though: it waits for the pass that one went in, so a
+ * client's LEAVE still follows its SAY.  Each client address gets two
+ * token buckets, one for control and one for data; a datagram that
+ * finds its bucket empty is dropped.  Neighbors have no buckets, since
+ * their traffic is many users' worth.
+ *
+ * Above the watermark (percent of the receive queue in use, as the
+ * server measures it once per batch) data is shed: every SAY is dropped
+ * unread, bundled S2S_SAYs included, until the queue is back under half
+ * the watermark.  Control is never shed, so routing state holds while
+ * data goes over capacity.
+ */
+
+#define ADMIT_S2S_CONTROL 0
+#define ADMIT_CLIENT_CONTROL 1
+#define ADMIT_DATA 2
+#define ADMIT_CLASSES 3
+
+/* Per-client control bucket: requests per second and burst. */
+#define ADMIT_CONTROL_RATE 20
+#define ADMIT_CONTROL_BURST 40
+#define ADMIT_DEFAULT_WATERMARK 75
+/* Clients with buckets; past this, new addresses share one bucket. */
+#define ADMIT_MAX_SOURCES 65536
+
+typedef struct AdmitStats {
+    uint64_t admitted[ADMIT_CLASSES];
+    uint64_t limited[ADMIT_CLASSES]; /* dropped for an empty bucket */
+    uint64_t shed[ADMIT_CLASSES];    /* dropped above the watermark */
+    uint64_t sources;                /* clients with buckets now */
+    uint64_t overflowed;             /* datagrams charged to the shared bucket */
+    uint64_t shed_periods;           /* times shedding started */
+    int shedding;
+    int fill;                        /* receive queue use at the last batch, percent */
+} AdmitStats;
+
+/* Sets each client's data bucket to say_rate SAYs per second with room
+ * for say_burst, and the shedding watermark in percent.  say_rate 0
+ * leaves admission off. */
+void admit_init(double say_rate, double say_burst, int watermark);
+int admit_enabled(void);
+
+/* The class of a datagram of the given type (see wire_peek_type()). */
+int admit_class(int type, int from_neighbor);
+
+/* Starts a receive batch with the receive queue fill_percent full,
+ * which turns shedding on or off. */
+void admit_begin_batch(int fill_percent);
+
+/* Decides one datagram of the current batch.  Returns 1 to handle it,
+ * 0 if it was dropped (and counted). */
+int admit(const struct sockaddr_in *source, int klass, int from_neighbor);
+
+/* Frees the buckets of clients that have been quiet long enough for
+ * them to fill up again. */
+void admit_expire(void);
+
+const char *admit_class_name(int klass);
+void admit_get_stats(AdmitStats *stats);
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <string.h>
+#include "backlog.h"
+#include "index.h"
+
+/* See backlog.h for usage information */
+
+//datagrams taken from one queue before the next queue gets a turn
+#define BACKLOG_TURN 8
+//most datagrams one backlog_peek() hands out
+#define BACKLOG_PEEK_MAX 1024
+
+typedef struct Queued {
+    struct Queued *next;
+    int keep;
+    size_t len;
+    char data[];
+} Queued;
+
+typedef struct Destination {
+    struct sockaddr_in addr;
+    Queued *head;
+    Queued *tail;
+    int droppable;                    //queued datagrams the policy may drop
+    Queued *cursor;                   //next datagram for backlog_peek()
+    struct Destination *next_active;
+} Destination;
+
+static int depth = 0;
+static int policy = BACKLOG_DROP_OLDEST;
+static backlog_keep_callback keep_callback = NULL;
+
+static AddrIndex destinations = {NULL, 0, 0};
+//queues with datagrams, in the order they filled up
+static Destination *active_head = NULL;
+static Destination *active_tail = NULL;
+
+//what the last backlog_peek() handed out, in order
+static Destination *peeked[BACKLOG_PEEK_MAX];
+
+static BacklogStats stats;
+
+void backlog_init(int queue_depth, int drop_policy, backlog_keep_callback keep) {
+    depth = queue_depth > 0 ? queue_depth : 0;
+    policy = drop_policy;
+    keep_callback = keep;
+}
+
+int backlog_enabled(void) {
+    return depth > 0;
+}
+
+size_t backlog_count(void) {
+    return stats.datagrams;
+}
+
+static Destination *destination_for(const struct sockaddr_in *addr) {
+    uint64_t key = addr_key(addr);
+    Destination *dest = (Destination *)addr_index_find(&destinations, key);
+    if (dest) {
+        return dest;
+    }
+    dest = (Destination *)calloc(1, sizeof(Destination));
+    if (!dest) {
+        return NULL;
+    }
+    if (addr_index_insert(&destinations, key, dest) < 0) {
+        free(dest);
+        return NULL;
+    }
+    dest->addr = *addr;
+    if (active_tail) {
+        active_tail->next_active = dest;
+    } else {
+        active_head = dest;
+    }
+    active_tail = dest;
+    stats.destinations++;
+    return dest;
+}
+
+static void unlink_queued(Destination *dest, Queued *prev, Queued *item) {
+    if (prev) {
+        prev->next = item->next;
+    } else {
+        dest->head = item->next;
+    }
+    if (dest->tail == item) {
+        dest->tail = prev;
+    }
+    if (!item->keep) {
+        dest->droppable--;
+    }
+    stats.datagrams--;
+    stats.bytes -= item->len;
+    free(item);
+}
+
+int backlog_add(const struct sockaddr_in *addr, const struct iovec *iov, int iovcnt) {
+    if (!depth) {
+        return -1;
+    }
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    Queued *item = (Queued *)malloc(sizeof(Queued) + len);
+    Destination *dest = item ? destination_for(addr) : NULL;
+    if (!dest) {
+        free(item);
+        stats.dropped++;
+        return -1;
+    }
+    char *out = item->data;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        out += iov[i].iov_len;
+    }
+    item->next = NULL;
+    item->len = len;
+    item->keep = keep_callback ? keep_callback(addr, item->data, len) : 0;
+
+    if (item->keep) {
+        if (dest->droppable >= depth) {
+            stats.kept++;
+        }
+    } else if (dest->droppable >= depth) {
+        stats.dropped++;
+        if (policy == BACKLOG_DROP_NEWEST) {
+            free(item);
+            return -1;
+        }
+        Queued *prev = NULL;
+        Queued *oldest = dest->head;
+        while (oldest->keep) {
+            prev = oldest;
+            oldest = oldest->next;
+        }
+        unlink_queued(dest, prev, oldest);
+    }
+
+    if (dest->tail) {
+        dest->tail->next = item;
+    } else {
+        dest->head = item;
+    }
+    dest->tail = item;
+    if (!item->keep) {
+        dest->droppable++;
+    }
+    stats.datagrams++;
+    stats.bytes += len;
+    stats.queued++;
+    return 0;
+}
+
+int backlog_peek(struct mmsghdr *msgs, struct iovec *iovs, int max) {
+    if (max > BACKLOG_PEEK_MAX) {
+        max = BACKLOG_PEEK_MAX;
+    }
+    for (Destination *dest = active_head; dest; dest = dest->next_active) {
+        dest->cursor = dest->head;
+    }
+    int count = 0;
+    int progress = 1;
+    while (count < max && progress) {
+        progress = 0;
+        for (Destination *dest = active_head; dest && count < max; dest = dest->next_active) {
+            for (int turn = 0; turn < BACKLOG_TURN && dest->cursor && count < max; turn++) {
+                Queued *item = dest->cursor;
+                dest->cursor = item->next;
+                iovs[count].iov_base = item->data;
+                iovs[count].iov_len = item->len;
+                struct msghdr *hdr = &msgs[count].msg_hdr;
+                memset(hdr, 0, sizeof(*hdr));
+                hdr->msg_name = &dest->addr;
+                hdr->msg_namelen = sizeof(dest->addr);
+                hdr->msg_iov = &iovs[count];
+                hdr->msg_iovlen = 1;
+                peeked[count++] = dest;
+                progress = 1;
+            }
+        }
+    }
+    return count;
+}
+
+void backlog_sent(int count) {
+    //each queue was peeked from its head in order, so its sent datagrams are still at the head
+    for (int i = 0; i < count; i++) {
+        Destination *dest = peeked[i];
+        unlink_queued(dest, NULL, dest->head);
+    }
+    stats.sent += count;
+
+    Destination *prev = NULL;
+    Destination *dest = active_head;
+    while (dest) {
+        Destination *next = dest->next_active;
+        if (dest->head) {
+            prev = dest;
+        } else {
+            if (prev) {
+                prev->next_active = next;
+            } else {
+                active_head = next;
+            }
+            if (active_tail == dest) {
+                active_tail = prev;
+            }
+            addr_index_remove(&destinations, addr_key(&dest->addr));
+            free(dest);
+            stats.destinations--;
+        }
+        dest = next;
+    }
+    //the queue served first goes to the back, so one busy destination cannot hog the socket
+    if (count && active_head && active_head != active_tail) {
+        Destination *first = active_head;
+        active_head = first->next_active;
+        first->next_active = NULL;
+        active_tail->next_active = first;
+        active_tail = first;
+    }
+}
+
+const char *backlog_policy_name(int drop_policy) {
+    return drop_policy == BACKLOG_DROP_NEWEST ? "newest" : "oldest";
+}
+
+int backlog_policy_from_name(const char *name) {
+    if (strcmp(name, "oldest") == 0) {
+        return BACKLOG_DROP_OLDEST;
+    }
+    if (strcmp(name, "newest") == 0) {
+        return BACKLOG_DROP_NEWEST;
+    }
+    return -1;
+}
+
+void backlog_get_stats(BacklogStats *out) {
+    *out = stats;
+}
@@ -0,0 +1,69 @@
+#ifndef BACKLOG_H
+#define BACKLOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Bounded per-destination queues for datagrams the server socket
+ * refused with EAGAIN, so a full send buffer delays them instead of
+ * losing them.  netio fills and drains the queues (see net_drain());
+ * this module only keeps them and applies the drop policy.
+ *
+ * Each user and neighbor gets its own queue the first time one of its
+ * datagrams is refused, and loses it once the queue is empty.  A queue
+ * holds at most `depth` datagrams that may be dropped.  When it is full
+ * the drop policy picks a victim: BACKLOG_DROP_OLDEST throws out the
+ * oldest droppable datagram to make room, and BACKLOG_DROP_NEWEST
+ * refuses the new one.  The keep callback marks datagrams that are
+ * never dropped (S2S control messages in the server).  Those are queued
+ * past the bound, so routing state survives a burst that costs users
+ * some SAYs.
+ */
+
+#define BACKLOG_DEFAULT_DEPTH 64
+
+#define BACKLOG_DROP_OLDEST 0
+#define BACKLOG_DROP_NEWEST 1
+
+/* Returns 1 if the datagram must never be dropped. */
+typedef int (*backlog_keep_callback)(const struct sockaddr_in *dest, const void *data, size_t len);
+
+typedef struct BacklogStats {
+    uint64_t datagrams;    /* waiting now */
+    uint64_t bytes;        /* waiting now */
+    uint64_t destinations; /* queues now */
+    uint64_t queued;       /* datagrams ever queued */
+    uint64_t sent;         /* datagrams sent from a queue */
+    uint64_t dropped;      /* datagrams dropped by the policy */
+    uint64_t kept;         /* never-drop datagrams queued past the bound */
+} BacklogStats;
+
+/* depth 0 turns the queues off: refused datagrams are dropped. */
+void backlog_init(int depth, int policy, backlog_keep_callback keep);
+int backlog_enabled(void);
+
+/* Datagrams waiting in all queues. */
+size_t backlog_count(void);
+
+/* Copies the datagram gathered from iov to the back of dest's queue,
+ * applying the drop policy.  Returns 0 if it was queued, -1 if it was
+ * dropped. */
+int backlog_add(const struct sockaddr_in *dest, const struct iovec *iov, int iovcnt);
+
+/* Points up to max msgs (one iovec each, from iovs) at waiting
+ * datagrams: a few from each queue in turn, each queue's in order. */
+int backlog_peek(struct mmsghdr *msgs, struct iovec *iovs, int max);
+
+/* Removes the first count datagrams of the last backlog_peek(). */
+void backlog_sent(int count);
+
+const char *backlog_policy_name(int policy);
+/* Returns -1 for an unknown name. */
+int backlog_policy_from_name(const char *name);
+
+void backlog_get_stats(BacklogStats *stats);
+
+#endif
@@ -0,0 +1,173 @@
+#!/usr/bin/bash
+
+# Brings up a server topology from start_servers.sh, drives traffic into
+# it and prints a JSON report, so routing changes can be compared run to
+# run.
+#
+#   ./bench_topology.sh [-n nodes] [-d degree] [-s seed] [-u users_per_server]
+#                       [-r says_per_second] [-t seconds] [-o report.json]
+#                       [-a server_args] <topology>
+#
+# <topology> is two, h, grid, ring, tree or random; -n, -d and -s only
+# apply to the generated ones. -a passes extra arguments to every server,
+# e.g. -a -T to compare tree mode against flooding. Needs `make server loadgen logdecode`.
+#
+# The run has two phases:
+#   1. One user joins a channel on the first server. Convergence is the
+#      time from that join until the last server receives the S2S join
+#      (or tree offer).
+#   2. loadgen logs users into every server on that channel and sends
+#      SAYs from the first server only, so each server's latency is for
+#      a known hop count.
+# Every server writes a binary log (-b). Duplicate S2S_SAYs, prunes
+# (S2S leaves) and forwarded S2S_SAYs are counted per link from those
+# logs.
+
+cd "$(dirname "$0")"
+source ./start_servers.sh
+
+nodes=9
+degree=3
+seed=1
+users=20
+rate=200
+seconds=5
+report=/dev/stdout
+server_args=
+while getopts "n:d:s:u:r:t:o:a:" opt; do
+    case $opt in
+        n) nodes=$OPTARG ;;
+        d) degree=$OPTARG ;;
+        s) seed=$OPTARG ;;
+        u) users=$OPTARG ;;
+        r) rate=$OPTARG ;;
+        t) seconds=$OPTARG ;;
+        o) report=$OPTARG ;;
+        a) server_args=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+topology=$1
+if ! declare -F "topology_$topology" >/dev/null; then
+    echo "Usage: $0 [-n nodes] [-d degree] [-s seed] [-u users_per_server] [-r says_per_second] [-t seconds] [-o report.json] [-a server_args] two|h|grid|ring|tree|random" >&2
+    exit 1
+fi
+for tool in "$SERVER" ./loadgen ./logdecode; do
+    if [[ ! -x $tool ]]; then
+        echo "$tool not built, run make server loadgen logdecode" >&2
+        exit 1
+    fi
+done
+
+work=$(mktemp -d)
+trap 'stop_topology; rm -rf "$work"' EXIT
+
+"topology_$topology" "$nodes" "$degree" "$seed" > "$work/topology"
+ports=($(awk '{print $1}' "$work/topology"))
+servers=()
+for port in "${ports[@]}"; do
+    servers+=(localhost "$port")
+done
+
+start_topology "$server_args -l info -b $work/log.%p" < "$work/topology"
+sleep 0.5
+
+# phase 1: a single join on the first server
+start_ns=$(date +%s%N)
+./loadgen -u 1 -c 1 -r 0 -t 1 -S 0 -D 0 localhost "${ports[0]}" > /dev/null
+run_ns=$(date +%s%N)
+
+# phase 2: SAYs from the first server to users everywhere
+./loadgen -J -O 0 -u $((users * ${#ports[@]})) -c 1 -r "$rate" -t "$seconds" "${servers[@]}" > "$work/loadgen.json"
+
+# the log writers drain at least every 64ms
+sleep 0.3
+stop_topology
+for port in "${ports[@]}"; do
+    ./logdecode -t "$work/log.$port"
+done > "$work/events"
+
+{
+    printf '{"topology": "%s", "server_args": "%s", "nodes": %d, "seed": %s, "users_per_server": %s, "say_rate": %s, "seconds": %s,\n' \
+        "$topology" "$server_args" "${#ports[@]}" "$seed" "$users" "$rate" "$seconds"
+    awk -v start_ns="$start_ns" -v run_ns="$run_ns" -v origin="${ports[0]}" '
+    function port_of(address) {
+        return substr(address, index(address, ":") + 1)
+    }
+    # nanoseconds since start_ns, without going through a double
+    function since_start(stamp,    parts) {
+        split(stamp, parts, ".")
+        return (parts[1] - base_sec) * 1e9 + parts[2] - base_ns
+    }
+    BEGIN {
+        base_sec = substr(start_ns, 1, length(start_ns) - 9)
+        base_ns = substr(start_ns, length(start_ns) - 8) + 0
+        run_at = (substr(run_ns, 1, length(run_ns) - 9) - base_sec) * 1e9 + substr(run_ns, length(run_ns) - 8) - base_ns
+    }
+    FNR == NR {
+        nodes[++node_count] = $1
+        for (i = 2; i <= NF; i++) {
+            links[++link_count] = $1 " " $i
+            adj[$1] = adj[$1] " " $i
+        }
+        next
+    }
+    {
+        t = since_start($1)
+        from = port_of($4)
+        to = port_of($5)
+        if ($7 == "S2S" && ($8 == "Join" || $8 == "Tree") && t < run_at) {
+            if ($6 == "send") {
+                joins++
+            } else {
+                reached[from] = 1
+                if (t > last_join) last_join = t
+            }
+        }
+        if (t < run_at) next
+        if ($6 == "send" && $7 == "S2S_SAY") says[from " " to]++
+        if ($6 == "recv" && $7 == "duplicate") dups[to " " from]++
+        if ($6 == "send" && $7 == "S2S" && $8 == "Leave") prunes[from " " to]++
+    }
+    END {
+        reached[origin] = 1
+        reach_count = 0
+        for (port in reached) reach_count++
+        printf "\"join\": {\"convergence_ms\": %.3f, \"servers_reached\": %d, \"s2s_joins\": %d},\n", last_join / 1e6, reach_count, joins
+
+        # hop counts from the origin, breadth first
+        hops[origin] = 0
+        queue[1] = origin
+        tail = 1
+        for (head = 1; head <= tail; head++) {
+            n = split(adj[queue[head]], next_hops, " ")
+            for (i = 1; i <= n; i++) {
+                if (!(next_hops[i] in hops)) {
+                    hops[next_hops[i]] = hops[queue[head]] + 1
+                    queue[++tail] = next_hops[i]
+                }
+            }
+        }
+        printf "\"hops\": {"
+        for (i = 1; i <= node_count; i++) {
+            printf "%s\"%s\": %d", (i > 1 ? ", " : ""), nodes[i], (nodes[i] in hops ? hops[nodes[i]] : -1)
+        }
+        printf "},\n"
+
+        printf "\"links\": ["
+        for (i = 1; i <= link_count; i++) {
+            split(links[i], ends, " ")
+            total_says += says[links[i]]
+            total_dups += dups[links[i]]
+            total_prunes += prunes[links[i]]
+            printf "%s\n  {\"from\": %s, \"to\": %s, \"s2s_says\": %d, \"duplicates\": %d, \"prunes\": %d}",
+                (i > 1 ? "," : ""), ends[1], ends[2], says[links[i]], dups[links[i]], prunes[links[i]]
+        }
+        printf "],\n"
+        printf "\"say\": {\"s2s_says\": %d, \"duplicates\": %d, \"prunes\": %d},\n", total_says, total_dups, total_prunes
+    }' "$work/topology" "$work/events"
+    printf '"loadgen": '
+    cat "$work/loadgen.json"
+    printf '}\n'
+} > "$report"
@@ -0,0 +1,47 @@
+#ifndef BITSET_H
+#define BITSET_H
+
+#include <stdint.h>
+
+/* Fixed-size bitsets stored as arrays of 64-bit words.  The caller owns
+ * the storage and knows its length in words. */
+
+#define BITSET_WORDS(bits) (((bits) + 63) / 64)
+
+static inline int bitset_test(const uint64_t *set, int bit) {
+    return (int)((set[bit >> 6] >> (bit & 63)) & 1);
+}
+
+static inline void bitset_set(uint64_t *set, int bit) {
+    set[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+static inline void bitset_clear(uint64_t *set, int bit) {
+    set[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+static inline int bitset_count(const uint64_t *set, int words) {
+    int count = 0;
+    for (int i = 0; i < words; i++) {
+        count += __builtin_popcountll(set[i]);
+    }
+    return count;
+}
+
+/* Lowest set bit at or after from, or -1. */
+static inline int bitset_next(const uint64_t *set, int words, int from) {
+    int word = from >> 6;
+    if (word >= words) {
+        return -1;
+    }
+    uint64_t bits = set[word] & (~0ULL << (from & 63));
+    while (!bits) {
+        if (++word == words) {
+            return -1;
+        }
+        bits = set[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+#endif
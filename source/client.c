@@ -11,12 +11,17 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include "raw.h"
+#include "wire.h"
 #define BUFFER_SIZE 1024 
+//how long to wait for the server to answer a HELLO before falling back to v1
+#define HELLO_TIMEOUT_MS 300
 
 const char *hostname;
 int sockfd;
 char buffer[BUFFER_SIZE];
 char active_channel[CHANNEL_MAX];
+//wire version agreed with the server
+int version = WIRE_V1;
 
 typedef struct Channel {
     char name[CHANNEL_MAX];
@@ -79,60 +84,107 @@ int is_channel(char* channel_name){
     return 0;
 }
 
-void handle_server_response(char *buffer) {
-    struct text *response = (struct text *)buffer;
+void handle_server_response(char *buffer, int len) {
+    //set while a paginated LIST or WHO reply has more pages coming
+    static int continued = 0;
+    WireMessage response;
+    char name[CHANNEL_MAX];
+    size_t offset = 0;
     clear_prompt_line();
     raw_mode();
     // Switch to raw mode to handle display without disrupting user input
-    //response->txt_type = htonl(response->txt_type);
-    switch (response->txt_type) {
-        case TXT_SAY: {
-            struct text_say *say_response = (struct text_say *)buffer;
-            printf("\r[%s][%s]: %s\n", say_response->txt_channel, say_response->txt_username, say_response->txt_text);
+    if (wire_decode(buffer, len, 1, &response) < 0) {
+        fprintf(stderr, "Malformed response of %d bytes\n", len);
+        response.type = -1;
+    }
+    switch (response.type) {
+        case -1:
+            break;
+        case WIRE_TEXT | TXT_SAY: {
+            printf("\r[%s][%s]: %.*s\n", response.channel, response.username, (int)response.text_len, response.text);
             break;
         }
-        case TXT_LIST: {
-            struct text_list *list_response = (struct text_list *)buffer;
-            printf("Active channels:\n");
-                //list_response->txt_type = ntohl(list_response->txt_type);
-                //list_response->txt_nchannels = ntohl(list_response->txt_nchannels);
-            for (int i = 0; i < list_response->txt_nchannels; i++) {
-                printf("  %s\n", list_response->txt_channels[i].ch_channel);
+        case WIRE_TEXT | TXT_LIST: {
+            if (!continued) printf("Active channels:\n");
+            while (wire_next_entry(&response, &offset, name) == 0) {
+                printf("  %s\n", name);
             }
             break;
         }
-        case TXT_WHO: {
-            struct text_who *who_response = (struct text_who *)buffer;
-            printf("Users on channel %s:\n", who_response->txt_channel);
-            for (int i = 0; i < who_response->txt_nusernames; i++) {
-                printf("  %s\n", who_response->txt_users[i].us_username);
+        case WIRE_TEXT | TXT_WHO: {
+            if (!continued) printf("Users on channel %s:\n", response.channel);
+            while (wire_next_entry(&response, &offset, name) == 0) {
+                printf("  %s\n", name);
             }
             break;
         }
-        case TXT_ERROR: {
-            struct text_error *error_response = (struct text_error *)buffer;
-            printf("Error: %s\n", error_response->txt_error);
+        case WIRE_TEXT | TXT_ERROR: {
+            printf("Error: %.*s\n", (int)response.text_len, response.text);
             break;
         }
+        case WIRE_HELLO:
+            //a late answer to the negotiation, nothing to show
+            break;
         default:
-            fprintf(stderr, "Unknown response type: %d\n", response->txt_type);
+            fprintf(stderr, "Unknown response type: %d\n", response.type);
     }
+    continued = response.type >= 0 && response.more;
 
     cooked_mode();
     printf("> %s", user_input);  
     fflush(stdout);
 }
 
+//encodes a request in the agreed version and sends it
+int send_request(int sockfd, struct sockaddr_in *server_addr, WireMessage *request, const char *what) {
+    char message[BUFFER_SIZE];
+    size_t len = wire_encode(version, request, message, sizeof(message));
+    if (len == 0) {
+        fprintf(stderr, "Error sending %s request: request too long\n", what);
+        return -1;
+    }
+    if (sendto(sockfd, message, len, 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        fprintf(stderr, "Error sending %s request: %s\n", what, strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+//offers v2 and waits briefly for the answer; servers that only know v1 never answer
+int negotiate_version(int sockfd, struct sockaddr_in *server_addr) {
+    WireMessage hello;
+    wire_message(&hello, WIRE_HELLO);
+    hello.hello_version = WIRE_V2;
+    char message[WIRE_V2_HEADER + 2];
+    size_t len = wire_encode(WIRE_V2, &hello, message, sizeof(message));
+    if (sendto(sockfd, message, len, 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        return WIRE_V1;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sockfd, &read_fds);
+    struct timeval timeout = {0, HELLO_TIMEOUT_MS * 1000};
+    if (select(sockfd + 1, &read_fds, NULL, NULL, &timeout) <= 0) {
+        return WIRE_V1;
+    }
+    int received = recv(sockfd, buffer, BUFFER_SIZE, 0);
+    WireMessage answer;
+    if (received > 0 && wire_decode(buffer, received, 1, &answer) == 0 &&
+        answer.type == WIRE_HELLO && answer.hello_version >= WIRE_V2) {
+        return WIRE_V2;
+    }
+    return WIRE_V1;
+}
+
 int send_join(int sockfd, struct sockaddr_in *server_addr, char *channel) {
-    struct request_join join_request;
-    join_request.req_type = REQ_JOIN;
-    strncpy(join_request.req_channel, channel, CHANNEL_MAX);
+    WireMessage join_request;
+    wire_message(&join_request, REQ_JOIN);
+    strncpy(join_request.channel, channel, CHANNEL_MAX - 1);
 
     if(is_channel(channel) == 0){
         add_channel(channel);
     }
-    if (sendto(sockfd, &join_request, sizeof(join_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending join request");
+    if (send_request(sockfd, server_addr, &join_request, "join") < 0) {
         return -1;
     }else{
         strncpy(active_channel, channel, CHANNEL_MAX);
@@ -141,12 +193,11 @@ int send_join(int sockfd, struct sockaddr_in *server_addr, char *channel) {
 }
 
 int send_login(int sockfd, struct sockaddr_in *server_addr, const char *username) {
-    struct request_login login_request;
-    login_request.req_type = REQ_LOGIN;
-    strncpy(login_request.req_username, username, USERNAME_MAX);
+    WireMessage login_request;
+    wire_message(&login_request, REQ_LOGIN);
+    strncpy(login_request.username, username, USERNAME_MAX - 1);
 
-    if (sendto(sockfd, &login_request, sizeof(login_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending login request");
+    if (send_request(sockfd, server_addr, &login_request, "login") < 0) {
         return -1;
     }
     send_join(sockfd, server_addr, active_channel);
@@ -155,70 +206,47 @@ int send_login(int sockfd, struct sockaddr_in *server_addr, const char *username
 }
 
 int send_list(int sockfd, struct sockaddr_in *server_addr) {
-    struct request_list list_request;
-    list_request.req_type = REQ_LIST;
-    if (sendto(sockfd, &list_request, sizeof(list_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending list request");
-        return -1;
-    }
-    return 1;
+    WireMessage list_request;
+    wire_message(&list_request, REQ_LIST);
+    return send_request(sockfd, server_addr, &list_request, "list");
 }
 
 int send_who(int sockfd, struct sockaddr_in *server_addr, const char *channel) {
-    struct request_who who_request;
-    who_request.req_type = REQ_WHO;
-    strncpy(who_request.req_channel, channel, CHANNEL_MAX);
-
-    if (sendto(sockfd, &who_request, sizeof(who_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending who request");
-        return -1;
-    }
-    return 1;
+    WireMessage who_request;
+    wire_message(&who_request, REQ_WHO);
+    strncpy(who_request.channel, channel, CHANNEL_MAX - 1);
+    return send_request(sockfd, server_addr, &who_request, "who");
 }
 
 int send_leave(int sockfd, struct sockaddr_in *server_addr, const char *channel) {
-    struct request_leave leave_request;
-    leave_request.req_type = REQ_LEAVE;
-    strncpy(leave_request.req_channel, channel, CHANNEL_MAX);
-
-    if (sendto(sockfd, &leave_request, sizeof(leave_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending leave request");
-        return -1;
-    }
-    return 1;
+    WireMessage leave_request;
+    wire_message(&leave_request, REQ_LEAVE);
+    strncpy(leave_request.channel, channel, CHANNEL_MAX - 1);
+    return send_request(sockfd, server_addr, &leave_request, "leave");
 }
 
 int send_say(int sockfd, struct sockaddr_in *server_addr, const char *channel, const char *text) {
-    struct request_say say_request;
-    say_request.req_type = REQ_SAY;
-    strncpy(say_request.req_channel, channel, CHANNEL_MAX);
-    strncpy(say_request.req_text, text, SAY_MAX);
-
-    if (sendto(sockfd, &say_request, sizeof(say_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending say request");
-        return -1;
-    }
-    return 1;
+    WireMessage say_request;
+    wire_message(&say_request, REQ_SAY);
+    strncpy(say_request.channel, channel, CHANNEL_MAX - 1);
+    say_request.text = text;
+    say_request.text_len = strlen(text);
+    return send_request(sockfd, server_addr, &say_request, "say");
 }
 
 int send_logout(int sockfd, struct sockaddr_in *server_addr) {
-    struct request_logout logout_request;
-    logout_request.req_type = REQ_LOGOUT;
-
-    if (sendto(sockfd, &logout_request, sizeof(logout_request), 0, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
-        perror("Error sending logout request");
-        
-        return -1;
-    }
-    return 1;
+    WireMessage logout_request;
+    wire_message(&logout_request, REQ_LOGOUT);
+    return send_request(sockfd, server_addr, &logout_request, "logout");
 }
 
 void parse_data(char* input, int sockfd, struct sockaddr_in *server_addr, char *active_channel) {    
     char* token; 
 
-    char input_copy[SAY_MAX];
+    char input_copy[WIRE_TEXT_MAX + 1];
     input[strcspn(input, "\n")] = '\0';
-    strncpy(input_copy, input, SAY_MAX);
+    strncpy(input_copy, input, WIRE_TEXT_MAX);
+    input_copy[WIRE_TEXT_MAX] = '\0';
     token = strtok(input_copy, " ");
 
     if (token == NULL){
@@ -327,6 +355,7 @@ int main(int argc, char* argv[]){
         exit(EXIT_FAILURE);
     }
     
+    version = negotiate_version(sockfd, &server_addr);
     if(send_login(sockfd, &server_addr, username) < 0){
         exit(EXIT_FAILURE);
     }
@@ -353,7 +382,7 @@ int main(int argc, char* argv[]){
                 int bytes_recieved = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&server_addr, &server_len);
                 if  (bytes_recieved > 0){
                     buffer[bytes_recieved] = '\0';
-                    handle_server_response(buffer);
+                    handle_server_response(buffer, bytes_recieved);
                 }
                 if (bytes_recieved < 0) {
                     perror("recvfrom failed");
@@ -366,7 +395,7 @@ int main(int argc, char* argv[]){
 
                 if (ch == '\n') { //newline execute input 
                     parse_data(user_input, sockfd, &server_addr, active_channel);
-                    memset(user_input, 0, SAY_MAX); //clear user input. 
+                    memset(user_input, 0, sizeof(user_input)); //clear user input. 
                     input_pos = 0;  
                 } else if (ch == '\b') {  //backspace 
                     if (input_pos > 0) {
@@ -378,7 +407,7 @@ int main(int argc, char* argv[]){
                         printf("\r> %s", user_input); 
                         fflush(stdout); 
                     }
-                } else if (input_pos < SAY_MAX - 1) { //handle edits
+                } else if (input_pos < (version == WIRE_V2 ? WIRE_TEXT_MAX : SAY_MAX - 1)) { //handle edits
                     user_input[input_pos++] = ch;  
                 }
                 clear_prompt_line();
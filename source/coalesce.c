@@ -0,0 +1,105 @@
+#include <string.h>
+#include "coalesce.h"
+#include "event.h"
+#include "wire.h"
+
+/* See coalesce.h for usage information */
+
+static_assert(COALESCE_MTU <= NET_RECV_BUFFER, "bundles must fit a receive buffer");
+
+static int server_fd = -1;
+static long deadline = 0;
+static int timer_fd = -1;
+static CoalesceBundle *pending = NULL;
+static CoalesceStats stats;
+
+static void send_bundle(CoalesceBundle *bundle) {
+    if (bundle->count == 1) {
+        //a lone message goes out as itself, without the bundle framing
+        size_t skip = WIRE_V2_HEADER + WIRE_BUNDLE_ENTRY;
+        net_send(server_fd, bundle->buf + skip, bundle->len - skip, &bundle->dest);
+        stats.singles++;
+    } else {
+        net_send(server_fd, bundle->buf, bundle->len, &bundle->dest);
+        stats.bundles++;
+    }
+    bundle->len = WIRE_V2_HEADER;
+    bundle->count = 0;
+}
+
+void coalesce_flush(void) {
+    while (pending) {
+        CoalesceBundle *bundle = pending;
+        pending = bundle->next_pending;
+        bundle->next_pending = NULL;
+        bundle->queued = 0;
+        if (bundle->count) {
+            send_bundle(bundle);
+        }
+    }
+}
+
+static void deadline_passed(int fd, uint32_t events, void *arg) {
+    stats.deadlines++;
+    coalesce_flush();
+    net_flush();
+}
+
+int coalesce_init(int sockfd, long deadline_us) {
+    server_fd = sockfd;
+    deadline = deadline_us;
+    if (deadline <= 0) {
+        return 0;
+    }
+    timer_fd = event_add_timer(0, 0, deadline_passed, NULL);
+    return timer_fd < 0 ? -1 : 0;
+}
+
+int coalesce_enabled(void) {
+    return timer_fd >= 0;
+}
+
+void coalesce_bundle_init(CoalesceBundle *bundle, const struct sockaddr_in *dest) {
+    bundle->dest = *dest;
+    bundle->count = 0;
+    bundle->queued = 0;
+    bundle->next_pending = NULL;
+    wire_bundle_begin(bundle->buf);
+    bundle->len = WIRE_V2_HEADER;
+}
+
+int coalesce_add(CoalesceBundle *bundle, const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (WIRE_V2_HEADER + WIRE_BUNDLE_ENTRY + len > COALESCE_MTU) {
+        return -1;
+    }
+    if (bundle->len + WIRE_BUNDLE_ENTRY + len > COALESCE_MTU) {
+        //still on the pending list, it stays there empty until the deadline
+        send_bundle(bundle);
+        stats.full_flushes++;
+    }
+    if (!bundle->queued) {
+        if (!pending) {
+            event_arm_timer_us(timer_fd, deadline);
+        }
+        bundle->queued = 1;
+        bundle->next_pending = pending;
+        pending = bundle;
+    }
+    wire_bundle_entry(bundle->buf + bundle->len, len);
+    bundle->len += WIRE_BUNDLE_ENTRY;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(bundle->buf + bundle->len, iov[i].iov_base, iov[i].iov_len);
+        bundle->len += iov[i].iov_len;
+    }
+    bundle->count++;
+    stats.messages++;
+    return 0;
+}
+
+void coalesce_get_stats(CoalesceStats *out) {
+    *out = stats;
+}
@@ -0,0 +1,63 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include "netio.h"
+
+/* Opt-in packing of S2S messages into BUNDLE datagrams (see wire.h).
+ *
+ * Each neighbor that unpacks bundles has a CoalesceBundle embedded in
+ * it.  coalesce_add() copies a message into the neighbor's bundle
+ * instead of queueing a datagram.  A bundle is sent when the next
+ * message would push it past COALESCE_MTU, or when the flush deadline
+ * has passed since the first message went into it, whichever comes
+ * first.  One timerfd covers every pending bundle.  A bundle holding a
+ * single message is sent as that message alone, so light traffic costs
+ * only the deadline.
+ *
+ * Bundles are queued through netio, so they leave with the next
+ * net_flush() like any other datagram.
+ */
+
+/* Largest bundle: a 1500-byte MTU less the IP and UDP headers.  The
+ * receive buffers are at least this large. */
+#define COALESCE_MTU 1472
+
+typedef struct CoalesceBundle {
+    struct sockaddr_in dest;
+    size_t len;                          /* bytes in buf, header included */
+    int count;                           /* messages in buf */
+    int queued;                          /* on the deadline list */
+    struct CoalesceBundle *next_pending;
+    char buf[COALESCE_MTU];
+} CoalesceBundle;
+
+typedef struct CoalesceStats {
+    uint64_t messages;     /* messages added */
+    uint64_t bundles;      /* datagrams that carried more than one */
+    uint64_t singles;      /* datagrams that carried one */
+    uint64_t full_flushes; /* bundles sent because the next message did not fit */
+    uint64_t deadlines;    /* timer wakeups */
+} CoalesceStats;
+
+/* Enables coalescing with the given deadline; 0 leaves it off.  Call
+ * after event_init().  Returns -1 on error. */
+int coalesce_init(int sockfd, long deadline_us);
+int coalesce_enabled(void);
+
+void coalesce_bundle_init(CoalesceBundle *bundle, const struct sockaddr_in *dest);
+
+/* Copies the message gathered from iov into the bundle, sending the
+ * bundle first if the message would not fit.  Returns -1 if the message
+ * is larger than a bundle. */
+int coalesce_add(CoalesceBundle *bundle, const struct iovec *iov, int iovcnt);
+
+/* Queues every pending bundle with netio. */
+void coalesce_flush(void);
+
+void coalesce_get_stats(CoalesceStats *stats);
+
+#endif
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+/* See dedup.h for usage information */
+
+typedef struct DedupSlot {
+    uint64_t id;
+    time_t timestamp;
+    int used;
+} DedupSlot;
+
+typedef struct DedupEntry {
+    uint64_t id;
+    time_t timestamp;
+} DedupEntry;
+
+static DedupSlot *table = NULL;
+static size_t table_mask = 0;
+static DedupEntry *ring = NULL;
+static size_t ring_capacity = 0;
+static size_t ring_head = 0;
+static size_t ring_count = 0;
+static int window = DEDUP_DEFAULT_WINDOW;
+static DedupStats stats;
+
+static size_t slot_of(uint64_t id) {
+    //ids are already random, fold the high bits in for the counter-style ids
+    return (size_t)(id ^ (id >> 29) ^ (id >> 47)) & table_mask;
+}
+
+int dedup_init(size_t capacity, int window_seconds) {
+    if (capacity == 0) {
+        capacity = DEDUP_DEFAULT_CAPACITY;
+    }
+    //keep the table at most half full
+    size_t table_size = 1;
+    while (table_size < capacity * 2) {
+        table_size <<= 1;
+    }
+
+    DedupSlot *new_table = (DedupSlot *)calloc(table_size, sizeof(DedupSlot));
+    DedupEntry *new_ring = (DedupEntry *)calloc(capacity, sizeof(DedupEntry));
+    if (!new_table || !new_ring) {
+        free(new_table);
+        free(new_ring);
+        return -1;
+    }
+    free(table);
+    free(ring);
+    table = new_table;
+    table_mask = table_size - 1;
+    ring = new_ring;
+    ring_capacity = capacity;
+    ring_head = 0;
+    ring_count = 0;
+    window = window_seconds > 0 ? window_seconds : DEDUP_DEFAULT_WINDOW;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = capacity;
+    stats.window = window;
+    return 0;
+}
+
+static DedupSlot *find_slot(uint64_t id) {
+    size_t pos = slot_of(id);
+    while (table[pos].used) {
+        if (table[pos].id == id) {
+            return &table[pos];
+        }
+        pos = (pos + 1) & table_mask;
+    }
+    return NULL;
+}
+
+static void remove_slot(DedupSlot *slot) {
+    //backward-shift deletion, see index.c
+    size_t hole = slot - table;
+    size_t next = hole;
+    while (1) {
+        next = (next + 1) & table_mask;
+        if (!table[next].used) break;
+        size_t ideal = slot_of(table[next].id);
+        int movable = hole <= next ? (ideal <= hole || ideal > next)
+                                   : (ideal <= hole && ideal > next);
+        if (movable) {
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+    table[hole].used = 0;
+}
+
+//pop the oldest id off the ring and out of the table
+static void drop_oldest(void) {
+    DedupEntry *oldest = &ring[ring_head];
+    DedupSlot *slot = find_slot(oldest->id);
+    if (slot && slot->timestamp == oldest->timestamp) {
+        remove_slot(slot);
+    }
+    ring_head = (ring_head + 1) % ring_capacity;
+    ring_count--;
+}
+
+void dedup_expire(time_t now) {
+    while (ring_count > 0 && difftime(now, ring[ring_head].timestamp) > window) {
+        drop_oldest();
+        stats.expired++;
+    }
+}
+
+int dedup_seen(uint64_t id, time_t now) {
+    if (!table && dedup_init(DEDUP_DEFAULT_CAPACITY, DEDUP_DEFAULT_WINDOW) < 0) {
+        return 0;
+    }
+    dedup_expire(now);
+    stats.lookups++;
+    if (find_slot(id)) {
+        stats.hits++;
+        return 1;
+    }
+    return 0;
+}
+
+void dedup_insert(uint64_t id, time_t now) {
+    if (!table && dedup_init(DEDUP_DEFAULT_CAPACITY, DEDUP_DEFAULT_WINDOW) < 0) {
+        return;
+    }
+    dedup_expire(now);
+    DedupSlot *slot = find_slot(id);
+    if (slot) {
+        return;
+    }
+    if (ring_count == ring_capacity) {
+        drop_oldest();
+        stats.evicted_early++;
+    }
+
+    size_t pos = slot_of(id);
+    while (table[pos].used) {
+        pos = (pos + 1) & table_mask;
+    }
+    table[pos].id = id;
+    table[pos].timestamp = now;
+    table[pos].used = 1;
+
+    DedupEntry *entry = &ring[(ring_head + ring_count) % ring_capacity];
+    entry->id = id;
+    entry->timestamp = now;
+    ring_count++;
+    stats.inserts++;
+}
+
+void dedup_get_stats(DedupStats *out) {
+    *out = stats;
+    out->occupancy = ring_count;
+}
+
+double dedup_false_positive_rate(void) {
+    return 0.0;
+}
+
+double dedup_early_eviction_rate(void) {
+    if (stats.inserts == 0) {
+        return 0.0;
+    }
+    return (double)stats.evicted_early / (double)stats.inserts;
+}
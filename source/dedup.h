@@ -0,0 +1,55 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Fixed-memory table of recently seen S2S_SAY ids, used for loop
+ * detection.  Ids live in an open-addressing hash table and, in
+ * insertion order, in a ring.  Entries older than the window are
+ * expired from the head of the ring as new ids arrive, so both lookup
+ * and upkeep are O(1) and memory never grows past the configured
+ * capacity.
+ *
+ * Full 64-bit ids are stored, so a lookup never reports an id that was
+ * not inserted (the false positive rate is zero by construction).  The
+ * failure mode of a fixed table is the opposite one: if more than
+ * `capacity` ids arrive inside one window the oldest are evicted early
+ * and a late duplicate of one of them would be forwarded instead of
+ * pruned.  That count is reported as `evicted_early`.
+ */
+
+#define DEDUP_DEFAULT_CAPACITY 65536
+#define DEDUP_DEFAULT_WINDOW 120
+
+typedef struct DedupStats {
+    size_t capacity;        /* maximum live ids */
+    size_t occupancy;       /* live ids right now */
+    int window;             /* seconds an id is remembered */
+    uint64_t lookups;
+    uint64_t hits;          /* duplicates detected */
+    uint64_t inserts;
+    uint64_t expired;       /* ids aged out of the window */
+    uint64_t evicted_early; /* ids pushed out before their window ended */
+} DedupStats;
+
+/* Returns -1 on allocation failure, 0 on success.  May be called again
+ * to resize; previously seen ids are forgotten. */
+int dedup_init(size_t capacity, int window_seconds);
+
+/* Returns 1 if id was seen inside the window, 0 otherwise. */
+int dedup_seen(uint64_t id, time_t now);
+/* Records id as seen at now. */
+void dedup_insert(uint64_t id, time_t now);
+/* Drops ids older than the window.  Called by dedup_seen/dedup_insert,
+ * exposed so an idle server can still release entries. */
+void dedup_expire(time_t now);
+
+void dedup_get_stats(DedupStats *stats);
+/* False positive rate of the table (always 0, see above) and fraction of
+ * inserts that were evicted before their window ended. */
+double dedup_false_positive_rate(void);
+double dedup_early_eviction_rate(void);
+
+#endif
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include "event.h"
+
+/* See event.h for usage information */
+
+#define EVENT_MAX_READY 64
+
+typedef struct EventSource {
+    int fd;
+    int is_timer;
+    event_callback callback;
+    void *arg;
+    struct EventSource *next;
+} EventSource;
+
+static int epoll_fd = -1;
+static EventSource *sources = NULL;
+static int running = 0;
+
+int event_init(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd < 0 ? -1 : 0;
+}
+
+static EventSource *find_source(int fd) {
+    EventSource *current = sources;
+    while (current) {
+        if (current->fd == fd) {
+            return current;
+        }
+        current = current->next;
+    }
+    return NULL;
+}
+
+static int add_source(int fd, uint32_t events, int is_timer, event_callback callback, void *arg) {
+    EventSource *source = (EventSource *)malloc(sizeof(EventSource));
+    if (!source) {
+        return -1;
+    }
+    source->fd = fd;
+    source->is_timer = is_timer;
+    source->callback = callback;
+    source->arg = arg;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        free(source);
+        return -1;
+    }
+    source->next = sources;
+    sources = source;
+    return 0;
+}
+
+int event_add_fd(int fd, uint32_t events, event_callback callback, void *arg) {
+    return add_source(fd, events, 0, callback, arg);
+}
+
+int event_mod_fd(int fd, uint32_t events) {
+    EventSource *source = find_source(fd);
+    if (!source) {
+        errno = ENOENT;
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = source;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_del_fd(int fd) {
+    EventSource *current = sources;
+    EventSource *prev = NULL;
+    while (current) {
+        if (current->fd == fd) {
+            if (prev == NULL) {
+                sources = current->next;
+            } else {
+                prev->next = current->next;
+            }
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            if (current->is_timer) {
+                close(fd);
+            }
+            free(current);
+            return 0;
+        }
+        prev = current;
+        current = current->next;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+static void ms_to_timespec(long ms, struct timespec *ts) {
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000L;
+}
+
+int event_arm_timer(int timer_fd, long first_ms, long interval_ms) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    ms_to_timespec(first_ms, &spec.it_value);
+    ms_to_timespec(interval_ms, &spec.it_interval);
+    return timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+int event_arm_timer_us(int timer_fd, long first_us) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = first_us / 1000000L;
+    spec.it_value.tv_nsec = (first_us % 1000000L) * 1000L;
+    return timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+long event_timer_remaining(int timer_fd) {
+    struct itimerspec spec;
+    if (timerfd_gettime(timer_fd, &spec) < 0) {
+        return 0;
+    }
+    return spec.it_value.tv_sec * 1000 + spec.it_value.tv_nsec / 1000000L;
+}
+
+int event_add_timer(long first_ms, long interval_ms, event_callback callback, void *arg) {
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        return -1;
+    }
+    if (event_arm_timer(timer_fd, first_ms, interval_ms) < 0 ||
+        add_source(timer_fd, EPOLLIN, 1, callback, arg) < 0) {
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+int event_run_once(int timeout_ms) {
+    struct epoll_event ready[EVENT_MAX_READY];
+    int n = epoll_wait(epoll_fd, ready, EVENT_MAX_READY, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        EventSource *source = (EventSource *)ready[i].data.ptr;
+        uint32_t events = ready[i].events;
+        if (source->is_timer) {
+            uint64_t expirations = 0;
+            if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                //re-armed between the wakeup and the read
+                continue;
+            }
+            events = (uint32_t)expirations;
+        }
+        source->callback(source->fd, events, source->arg);
+    }
+    return n;
+}
+
+int event_run(void) {
+    running = 1;
+    while (running) {
+        if (event_run_once(-1) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void event_stop(void) {
+    running = 0;
+}
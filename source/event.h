@@ -0,0 +1,48 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* epoll based event loop.  Any number of file descriptors (the server
+ * socket, an extra S2S or control socket) and timerfd timers can be
+ * registered, each with its own callback.  The loop blocks in
+ * epoll_wait() with no timeout, so an idle server sleeps until a packet
+ * arrives or a timer is due.
+ *
+ * Timers use CLOCK_MONOTONIC timerfds.  A timer callback runs once per
+ * wakeup no matter how many expirations were missed; the count is
+ * passed in `events`.  Callbacks may re-arm timers and modify their own
+ * fd but should not delete other sources.
+ */
+
+typedef void (*event_callback)(int fd, uint32_t events, void *arg);
+
+/* Returns -1 on error, 0 on success */
+int event_init(void);
+
+/* Watches fd for the given EPOLL* events. */
+int event_add_fd(int fd, uint32_t events, event_callback callback, void *arg);
+int event_mod_fd(int fd, uint32_t events);
+int event_del_fd(int fd);
+
+/* Creates a timer.  It first fires after `first_ms` milliseconds and then
+ * every `interval_ms` (0 for one-shot; first_ms 0 leaves it disarmed).
+ * Returns the timer's fd, or -1 on error. */
+int event_add_timer(long first_ms, long interval_ms, event_callback callback, void *arg);
+/* Re-arms (or with first_ms 0, disarms) an existing timer. */
+int event_arm_timer(int timer_fd, long first_ms, long interval_ms);
+/* One-shot re-arm with microsecond resolution, for short deadlines. */
+int event_arm_timer_us(int timer_fd, long first_us);
+/* Milliseconds until the timer next fires, 0 if disarmed. */
+long event_timer_remaining(int timer_fd);
+
+/* Waits for events and runs their callbacks.  timeout_ms of -1 blocks.
+ * Returns the number of callbacks run or -1 on error. */
+int event_run_once(int timeout_ms);
+
+/* Runs until event_stop() is called.  Returns -1 on error. */
+int event_run(void);
+void event_stop(void);
+
+#endif
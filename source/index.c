@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include "index.h"
+
+/* See index.h for usage information */
+
+#define INDEX_MIN_CAPACITY 8
+
+static uint64_t mix64(uint64_t x) {
+    //splitmix64 finalizer, spreads packed addresses across the table
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+//true if slot j can be moved back into hole i given its ideal slot k
+static int can_shift(size_t i, size_t j, size_t k) {
+    if (i <= j) {
+        return k <= i || k > j;
+    }
+    return k <= i && k > j;
+}
+
+uint64_t addr_key(const struct sockaddr_in *addr) {
+    return ((uint64_t)addr->sin_addr.s_addr << 16) | (uint64_t)addr->sin_port;
+}
+
+static int addr_index_grow(AddrIndex *index) {
+    size_t new_capacity = index->capacity ? index->capacity * 2 : INDEX_MIN_CAPACITY;
+    AddrIndexSlot *new_slots = (AddrIndexSlot *)calloc(new_capacity, sizeof(AddrIndexSlot));
+    if (!new_slots) {
+        return -1;
+    }
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < index->capacity; i++) {
+        AddrIndexSlot *slot = &index->slots[i];
+        if (!slot->value) continue;
+        size_t pos = mix64(slot->key) & mask;
+        while (new_slots[pos].value) {
+            pos = (pos + 1) & mask;
+        }
+        new_slots[pos] = *slot;
+    }
+    free(index->slots);
+    index->slots = new_slots;
+    index->capacity = new_capacity;
+    return 0;
+}
+
+void *addr_index_find(const AddrIndex *index, uint64_t key) {
+    if (index->count == 0) {
+        return NULL;
+    }
+    size_t mask = index->capacity - 1;
+    size_t pos = mix64(key) & mask;
+    while (index->slots[pos].value) {
+        if (index->slots[pos].key == key) {
+            return index->slots[pos].value;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+int addr_index_insert(AddrIndex *index, uint64_t key, void *value) {
+    if ((index->count + 1) * 4 > index->capacity * 3 && addr_index_grow(index) < 0) {
+        return -1;
+    }
+    size_t mask = index->capacity - 1;
+    size_t pos = mix64(key) & mask;
+    while (index->slots[pos].value) {
+        if (index->slots[pos].key == key) {
+            index->slots[pos].value = value;
+            return 0;
+        }
+        pos = (pos + 1) & mask;
+    }
+    index->slots[pos].key = key;
+    index->slots[pos].value = value;
+    index->count++;
+    return 1;
+}
+
+int addr_index_remove(AddrIndex *index, uint64_t key) {
+    if (index->count == 0) {
+        return 0;
+    }
+    size_t mask = index->capacity - 1;
+    size_t hole = mix64(key) & mask;
+    while (index->slots[hole].value && index->slots[hole].key != key) {
+        hole = (hole + 1) & mask;
+    }
+    if (!index->slots[hole].value) {
+        return 0;
+    }
+
+    //backward-shift the rest of the cluster so probes never see a gap
+    size_t next = hole;
+    while (1) {
+        next = (next + 1) & mask;
+        if (!index->slots[next].value) break;
+        size_t ideal = mix64(index->slots[next].key) & mask;
+        if (can_shift(hole, next, ideal)) {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+    }
+    index->slots[hole].value = NULL;
+    index->count--;
+    return 1;
+}
+
+void addr_index_free(AddrIndex *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+uint64_t name_hash(const char *name) {
+    //FNV-1a over the stored (truncated) form of the name
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < INDEX_NAME_MAX - 1 && name[i]; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int name_equal(const NameIndexSlot *slot, uint64_t hash, const char *name) {
+    return slot->hash == hash && strncmp(slot->name, name, INDEX_NAME_MAX - 1) == 0;
+}
+
+static int name_index_grow(NameIndex *index) {
+    size_t new_capacity = index->capacity ? index->capacity * 2 : INDEX_MIN_CAPACITY;
+    NameIndexSlot *new_slots = (NameIndexSlot *)calloc(new_capacity, sizeof(NameIndexSlot));
+    if (!new_slots) {
+        return -1;
+    }
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < index->capacity; i++) {
+        NameIndexSlot *slot = &index->slots[i];
+        if (!slot->value) continue;
+        size_t pos = slot->hash & mask;
+        while (new_slots[pos].value) {
+            pos = (pos + 1) & mask;
+        }
+        new_slots[pos] = *slot;
+    }
+    free(index->slots);
+    index->slots = new_slots;
+    index->capacity = new_capacity;
+    return 0;
+}
+
+void *name_index_find(const NameIndex *index, const char *name) {
+    if (index->count == 0) {
+        return NULL;
+    }
+    uint64_t hash = name_hash(name);
+    size_t mask = index->capacity - 1;
+    size_t pos = hash & mask;
+    while (index->slots[pos].value) {
+        if (name_equal(&index->slots[pos], hash, name)) {
+            return index->slots[pos].value;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+int name_index_insert(NameIndex *index, const char *name, void *value) {
+    if ((index->count + 1) * 4 > index->capacity * 3 && name_index_grow(index) < 0) {
+        return -1;
+    }
+    uint64_t hash = name_hash(name);
+    size_t mask = index->capacity - 1;
+    size_t pos = hash & mask;
+    while (index->slots[pos].value) {
+        if (name_equal(&index->slots[pos], hash, name)) {
+            index->slots[pos].value = value;
+            return 0;
+        }
+        pos = (pos + 1) & mask;
+    }
+    index->slots[pos].hash = hash;
+    strncpy(index->slots[pos].name, name, INDEX_NAME_MAX - 1);
+    index->slots[pos].name[INDEX_NAME_MAX - 1] = '\0';
+    index->slots[pos].value = value;
+    index->count++;
+    return 1;
+}
+
+int name_index_remove(NameIndex *index, const char *name) {
+    if (index->count == 0) {
+        return 0;
+    }
+    uint64_t hash = name_hash(name);
+    size_t mask = index->capacity - 1;
+    size_t hole = hash & mask;
+    while (index->slots[hole].value && !name_equal(&index->slots[hole], hash, name)) {
+        hole = (hole + 1) & mask;
+    }
+    if (!index->slots[hole].value) {
+        return 0;
+    }
+
+    size_t next = hole;
+    while (1) {
+        next = (next + 1) & mask;
+        if (!index->slots[next].value) break;
+        size_t ideal = index->slots[next].hash & mask;
+        if (can_shift(hole, next, ideal)) {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+    }
+    index->slots[hole].value = NULL;
+    index->count--;
+    return 1;
+}
+
+void name_index_free(NameIndex *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+
+/* Open-addressing hash indexes that sit next to the server's linked
+ * lists so lookups by address or by name do not have to walk them.
+ *
+ * Both tables use linear probing with backward-shift deletion, so there
+ * are no tombstones and a probe stops at the first empty slot.  A slot
+ * is empty when its value is NULL.  Tables start with no storage and
+ * double once they pass 3/4 load.  The index never owns the values it
+ * points at; callers free their own nodes after removing them.
+ */
+
+/* Names are stored the same way the server stores them: at most
+ * CHANNEL_MAX - 1 characters (USERNAME_MAX is the same size). */
+#define INDEX_NAME_MAX CHANNEL_MAX
+
+typedef struct AddrIndexSlot {
+    uint64_t key;
+    void *value;
+} AddrIndexSlot;
+
+typedef struct AddrIndex {
+    AddrIndexSlot *slots;
+    size_t capacity;
+    size_t count;
+} AddrIndex;
+
+typedef struct NameIndexSlot {
+    uint64_t hash;
+    char name[INDEX_NAME_MAX];
+    void *value;
+} NameIndexSlot;
+
+typedef struct NameIndex {
+    NameIndexSlot *slots;
+    size_t capacity;
+    size_t count;
+} NameIndex;
+
+/* Packs an IPv4 address and port into a single 64-bit key. */
+uint64_t addr_key(const struct sockaddr_in *addr);
+
+/* Returns the value stored for key, or NULL. */
+void *addr_index_find(const AddrIndex *index, uint64_t key);
+/* Inserts or replaces.  Returns 1 if inserted, 0 if replaced, -1 on
+ * allocation failure. */
+int addr_index_insert(AddrIndex *index, uint64_t key, void *value);
+/* Returns 1 if the key was present and removed, 0 otherwise. */
+int addr_index_remove(AddrIndex *index, uint64_t key);
+void addr_index_free(AddrIndex *index);
+
+uint64_t name_hash(const char *name);
+void *name_index_find(const NameIndex *index, const char *name);
+int name_index_insert(NameIndex *index, const char *name, void *value);
+int name_index_remove(NameIndex *index, const char *name);
+void name_index_free(NameIndex *index);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include "intern.h"
+#include "index.h"
+
+/* See intern.h for usage information */
+
+typedef struct InternEntry {
+    char name[CHANNEL_MAX];
+    int refs;
+    int next_free;
+} InternEntry;
+
+static InternEntry *entries = NULL;
+static int capacity = 0;
+//ids below used have been handed out at least once
+static int used = 0;
+static int free_head = INTERN_NONE;
+//name -> id + 1, so id 0 is not stored as NULL
+static NameIndex by_name = {NULL, 0, 0};
+
+int intern_find(const char *name) {
+    void *value = name_index_find(&by_name, name);
+    return value ? (int)((intptr_t)value - 1) : INTERN_NONE;
+}
+
+static int intern_new_id(void) {
+    if (free_head != INTERN_NONE) {
+        int id = free_head;
+        free_head = entries[id].next_free;
+        return id;
+    }
+    if (used == capacity) {
+        int grown_capacity = capacity ? capacity * 2 : 64;
+        InternEntry *grown = (InternEntry *)realloc(entries, grown_capacity * sizeof(InternEntry));
+        if (!grown) {
+            return INTERN_NONE;
+        }
+        entries = grown;
+        capacity = grown_capacity;
+    }
+    return used++;
+}
+
+int intern_acquire(const char *name) {
+    int id = intern_find(name);
+    if (id != INTERN_NONE) {
+        entries[id].refs++;
+        return id;
+    }
+    id = intern_new_id();
+    if (id == INTERN_NONE) {
+        return INTERN_NONE;
+    }
+    strncpy(entries[id].name, name, CHANNEL_MAX - 1);
+    entries[id].name[CHANNEL_MAX - 1] = '\0';
+    entries[id].refs = 1;
+    if (name_index_insert(&by_name, entries[id].name, (void *)(intptr_t)(id + 1)) < 0) {
+        entries[id].refs = 0;
+        entries[id].next_free = free_head;
+        free_head = id;
+        return INTERN_NONE;
+    }
+    return id;
+}
+
+void intern_retain(int id) {
+    entries[id].refs++;
+}
+
+void intern_release(int id) {
+    if (--entries[id].refs > 0) {
+        return;
+    }
+    name_index_remove(&by_name, entries[id].name);
+    entries[id].next_free = free_head;
+    free_head = id;
+}
+
+const char *intern_name(int id) {
+    return entries[id].name;
+}
+
+int intern_limit(void) {
+    return used;
+}
@@ -0,0 +1,37 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include "duckchat.h"
+
+/* Channel-name interning.
+ *
+ * Each channel name the server routes on is mapped to a small dense
+ * integer id when a packet naming it is decoded.  Per-channel routing
+ * state can then live in arrays and bitsets indexed by id instead of in
+ * lists searched with strcmp.
+ *
+ * Ids are reference counted.  intern_acquire() takes a reference,
+ * interning the name first if needed, and intern_release() drops one.
+ * When the last reference goes the id is put on a free list and handed
+ * out again, so ids stay below the number of live channels rather than
+ * the number of names ever seen.
+ */
+
+#define INTERN_NONE (-1)
+
+/* Id for name with one more reference, or INTERN_NONE on allocation
+ * failure. */
+int intern_acquire(const char *name);
+/* Id for name if it is interned, without taking a reference. */
+int intern_find(const char *name);
+void intern_retain(int id);
+void intern_release(int id);
+
+/* Name an id was interned with.  Valid while the id has references. */
+const char *intern_name(int id);
+
+/* Every live id is below this. */
+int intern_limit(void);
+
+#endif
@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+#include "event.h"
+#include "wire.h"
+
+/* Headless load generator.  Simulates many users from one process, each
+ * with its own UDP socket, spread round-robin over the given servers.
+ *
+ * Every user logs in and joins -j channels drawn from a uniform or zipf
+ * distribution.  After a settle period (so S2S joins can spread through
+ * the mesh), SAYs are sent from random users at -r per second, plus
+ * WHO and LIST at their own rates.  Each SAY carries its send time.
+ * Every receiver records the delivery latency under the server it is
+ * connected to.  With -O only the users on one server send, so in a
+ * multi-hop mesh each server's numbers are for one hop distance.  With
+ * -V 2 every request is sent in wire version 2 (see wire.h), which lets
+ * -s go up to WIRE_TEXT_MAX; the servers must speak it.
+ *
+ * Usage: ./loadgen [options] <server_ip> <port> [<server_ip> <port>]...
+ */
+
+#define LOADGEN_MAX_SERVERS 64
+#define LOADGEN_TICK_MS 1
+//log-linear latency histogram in microseconds: exact below 64, then 32 buckets per power of two
+#define HIST_BUCKETS (64 + 32 * 32)
+
+typedef struct Histogram {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} Histogram;
+
+typedef struct Server {
+    struct sockaddr_in addr;
+    char name[64];
+    int users;
+    Histogram latency;
+    uint64_t delivered;
+    uint64_t who_replies;
+    uint64_t list_replies;
+    uint64_t errors;
+} Server;
+
+typedef struct LoadUser {
+    int fd;
+    int server;
+    int *channels;
+    int channel_count;
+} LoadUser;
+
+Server servers[LOADGEN_MAX_SERVERS];
+int server_count = 0;
+LoadUser *load_users = NULL;
+int user_total = 100;
+int channel_total = 10;
+int joins_per_user = 1;
+int zipf = 0;
+double zipf_exponent = 1.0;
+double say_rate = 1000;
+double who_rate = 0;
+double list_rate = 0;
+int duration_s = 10;
+int payload_size = 32;
+int settle_ms = 500;
+int drain_ms = 1000;
+int json = 0;
+//only users on this server send SAYs, so latency can be read per hop count; -1 for all
+int origin_server = -1;
+int wire_version = WIRE_V1;
+
+//members per channel, to know how many deliveries each SAY should produce
+int *channel_members = NULL;
+double *zipf_cdf = NULL;
+uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+uint64_t says_sent = 0;
+uint64_t deliveries_expected = 0;
+uint64_t whos_sent = 0;
+uint64_t lists_sent = 0;
+uint64_t send_failures = 0;
+uint64_t malformed = 0;
+uint64_t run_start_ns = 0;
+uint64_t run_end_ns = 0;
+
+uint64_t monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+uint64_t next_random() {
+    //xorshift64*, seeded with -R so runs can be repeated
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+double random_unit() {
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int hist_bucket(uint64_t value) {
+    if (value < 64) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb > 36) {
+        return HIST_BUCKETS - 1;
+    }
+    return 64 + (msb - 6) * 32 + (int)((value >> (msb - 5)) - 32);
+}
+
+//upper bound of a bucket, what a percentile reports
+uint64_t hist_bucket_value(int bucket) {
+    if (bucket < 64) {
+        return (uint64_t)bucket;
+    }
+    int msb = (bucket - 64) / 32 + 6;
+    uint64_t sub = (uint64_t)((bucket - 64) % 32 + 32);
+    return ((sub + 1) << (msb - 5)) - 1;
+}
+
+void hist_add(Histogram *hist, uint64_t value) {
+    hist->buckets[hist_bucket(value)]++;
+    hist->count++;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+void hist_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t hist_percentile(const Histogram *hist, double percentile) {
+    if (hist->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(percentile / 100.0 * hist->count);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int pick_channel() {
+    if (!zipf) {
+        return (int)(next_random() % channel_total);
+    }
+    double u = random_unit();
+    int low = 0, high = channel_total - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (zipf_cdf[mid] < u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void build_zipf() {
+    zipf_cdf = (double*)malloc(channel_total * sizeof(double));
+    double total = 0;
+    for (int i = 0; i < channel_total; i++) {
+        total += 1.0 / pow(i + 1, zipf_exponent);
+        zipf_cdf[i] = total;
+    }
+    for (int i = 0; i < channel_total; i++) {
+        zipf_cdf[i] /= total;
+    }
+}
+
+void channel_name(int channel, char *out) {
+    memset(out, 0, CHANNEL_MAX);
+    snprintf(out, CHANNEL_MAX, "lg%d", channel);
+}
+
+int send_to_server(LoadUser *user, const WireMessage *request) {
+    Server *server = &servers[user->server];
+    char message[1024];
+    size_t len = wire_encode(wire_version, request, message, sizeof(message));
+    if (len == 0 || sendto(user->fd, message, len, 0, (struct sockaddr*)&server->addr, sizeof(server->addr)) < 0) {
+        send_failures++;
+        return -1;
+    }
+    return 0;
+}
+
+void receive_replies(int fd, uint32_t events, void *arg) {
+    LoadUser *user = (LoadUser*)arg;
+    Server *server = &servers[user->server];
+    char buffer[65536];
+    while (1) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0) {
+            break;
+        }
+        WireMessage reply;
+        if (wire_decode(buffer, n, 1, &reply) < 0) {
+            malformed++;
+            continue;
+        }
+        switch (reply.type) {
+            case WIRE_TEXT | TXT_SAY: {
+                //only the leading send time is needed
+                char text[32];
+                size_t text_len = reply.text_len < sizeof(text) - 1 ? reply.text_len : sizeof(text) - 1;
+                memcpy(text, reply.text, text_len);
+                text[text_len] = '\0';
+                unsigned long long sent_ns;
+                if (sscanf(text, "%llu", &sent_ns) != 1) {
+                    malformed++;
+                    break;
+                }
+                uint64_t now = monotonic_ns();
+                hist_add(&server->latency, now > sent_ns ? (now - sent_ns) / 1000 : 0);
+                server->delivered++;
+                break;
+            }
+            //a paginated reply counts once, on its last page
+            case WIRE_TEXT | TXT_WHO:
+                server->who_replies += !reply.more;
+                break;
+            case WIRE_TEXT | TXT_LIST:
+                server->list_replies += !reply.more;
+                break;
+            case WIRE_TEXT | TXT_ERROR:
+                server->errors++;
+                break;
+            default:
+                malformed++;
+        }
+    }
+}
+
+void send_say() {
+    LoadUser *user;
+    if (origin_server >= 0) {
+        //users are dealt round-robin, so the origin's users are every server_count-th one
+        user = &load_users[origin_server + server_count * (next_random() % servers[origin_server].users)];
+    } else {
+        user = &load_users[next_random() % user_total];
+    }
+    int channel = user->channels[next_random() % user->channel_count];
+    WireMessage say;
+    wire_message(&say, REQ_SAY);
+    channel_name(channel, say.channel);
+    //send time first, then padding up to the payload size
+    char text[WIRE_TEXT_MAX];
+    int max = wire_version == WIRE_V2 ? WIRE_TEXT_MAX : SAY_MAX - 1;
+    int len = snprintf(text, sizeof(text), "%llu ", (unsigned long long)monotonic_ns());
+    while (len < payload_size && len < max) {
+        text[len++] = 'x';
+    }
+    say.text = text;
+    say.text_len = len;
+    if (send_to_server(user, &say) == 0) {
+        says_sent++;
+        deliveries_expected += channel_members[channel];
+    }
+}
+
+void send_who() {
+    LoadUser *user = &load_users[next_random() % user_total];
+    WireMessage who;
+    wire_message(&who, REQ_WHO);
+    channel_name(user->channels[next_random() % user->channel_count], who.channel);
+    if (send_to_server(user, &who) == 0) {
+        whos_sent++;
+    }
+}
+
+void send_list() {
+    LoadUser *user = &load_users[next_random() % user_total];
+    WireMessage list;
+    wire_message(&list, REQ_LIST);
+    if (send_to_server(user, &list) == 0) {
+        lists_sent++;
+    }
+}
+
+//sends whatever the configured rates say should have gone out by now
+void pace(int timer_fd, uint32_t expirations, void *arg) {
+    uint64_t now = monotonic_ns();
+    if (now >= run_end_ns) {
+        event_stop();
+        return;
+    }
+    double elapsed = (now - run_start_ns) / 1e9;
+    while (says_sent < (uint64_t)(say_rate * elapsed)) {
+        send_say();
+    }
+    while (whos_sent < (uint64_t)(who_rate * elapsed)) {
+        send_who();
+    }
+    while (lists_sent < (uint64_t)(list_rate * elapsed)) {
+        send_list();
+    }
+}
+
+void stop_loop(int timer_fd, uint32_t expirations, void *arg) {
+    event_stop();
+}
+
+//runs the event loop for ms milliseconds, delivering replies as they come
+void run_for(long ms) {
+    int timer = event_add_timer(ms > 0 ? ms : 1, 0, stop_loop, NULL);
+    event_run();
+    event_del_fd(timer);
+}
+
+void raise_fd_limit(int needed) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)needed) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)needed ? limit.rlim_max : (rlim_t)needed;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int setup_users() {
+    load_users = (LoadUser*)calloc(user_total, sizeof(LoadUser));
+    channel_members = (int*)calloc(channel_total, sizeof(int));
+    if (!load_users || !channel_members) {
+        return -1;
+    }
+    for (int i = 0; i < user_total; i++) {
+        LoadUser *user = &load_users[i];
+        user->server = i % server_count;
+        servers[user->server].users++;
+        user->fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (user->fd < 0) {
+            perror("socket creation failed");
+            return -1;
+        }
+        fcntl(user->fd, F_SETFL, fcntl(user->fd, F_GETFL, 0) | O_NONBLOCK);
+        if (event_add_fd(user->fd, EPOLLIN, receive_replies, user) < 0) {
+            perror("epoll registration failed");
+            return -1;
+        }
+
+        WireMessage login;
+        wire_message(&login, REQ_LOGIN);
+        snprintf(login.username, USERNAME_MAX, "lg%d", i);
+        send_to_server(user, &login);
+
+        //distinct channels, so member counts match what the server sees
+        user->channels = (int*)malloc(joins_per_user * sizeof(int));
+        while (user->channel_count < joins_per_user) {
+            int channel = pick_channel();
+            int duplicate = 0;
+            for (int j = 0; j < user->channel_count; j++) {
+                if (user->channels[j] == channel) {
+                    duplicate = 1;
+                }
+            }
+            if (duplicate) {
+                continue;
+            }
+            user->channels[user->channel_count++] = channel;
+            channel_members[channel]++;
+            WireMessage join;
+            wire_message(&join, REQ_JOIN);
+            channel_name(channel, join.channel);
+            send_to_server(user, &join);
+        }
+        //let the servers keep up instead of overflowing their socket buffers
+        if (i % 64 == 63) {
+            run_for(2);
+        }
+    }
+    return 0;
+}
+
+void logout_users() {
+    WireMessage logout;
+    wire_message(&logout, REQ_LOGOUT);
+    for (int i = 0; i < user_total; i++) {
+        send_to_server(&load_users[i], &logout);
+        if (i % 64 == 63) {
+            run_for(1);
+        }
+        close(load_users[i].fd);
+    }
+}
+
+void print_report() {
+    double seconds = (run_end_ns - run_start_ns) / 1e9;
+    Histogram total;
+    memset(&total, 0, sizeof(total));
+    uint64_t delivered = 0;
+    for (int i = 0; i < server_count; i++) {
+        hist_merge(&total, &servers[i].latency);
+        delivered += servers[i].delivered;
+    }
+    double delivery_ratio = deliveries_expected ? (double)delivered / deliveries_expected : 0;
+
+    if (json) {
+        printf("{\"users\": %d, \"channels\": %d, \"joins_per_user\": %d, \"distribution\": \"%s\", "
+               "\"duration_s\": %.3f, \"says_sent\": %llu, \"say_rate\": %.1f, "
+               "\"deliveries_expected\": %llu, \"deliveries\": %llu, \"delivery_ratio\": %.6f, "
+               "\"delivery_rate\": %.1f, \"send_failures\": %llu, \"malformed\": %llu, "
+               "\"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, \"servers\": [",
+               user_total, channel_total, joins_per_user, zipf ? "zipf" : "uniform", seconds,
+               (unsigned long long)says_sent, says_sent / seconds,
+               (unsigned long long)deliveries_expected, (unsigned long long)delivered, delivery_ratio,
+               delivered / seconds, (unsigned long long)send_failures, (unsigned long long)malformed,
+               (unsigned long long)hist_percentile(&total, 50), (unsigned long long)hist_percentile(&total, 99),
+               (unsigned long long)hist_percentile(&total, 99.9), (unsigned long long)total.max);
+        for (int i = 0; i < server_count; i++) {
+            Server *server = &servers[i];
+            printf("%s{\"server\": \"%s\", \"users\": %d, \"deliveries\": %llu, \"delivery_rate\": %.1f, "
+                   "\"who_replies\": %llu, \"list_replies\": %llu, \"errors\": %llu, "
+                   "\"latency_us\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+                   i ? ", " : "", server->name, server->users, (unsigned long long)server->delivered,
+                   server->delivered / seconds, (unsigned long long)server->who_replies,
+                   (unsigned long long)server->list_replies, (unsigned long long)server->errors,
+                   (unsigned long long)hist_percentile(&server->latency, 50),
+                   (unsigned long long)hist_percentile(&server->latency, 99),
+                   (unsigned long long)hist_percentile(&server->latency, 99.9),
+                   (unsigned long long)server->latency.max);
+        }
+        printf("]}\n");
+        return;
+    }
+
+    printf("%d users, %d channels (%s), %d joins each, %.1fs\n", user_total, channel_total,
+           zipf ? "zipf" : "uniform", joins_per_user, seconds);
+    printf("sent %llu says (%.1f/s), %llu who, %llu list, %llu send failures\n",
+           (unsigned long long)says_sent, says_sent / seconds, (unsigned long long)whos_sent,
+           (unsigned long long)lists_sent, (unsigned long long)send_failures);
+    printf("delivered %llu of %llu expected (%.2f%%), %.1f msgs/s\n",
+           (unsigned long long)delivered, (unsigned long long)deliveries_expected,
+           delivery_ratio * 100.0, delivered / seconds);
+    printf("%-22s %6s %10s %10s %8s %8s %8s %8s %6s %6s %6s\n", "server", "users", "delivered", "msgs/s",
+           "p50us", "p99us", "p999us", "maxus", "who", "list", "error");
+    for (int i = 0; i < server_count; i++) {
+        Server *server = &servers[i];
+        printf("%-22s %6d %10llu %10.1f %8llu %8llu %8llu %8llu %6llu %6llu %6llu\n", server->name, server->users,
+               (unsigned long long)server->delivered, server->delivered / seconds,
+               (unsigned long long)hist_percentile(&server->latency, 50),
+               (unsigned long long)hist_percentile(&server->latency, 99),
+               (unsigned long long)hist_percentile(&server->latency, 99.9),
+               (unsigned long long)server->latency.max, (unsigned long long)server->who_replies,
+               (unsigned long long)server->list_replies, (unsigned long long)server->errors);
+    }
+    printf("%-22s %6d %10llu %10.1f %8llu %8llu %8llu %8llu\n", "all", user_total,
+           (unsigned long long)delivered, delivered / seconds,
+           (unsigned long long)hist_percentile(&total, 50), (unsigned long long)hist_percentile(&total, 99),
+           (unsigned long long)hist_percentile(&total, 99.9), (unsigned long long)total.max);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-c channels] [-j joins_per_user] [-d uniform|zipf] [-z zipf_exponent]\n"
+                    "       [-r says_per_second] [-W whos_per_second] [-L lists_per_second] [-t seconds]\n"
+                    "       [-s payload_bytes] [-S settle_ms] [-D drain_ms] [-R seed] [-O origin_server] [-V 1|2] [-J]\n"
+                    "       <server_ip> <port> [<server_ip> <port>]...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:c:j:d:z:r:W:L:t:s:S:D:R:O:V:J")) != -1) {
+        switch (opt) {
+            case 'u': user_total = atoi(optarg); break;
+            case 'c': channel_total = atoi(optarg); break;
+            case 'j': joins_per_user = atoi(optarg); break;
+            case 'd':
+                if (strcmp(optarg, "zipf") == 0) {
+                    zipf = 1;
+                } else if (strcmp(optarg, "uniform") != 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'z': zipf_exponent = atof(optarg); break;
+            case 'r': say_rate = atof(optarg); break;
+            case 'W': who_rate = atof(optarg); break;
+            case 'L': list_rate = atof(optarg); break;
+            case 't': duration_s = atoi(optarg); break;
+            case 's': payload_size = atoi(optarg); break;
+            case 'S': settle_ms = atoi(optarg); break;
+            case 'D': drain_ms = atoi(optarg); break;
+            case 'R': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+            case 'O': origin_server = atoi(optarg); break;
+            case 'V': wire_version = atoi(optarg); break;
+            case 'J': json = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    int positional = argc - optind;
+    if (positional < 2 || positional % 2 != 0 || positional / 2 > LOADGEN_MAX_SERVERS ||
+        user_total < 1 || channel_total < 1 || joins_per_user < 1 || duration_s < 1 || say_rate < 0 ||
+        origin_server >= positional / 2 || (origin_server >= 0 && user_total <= origin_server) ||
+        (wire_version != WIRE_V1 && wire_version != WIRE_V2)) {
+        usage(argv[0]);
+    }
+    if (joins_per_user > channel_total) {
+        joins_per_user = channel_total;
+    }
+
+    for (int i = optind; i < argc; i += 2) {
+        Server *server = &servers[server_count++];
+        const char *host = strcmp(argv[i], "localhost") == 0 ? "127.0.0.1" : argv[i];
+        server->addr.sin_family = AF_INET;
+        server->addr.sin_port = htons(atoi(argv[i + 1]));
+        if (inet_pton(AF_INET, host, &server->addr.sin_addr) != 1) {
+            fprintf(stderr, "bad server address %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        snprintf(server->name, sizeof(server->name), "%s:%s", host, argv[i + 1]);
+    }
+
+    raise_fd_limit(user_total + 64);
+    if (zipf) {
+        build_zipf();
+    }
+    if (event_init() < 0 || setup_users() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    //let joins spread through the server mesh before measuring
+    run_for(settle_ms);
+
+    run_start_ns = monotonic_ns();
+    run_end_ns = run_start_ns + (uint64_t)duration_s * 1000000000ULL;
+    int pacer = event_add_timer(LOADGEN_TICK_MS, LOADGEN_TICK_MS, pace, NULL);
+    if (pacer < 0) {
+        perror("timer setup failed");
+        exit(EXIT_FAILURE);
+    }
+    event_run();
+    event_del_fd(pacer);
+    run_end_ns = monotonic_ns();
+    run_for(drain_ms);
+
+    logout_users();
+    print_report();
+    return 0;
+}
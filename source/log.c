@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include "log.h"
+
+/* See log.h for usage information */
+
+#define LOG_RING_SIZE 8192 /* records, power of two */
+
+int log_runtime_level = LOG_LEVEL_INFO;
+
+static struct log_record ring[LOG_RING_SIZE];
+//head is written only by the producer, tail only by the writer thread
+static uint64_t ring_head = 0;
+static uint64_t ring_tail = 0;
+static unsigned long dropped = 0;
+
+static pthread_t writer;
+static int writer_running = 0;
+static int stopping = 0;
+//the writer blocks on wake_fd while the ring is empty, with sleeping set
+static int wake_fd = -1;
+static int sleeping = 0;
+static FILE *binary_out = NULL;
+
+static uint32_t local_addr = 0;
+static uint16_t local_port = 0;
+static uint8_t worker_index = 0;
+
+static const char *event_formats[] = {
+    "",
+    "send S2S Join %s",
+    "send S2S soft Join %s",
+    "recv S2S Join %s",
+    "send S2S Leave %s",
+    "recv S2S Leave %s",
+    "send S2S_SAY %s \"%s\"",
+    "recv S2S_SAY %s \"%s\"",
+    "recv duplicate S2S_SAY %s \"%s\"",
+    "send S2S Tree offer %s",
+    "recv S2S Tree offer %s",
+    "send S2S Tree link %s",
+    "recv S2S Tree link %s",
+};
+
+int log_format_record(const struct log_record *record, char *out, size_t size) {
+    if (record->event == LOG_EVENT_TEXT ||
+        record->event >= sizeof(event_formats) / sizeof(event_formats[0])) {
+        return snprintf(out, size, "%.*s", LOG_TEXT_MAX, record->text);
+    }
+
+    char local_ip[INET_ADDRSTRLEN];
+    char peer_ip[INET_ADDRSTRLEN];
+    struct in_addr addr;
+    addr.s_addr = record->local_addr;
+    inet_ntop(AF_INET, &addr, local_ip, sizeof(local_ip));
+    addr.s_addr = record->peer_addr;
+    inet_ntop(AF_INET, &addr, peer_ip, sizeof(peer_ip));
+
+    char channel[CHANNEL_MAX + 1];
+    char text[LOG_TEXT_MAX + 1];
+    memcpy(channel, record->channel, CHANNEL_MAX);
+    channel[CHANNEL_MAX] = '\0';
+    memcpy(text, record->text, LOG_TEXT_MAX);
+    text[LOG_TEXT_MAX] = '\0';
+
+    int n = snprintf(out, size, "%s:%d %s:%d ", local_ip, ntohs(record->local_port),
+                     peer_ip, ntohs(record->peer_port));
+    if (n < 0 || (size_t)n >= size) {
+        return n;
+    }
+    return n + snprintf(out + n, size - n, event_formats[record->event], channel, text);
+}
+
+static void write_record(const struct log_record *record) {
+    if (binary_out) {
+        fwrite(record, sizeof(*record), 1, binary_out);
+        return;
+    }
+    char line[LOG_TEXT_MAX + 2 * CHANNEL_MAX + 128];
+    log_format_record(record, line, sizeof(line));
+    fputs(line, stdout);
+    fputc('\n', stdout);
+}
+
+static void wake_writer(void) {
+    uint64_t one = 1;
+    while (write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+static void *writer_main(void *arg) {
+    while (1) {
+        uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring_tail;
+        if (tail == head) {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            //block until a record comes in, so a quiet server stays quiet;
+            //either the producer sees the flag or we see its record
+            __atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring_head, __ATOMIC_RELAXED) == tail &&
+                !__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+                uint64_t wakeups;
+                if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR) {
+                    abort();
+                }
+            }
+            __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        while (tail != head) {
+            write_record(&ring[tail & (LOG_RING_SIZE - 1)]);
+            tail++;
+        }
+        __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+        fflush(binary_out ? binary_out : stdout);
+    }
+    return NULL;
+}
+
+int log_init(int level, const char *binary_path, int worker) {
+    log_runtime_level = level;
+    worker_index = (uint8_t)worker;
+    if (binary_path) {
+        char path[512];
+        //one file per worker, each has its own writer
+        if (worker > 0) {
+            snprintf(path, sizeof(path), "%s.%d", binary_path, worker);
+        } else {
+            snprintf(path, sizeof(path), "%s", binary_path);
+        }
+        binary_out = fopen(path, "wb");
+        if (!binary_out) {
+            return -1;
+        }
+        fwrite(LOG_FILE_MAGIC, 1, strlen(LOG_FILE_MAGIC), binary_out);
+    }
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        return -1;
+    }
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    writer_running = 1;
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!writer_running) {
+        return;
+    }
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wake_writer();
+    pthread_join(writer, NULL);
+    writer_running = 0;
+    close(wake_fd);
+    wake_fd = -1;
+    if (binary_out) {
+        fclose(binary_out);
+        binary_out = NULL;
+    }
+}
+
+void log_set_local(const struct sockaddr_in *addr) {
+    local_addr = addr->sin_addr.s_addr;
+    local_port = addr->sin_port;
+}
+
+int log_level_from_name(const char *name) {
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+unsigned long log_dropped(void) {
+    return dropped;
+}
+
+//slot for the next record, or NULL if the writer has fallen a full ring behind
+static struct log_record *claim(int level, int event) {
+    uint64_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+    if (ring_head - tail >= LOG_RING_SIZE) {
+        dropped++;
+        return NULL;
+    }
+    struct log_record *record = &ring[ring_head & (LOG_RING_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    record->event = (uint16_t)event;
+    record->level = (uint8_t)level;
+    record->worker = worker_index;
+    record->local_addr = local_addr;
+    record->local_port = local_port;
+    return record;
+}
+
+static void publish(struct log_record *record) {
+    if (!writer_running) {
+        //no writer yet (startup, tools), write in place
+        write_record(record);
+        fflush(stdout);
+        return;
+    }
+    uint64_t old_head = ring_head;
+    __atomic_store_n(&ring_head, old_head + 1, __ATOMIC_RELEASE);
+    //only the record that ends an empty spell can find the writer asleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring_tail, __ATOMIC_RELAXED) == old_head &&
+        __atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+        wake_writer();
+    }
+}
+
+void log_text(int level, const char *format, ...) {
+    struct log_record *record = claim(level, LOG_EVENT_TEXT);
+    if (!record) {
+        return;
+    }
+    record->peer_addr = 0;
+    record->peer_port = 0;
+    record->channel[0] = '\0';
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, LOG_TEXT_MAX, format, args);
+    va_end(args);
+    publish(record);
+}
+
+void log_event(int level, int event, const struct sockaddr_in *peer,
+               const char *channel, const char *text, size_t text_len) {
+    struct log_record *record = claim(level, event);
+    if (!record) {
+        return;
+    }
+    record->peer_addr = peer ? peer->sin_addr.s_addr : 0;
+    record->peer_port = peer ? peer->sin_port : 0;
+    strncpy(record->channel, channel ? channel : "", CHANNEL_MAX);
+    if (text) {
+        //text from the wire may not be terminated
+        size_t len = strnlen(text, text_len < LOG_TEXT_MAX - 1 ? text_len : LOG_TEXT_MAX - 1);
+        memcpy(record->text, text, len);
+        record->text[len] = '\0';
+    } else {
+        record->text[0] = '\0';
+    }
+    publish(record);
+}
@@ -0,0 +1,122 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+
+/* Asynchronous, leveled logging.
+ *
+ * Log sites never touch stdio.  They copy a fixed-size record into a
+ * single-producer/single-consumer ring and return; a background writer
+ * thread drains the ring and either formats the records as text on
+ * stdout or appends them raw to a binary log file (-b).  Binary logs are
+ * turned back into the usual text by the logdecode tool.  If the ring is
+ * full the record is dropped and counted rather than blocking the
+ * packet path.
+ *
+ * The S2S trace lines ("send S2S Join", "recv S2S_SAY", ...) are logged
+ * as structured events: the producer only copies the addresses and
+ * channel, and inet_ntoa/printf run on the writer thread (or in
+ * logdecode).  Everything else goes through log_error/log_warn/
+ * log_info/log_debug with printf-style arguments.
+ *
+ * Each process (each worker in -w mode) has its own ring and writer, so
+ * call log_init() after forking.
+ */
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/* Sites above this level are compiled out entirely. */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_EVENT_TEXT 0
+#define LOG_EVENT_S2S_JOIN_SEND 1
+#define LOG_EVENT_S2S_SOFT_JOIN_SEND 2
+#define LOG_EVENT_S2S_JOIN_RECV 3
+#define LOG_EVENT_S2S_LEAVE_SEND 4
+#define LOG_EVENT_S2S_LEAVE_RECV 5
+#define LOG_EVENT_S2S_SAY_SEND 6
+#define LOG_EVENT_S2S_SAY_RECV 7
+#define LOG_EVENT_S2S_SAY_DUPLICATE 8
+#define LOG_EVENT_TREE_OFFER_SEND 9
+#define LOG_EVENT_TREE_OFFER_RECV 10
+#define LOG_EVENT_TREE_LINK_SEND 11
+#define LOG_EVENT_TREE_LINK_RECV 12
+
+#define LOG_TEXT_MAX 160
+
+/* One ring slot, and one record in a binary log file.  Addresses and
+ * ports are kept in network byte order. */
+struct log_record {
+    uint64_t time_ns;
+    uint16_t event;
+    uint8_t level;
+    uint8_t worker;
+    uint32_t local_addr;
+    uint16_t local_port;
+    uint32_t peer_addr;
+    uint16_t peer_port;
+    char channel[CHANNEL_MAX];
+    char text[LOG_TEXT_MAX];
+} packed;
+
+/* Binary log files start with this magic, then whole records. */
+#define LOG_FILE_MAGIC "DUCKLOG1"
+
+/* Starts the writer thread.  binary_path NULL logs text to stdout.
+ * Returns -1 on error. */
+int log_init(int level, const char *binary_path, int worker);
+/* Drains the ring and stops the writer. */
+void log_shutdown(void);
+
+/* Local address printed as the first half of every trace line. */
+void log_set_local(const struct sockaddr_in *addr);
+
+int log_level_from_name(const char *name);
+extern int log_runtime_level;
+
+void log_text(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+/* Logs a trace event.  text may be NULL; otherwise it is cut at
+ * text_len bytes or LOG_TEXT_MAX - 1, and need not be terminated. */
+void log_event(int level, int event, const struct sockaddr_in *peer,
+               const char *channel, const char *text, size_t text_len);
+
+/* Records dropped because the ring was full. */
+unsigned long log_dropped(void);
+
+/* Formats a record as one text line (without newline).  Shared with
+ * logdecode. */
+int log_format_record(const struct log_record *record, char *out, size_t size);
+
+#define LOG_AT(level, ...) \
+    do { if ((level) <= log_runtime_level) log_text((level), __VA_ARGS__); } while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_trace(event, peer, channel) \
+    do { if (LOG_LEVEL_INFO <= log_runtime_level) log_event(LOG_LEVEL_INFO, (event), (peer), (channel), NULL, 0); } while (0)
+#define log_trace_text(event, peer, channel, text, text_len) \
+    do { if (LOG_LEVEL_INFO <= log_runtime_level) log_event(LOG_LEVEL_INFO, (event), (peer), (channel), (text), (text_len)); } while (0)
+#else
+#define log_info(...) do { } while (0)
+#define log_trace(event, peer, channel) do { } while (0)
+#define log_trace_text(event, peer, channel, text, text_len) do { } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+
+/* Turns a binary server log (server -b <file>) back into text.
+ *
+ * Usage: ./logdecode [-t] [-l level] <file>...
+ *   -t        prefix each line with its timestamp and worker
+ *   -l level  only print records at or above level (error..debug)
+ */
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+static int decode(const char *path, int timestamps, int max_level) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+    char magic[sizeof(LOG_FILE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, LOG_FILE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s: not a server binary log\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    struct log_record record;
+    char line[LOG_TEXT_MAX + 2 * CHANNEL_MAX + 128];
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        if (record.level > max_level) {
+            continue;
+        }
+        log_format_record(&record, line, sizeof(line));
+        if (timestamps) {
+            printf("%llu.%09llu w%d %s ",
+                   (unsigned long long)(record.time_ns / 1000000000ULL),
+                   (unsigned long long)(record.time_ns % 1000000000ULL),
+                   record.worker, record.level < 4 ? level_names[record.level] : "?");
+        }
+        printf("%s\n", line);
+    }
+    fclose(in);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int timestamps = 0;
+    int max_level = LOG_LEVEL_DEBUG;
+    int opt;
+    while ((opt = getopt(argc, argv, "tl:")) != -1) {
+        switch (opt) {
+            case 't':
+                timestamps = 1;
+                break;
+            case 'l':
+                max_level = log_level_from_name(optarg);
+                if (max_level < 0) {
+                    fprintf(stderr, "unknown level %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t] [-l level] <file>...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-t] [-l level] <file>...\n", argv[0]);
+        return 1;
+    }
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        if (decode(argv[i], timestamps, max_level) < 0) {
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "metrics.h"
+#include "event.h"
+
+/* See metrics.h for usage information */
+
+#define METRICS_SEND_TIMEOUT_MS 100
+
+Metrics metrics;
+
+static int listen_fd = -1;
+static char socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static metrics_render render = NULL;
+
+static const char *kind_names[METRICS_KINDS] = {
+    "login", "logout", "join", "leave", "say", "list", "who", "keep_alive",
+    "s2s_join", "s2s_leave", "s2s_say",
+    "txt_say", "txt_list", "txt_who", "txt_error",
+    "hello", "bundle", "tree", "reach", "unknown",
+};
+
+const char *metrics_kind_name(int kind) {
+    return kind >= 0 && kind < METRICS_KINDS ? kind_names[kind] : kind_names[METRICS_UNKNOWN];
+}
+
+static void append(MetricsWriter *out, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        size_t room = out->capacity - out->len;
+        int written = vsnprintf(out->data ? out->data + out->len : NULL, room, format, args);
+        va_end(args);
+        if (written < 0) {
+            return;
+        }
+        if ((size_t)written < room) {
+            out->len += written;
+            return;
+        }
+        size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+        while (capacity - out->len <= (size_t)written) {
+            capacity *= 2;
+        }
+        char *grown = (char *)realloc(out->data, capacity);
+        if (!grown) {
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+}
+
+static void type_line(MetricsWriter *out, const char *name, const char *type) {
+    if (!out->last_name || strcmp(out->last_name, name) != 0) {
+        append(out, "# TYPE %s %s\n", name, type);
+        out->last_name = name;
+    }
+}
+
+void metrics_counter(MetricsWriter *out, const char *name, const char *labels, uint64_t value) {
+    type_line(out, name, "counter");
+    if (labels) {
+        append(out, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+    } else {
+        append(out, "%s %llu\n", name, (unsigned long long)value);
+    }
+}
+
+void metrics_gauge(MetricsWriter *out, const char *name, const char *labels, double value) {
+    type_line(out, name, "gauge");
+    if (labels) {
+        append(out, "%s{%s} %.17g\n", name, labels, value);
+    } else {
+        append(out, "%s %.17g\n", name, value);
+    }
+}
+
+void metrics_histogram(MetricsWriter *out, const char *name, const MetricsHistogram *histogram) {
+    type_line(out, name, "histogram");
+    //buckets are stored per range, the format wants them cumulative
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+        cumulative += histogram->buckets[i];
+        append(out, "%s_bucket{le=\"%llu\"} %llu\n", name,
+               i == 0 ? 0ULL : 1ULL << (i - 1), (unsigned long long)cumulative);
+    }
+    append(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)histogram->count);
+    append(out, "%s_sum %llu\n", name, (unsigned long long)histogram->sum);
+    append(out, "%s_count %llu\n", name, (unsigned long long)histogram->count);
+}
+
+static void serve(int client) {
+    //a reader that stops reading may only hold the loop up briefly
+    struct timeval timeout = {0, METRICS_SEND_TIMEOUT_MS * 1000};
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    MetricsWriter out;
+    memset(&out, 0, sizeof(out));
+    render(&out);
+    size_t sent = 0;
+    while (sent < out.len) {
+        ssize_t n = send(client, out.data + sent, out.len - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    free(out.data);
+}
+
+static void accept_scrapes(int fd, uint32_t events, void *arg) {
+    int client;
+    while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        serve(client);
+        close(client);
+    }
+}
+
+int metrics_init(const char *path, int worker, metrics_render render_report) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    //one socket per worker, like the binary log
+    int len = worker > 0 ? snprintf(socket_path, sizeof(socket_path), "%s.%d", path, worker)
+                         : snprintf(socket_path, sizeof(socket_path), "%s", path);
+    if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+        socket_path[0] = '\0';
+        return -1;
+    }
+    memcpy(addr.sun_path, socket_path, len + 1);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 16) < 0 ||
+        event_add_fd(listen_fd, EPOLLIN, accept_scrapes, NULL) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    render = render_report;
+    return 0;
+}
+
+void metrics_shutdown(void) {
+    if (listen_fd >= 0) {
+        event_del_fd(listen_fd);
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(socket_path);
+    }
+}
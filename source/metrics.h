@@ -0,0 +1,114 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Live counters and histograms, scraped over a local control socket.
+ *
+ * The packet path only bumps plain counters in the global `metrics`
+ * struct (inline, no locking: each process, each worker in -w mode, has
+ * its own copy).  Everything else, such as object counts, memory, and
+ * the other modules' stats, is gathered when somebody reads the socket.
+ *
+ * With -m <path> the server listens on a unix stream socket at <path>
+ * (<path>.N for worker N).  Every connection gets one report in the
+ * Prometheus text format and is then closed:
+ *
+ *   $ socat - UNIX-CONNECT:/tmp/duckchat.metrics
+ *
+ * The report is written by the render callback given to metrics_init()
+ * through the metrics_counter/metrics_gauge/metrics_histogram helpers.
+ */
+
+/* Message kinds for the per-type counters.  Requests keep their
+ * req_type; replies to clients follow them.  Messages that came in a
+ * BUNDLE are counted under their own kind as well as under bundle. */
+#define METRICS_TXT_SAY 11
+#define METRICS_TXT_LIST 12
+#define METRICS_TXT_WHO 13
+#define METRICS_TXT_ERROR 14
+#define METRICS_HELLO 15
+#define METRICS_BUNDLE 16
+#define METRICS_TREE 17
+#define METRICS_REACH 18
+#define METRICS_UNKNOWN 19
+#define METRICS_KINDS 20
+
+/* Bucket i counts values <= 2^(i-1) (bucket 0 counts zeros); the last
+ * bucket counts everything larger. */
+#define METRICS_BUCKETS 14
+
+typedef struct MetricsHistogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+} MetricsHistogram;
+
+typedef struct Metrics {
+    uint64_t received[METRICS_KINDS];
+    uint64_t received_bytes[METRICS_KINDS];
+    uint64_t sent[METRICS_KINDS];
+    uint64_t sent_bytes[METRICS_KINDS];
+    MetricsHistogram say_users;      /* local users each SAY went to */
+    MetricsHistogram say_neighbors;  /* neighbors each SAY was forwarded to */
+    uint64_t prunes;                 /* leaves sent because nothing here needs the channel */
+    uint64_t expiries;               /* subscriptions expired without a join */
+    uint64_t received_v2;            /* datagrams in protocol version 2 */
+    uint64_t reply_cache_hits;       /* LIST/WHO answered from cached pages */
+    uint64_t reply_cache_builds;     /* LIST/WHO pages rebuilt after a change */
+    uint64_t tree_links;             /* tree links made, with -T */
+    uint64_t tree_loops;             /* offers of a tree already joined, links not made */
+    uint64_t tree_switches;          /* trees left for an older one */
+    uint64_t core_moves;             /* channels whose way to their core moved, with -R */
+} Metrics;
+
+extern Metrics metrics;
+
+static inline int metrics_kind(int req_type) {
+    return req_type >= 0 && req_type < METRICS_HELLO ? req_type : METRICS_UNKNOWN;
+}
+
+static inline void metrics_received(int kind, size_t len) {
+    metrics.received[kind]++;
+    metrics.received_bytes[kind] += len;
+}
+
+static inline void metrics_sent(int kind, size_t len, uint64_t count) {
+    metrics.sent[kind] += count;
+    metrics.sent_bytes[kind] += len * count;
+}
+
+static inline void metrics_observe(MetricsHistogram *histogram, uint64_t value) {
+    int bucket = value <= 1 ? (int)value : 2 + (63 - __builtin_clzll(value - 1));
+    histogram->buckets[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+const char *metrics_kind_name(int kind);
+
+/* Output being built for one scrape. */
+typedef struct MetricsWriter {
+    char *data;
+    size_t len;
+    size_t capacity;
+    const char *last_name; /* so # TYPE is written once per metric */
+} MetricsWriter;
+
+/* labels is either NULL or the inside of the braces, e.g. type="say". */
+void metrics_counter(MetricsWriter *out, const char *name, const char *labels, uint64_t value);
+void metrics_gauge(MetricsWriter *out, const char *name, const char *labels, double value);
+void metrics_histogram(MetricsWriter *out, const char *name, const MetricsHistogram *histogram);
+
+typedef void (*metrics_render)(MetricsWriter *out);
+
+/* Listens on path (path.N for worker > 0) and registers the socket with
+ * the event loop, so call it after event_init().  A stale socket file
+ * at path is replaced.  Returns -1 on error. */
+int metrics_init(const char *path, int worker, metrics_render render);
+/* Removes the socket file.  The server calls it once SIGINT or SIGTERM
+ * has stopped the event loop. */
+void metrics_shutdown(void);
+
+#endif
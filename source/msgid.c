@@ -0,0 +1,47 @@
+#include <string.h>
+#include <time.h>
+#include "msgid.h"
+
+/* See msgid.h for usage information */
+
+#define MSGID_SEQUENCE_BITS 44
+#define MSGID_SEQUENCE_MASK ((1ULL << MSGID_SEQUENCE_BITS) - 1)
+#define MSGID_NODE_MASK ((1U << (64 - MSGID_SEQUENCE_BITS)) - 1)
+
+static uint64_t prefix = 0;
+static uint64_t sequence = 0;
+
+uint32_t msgid_node(const char *host, int port, int worker) {
+    //FNV-1a over host:port:worker
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; host && host[i]; i++) {
+        hash ^= (unsigned char)host[i];
+        hash *= 16777619U;
+    }
+    uint32_t extra[2] = {(uint32_t)port, (uint32_t)worker};
+    const unsigned char *bytes = (const unsigned char *)extra;
+    for (size_t i = 0; i < sizeof(extra); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619U;
+    }
+    //fold the high bits down so all 32 bits feed the prefix
+    return (hash ^ (hash >> 20)) & MSGID_NODE_MASK;
+}
+
+void msgid_init(uint32_t node) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t micros = (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_nsec / 1000ULL;
+    prefix = (uint64_t)(node & MSGID_NODE_MASK) << MSGID_SEQUENCE_BITS;
+    sequence = micros & MSGID_SEQUENCE_MASK;
+}
+
+uint64_t msgid_next(void) {
+    sequence = (sequence + 1) & MSGID_SEQUENCE_MASK;
+    return prefix | sequence;
+}
+
+uint64_t msgid_next_ordered(void) {
+    uint64_t id = msgid_next();
+    return (id << (64 - MSGID_SEQUENCE_BITS)) | (id >> MSGID_SEQUENCE_BITS);
+}
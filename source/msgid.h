@@ -0,0 +1,45 @@
+#ifndef MSGID_H
+#define MSGID_H
+
+#include <stdint.h>
+
+/* S2S_SAY ids, generated without syscalls.
+ *
+ * An id is a 20-bit node prefix followed by a 44-bit sequence number:
+ *
+ *     | node (20) | sequence (44) |
+ *
+ * The node prefix is a hash of the server's host, port and worker index,
+ * so different servers (and workers) draw from different id spaces.
+ * The sequence starts at the wall clock in microseconds when the server
+ * starts and then counts up by one per id.
+ *
+ * Uniqueness:
+ *   - within one run, ids never repeat until the sequence wraps, which
+ *     takes 2^44 ids (about 200 days at a million SAYs a second);
+ *   - across restarts of the same server, a new run starts its sequence
+ *     ahead of every id the old run produced as long as the old run
+ *     averaged less than one id per microsecond, so loop detection never
+ *     mistakes a new message for an old one;
+ *   - across servers, two ids can only match if the servers' prefixes
+ *     collide (probability about n^2 / 2^21 for n servers) and their
+ *     sequences reach the same value inside one dedup window.
+ */
+
+/* Node prefix for a server bound to host:port, plus worker index. */
+uint32_t msgid_node(const char *host, int port, int worker);
+
+/* Sets the node prefix and seeds the sequence from the clock. */
+void msgid_init(uint32_t node);
+
+/* Next id.  No syscalls, no locking (the server is single threaded
+ * per worker). */
+uint64_t msgid_next(void);
+
+/* Next id with its halves swapped, | sequence (44) | node (20) |, so
+ * ids taken earlier compare lower across servers (as far as their
+ * clocks agree).  Used to number channel trees, where the older tree
+ * wins. */
+uint64_t msgid_next_ordered(void);
+
+#endif
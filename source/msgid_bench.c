@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include "msgid.h"
+
+/* Microbenchmark for S2S_SAY id generation.  Compares msgid_next() with
+ * the old approach of reading 8 bytes from /dev/urandom per id.
+ *
+ * Usage: ./msgid_bench [ids]
+ */
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint64_t urandom_id() {
+    uint64_t id;
+    FILE *urandom = fopen("/dev/urandom", "r");
+    if (fread(&id, sizeof(id), 1, urandom) != 1) {
+        id = 0;
+    }
+    fclose(urandom);
+    return id;
+}
+
+int main(int argc, char *argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 100000000L;
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [ids]\n", argv[0]);
+        return 1;
+    }
+    //the urandom path is thousands of times slower, give it a smaller run
+    long slow_count = count / 1000 > 0 ? count / 1000 : 1;
+
+    msgid_init(msgid_node("127.0.0.1", 4000, 0));
+    struct timespec start;
+    volatile uint64_t sink = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++) {
+        sink ^= msgid_next();
+    }
+    double fast = elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < slow_count; i++) {
+        sink ^= urandom_id();
+    }
+    double slow = elapsed(&start);
+
+    double fast_rate = count / fast;
+    double slow_rate = slow_count / slow;
+    printf("msgid_next:   %ld ids in %.3fs, %.0f ids/sec\n", count, fast, fast_rate);
+    printf("/dev/urandom: %ld ids in %.3fs, %.0f ids/sec\n", slow_count, slow, slow_rate);
+    printf("speedup:      %.0fx\n", fast_rate / slow_rate);
+    return sink == 42 ? 2 : 0;
+}
@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+#include "netio.h"
+#include "uring.h"
+#include "pipeline.h"
+#include "backlog.h"
+#include "log.h"
+
+/* See netio.h for usage information */
+
+//outgoing bytes are packed into one arena so the batch needs no per-datagram malloc
+#define NET_ARENA_SIZE (256 * 1024)
+//headers built for zero-copy frames, kept until net_flush()
+#define NET_FRAME_AREA_SIZE (64 * 1024)
+
+static int batch_size = 0;
+
+static struct mmsghdr *recv_msgs = NULL;
+static struct iovec *recv_iovs = NULL;
+static char *recv_buffers = NULL;
+static NetPacket *recv_packets = NULL;
+
+static struct mmsghdr *send_msgs = NULL;
+//the backlog is sent from its own batch, it may be drained while send_msgs is being filled
+static struct mmsghdr *drain_msgs = NULL;
+static struct iovec *drain_iovs = NULL;
+static struct iovec *send_iovs = NULL;
+static struct sockaddr_in *send_addrs = NULL;
+static char *send_arena = NULL;
+static size_t arena_used = 0;
+static char *frame_area = NULL;
+static size_t frame_used = 0;
+static int send_count = 0;
+static int send_fd = -1;
+//-U: the server socket goes through io_uring instead of recvmmsg/sendmmsg
+static int use_uring = 0;
+//-S: receive and send threads around the event loop
+static int use_pipeline = 0;
+
+static NetStats stats;
+static net_writable_callback writable_callback = NULL;
+static int want_writable = 0;
+
+int net_init(int size) {
+    if (size <= 0) size = NET_DEFAULT_BATCH;
+    if (size > NET_MAX_BATCH) size = NET_MAX_BATCH;
+    batch_size = size;
+
+    recv_msgs = (struct mmsghdr *)calloc(size, sizeof(struct mmsghdr));
+    recv_iovs = (struct iovec *)calloc(size, sizeof(struct iovec));
+    recv_buffers = (char *)malloc((size_t)size * NET_RECV_BUFFER);
+    recv_packets = (NetPacket *)calloc(size, sizeof(NetPacket));
+    //sends fan out, so the send side holds more datagrams than one receive batch
+    send_msgs = (struct mmsghdr *)calloc(NET_MAX_BATCH, sizeof(struct mmsghdr));
+    send_iovs = (struct iovec *)calloc(NET_MAX_BATCH * NET_MAX_IOV, sizeof(struct iovec));
+    send_addrs = (struct sockaddr_in *)calloc(NET_MAX_BATCH, sizeof(struct sockaddr_in));
+    drain_msgs = (struct mmsghdr *)calloc(NET_MAX_BATCH, sizeof(struct mmsghdr));
+    drain_iovs = (struct iovec *)calloc(NET_MAX_BATCH, sizeof(struct iovec));
+    send_arena = (char *)malloc(NET_ARENA_SIZE);
+    frame_area = (char *)malloc(NET_FRAME_AREA_SIZE);
+    if (!recv_msgs || !recv_iovs || !recv_buffers || !recv_packets ||
+        !send_msgs || !send_iovs || !send_addrs || !drain_msgs || !drain_iovs || !send_arena || !frame_area) {
+        return -1;
+    }
+    memset(&stats, 0, sizeof(stats));
+    return 0;
+}
+
+int net_use_uring(int sockfd) {
+    if (uring_init(sockfd, batch_size) < 0) {
+        return -1;
+    }
+    use_uring = 1;
+    return 0;
+}
+
+int net_use_pipeline(int sockfd, int threads) {
+    if (pipeline_start(sockfd, batch_size, threads) < 0) {
+        return -1;
+    }
+    use_pipeline = 1;
+    return 0;
+}
+
+int net_poll_fd(int sockfd) {
+    if (use_pipeline) {
+        return pipeline_event_fd();
+    }
+    return use_uring ? uring_event_fd() : sockfd;
+}
+
+const char *net_backend(void) {
+    if (use_pipeline) {
+        return "pipeline";
+    }
+    return use_uring ? "io_uring" : "recvmmsg";
+}
+
+int net_recv_batch(int sockfd, NetPacket **packets) {
+    if (use_pipeline) {
+        //the receive thread counts its own calls and packets
+        *packets = recv_packets;
+        return pipeline_recv(recv_packets, batch_size);
+    }
+    if (use_uring) {
+        int n = uring_recv(recv_packets, batch_size, &stats);
+        if (n > 0) {
+            stats.recv_packets += n;
+            *packets = recv_packets;
+        }
+        return n;
+    }
+    for (int i = 0; i < batch_size; i++) {
+        recv_iovs[i].iov_base = recv_buffers + (size_t)i * NET_RECV_BUFFER;
+        recv_iovs[i].iov_len = NET_RECV_BUFFER;
+        memset(&recv_msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+        recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        recv_msgs[i].msg_hdr.msg_name = &recv_packets[i].addr;
+        recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    stats.recv_calls++;
+    int n = recvmmsg(sockfd, recv_msgs, batch_size, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        recv_packets[i].addr_len = recv_msgs[i].msg_hdr.msg_namelen;
+        recv_packets[i].len = recv_msgs[i].msg_len;
+        recv_packets[i].data = (char *)recv_iovs[i].iov_base;
+    }
+    stats.recv_packets += n;
+    *packets = recv_packets;
+    return n;
+}
+
+int net_recv_fill(int sockfd) {
+    if (use_pipeline) {
+        return pipeline_rx_fill();
+    }
+    //the ring drains the socket into its buffers as fast as they come back, so those are the queue;
+    //once they run out datagrams wait on the socket again
+    int fill = use_uring ? uring_rx_fill() : 0;
+    //what the datagrams still queued on the socket take, against what they may take
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0 || !meminfo[SK_MEMINFO_RCVBUF]) {
+        return fill;
+    }
+    int socket_fill = (int)((uint64_t)meminfo[SK_MEMINFO_RMEM_ALLOC] * 100 / meminfo[SK_MEMINFO_RCVBUF]);
+    return socket_fill > fill ? socket_fill : fill;
+}
+
+//sendmmsg() on whichever backend is in use
+static int send_batch(int sockfd, struct mmsghdr *msgs, int count) {
+    stats.send_calls++;
+    return use_uring ? uring_sendmmsg(sockfd, msgs, count) : sendmmsg(sockfd, msgs, count, 0);
+}
+
+//asks for a writable wakeup while anything waits in the backlog, and stops asking once it is empty
+static void watch_backlog(void) {
+    int want = backlog_count() > 0;
+    if (want != want_writable && writable_callback) {
+        want_writable = want;
+        writable_callback(want);
+    }
+}
+
+//sends the queued datagrams; frames stay put since callers may still be gathering from them
+static int send_queued(void) {
+    if (use_pipeline) {
+        int queued = send_count ? pipeline_send(send_fd, send_msgs, send_count, &stats) : 0;
+        send_count = 0;
+        arena_used = 0;
+        return queued;
+    }
+    int sent = 0;
+    int i = 0;
+    int blocked = 0;
+    if (send_count && backlog_count()) {
+        //the socket was full; what waits goes first so each destination keeps its order
+        net_drain(send_fd);
+        blocked = backlog_count() > 0;
+    }
+    while (i < send_count && !blocked) {
+        int n = send_batch(send_fd, send_msgs + i, send_count - i);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR) continue;
+            if (err == EAGAIN || err == EWOULDBLOCK) {
+                //socket buffer is full, the rest of the batch waits in the backlog
+                break;
+            }
+            log_error("sendmmsg failed: %s", strerror(err));
+            stats.send_errors++;
+            //skip the datagram the kernel refused and keep going
+            i++;
+            continue;
+        }
+        i += n;
+        sent += n;
+    }
+    if (i < send_count && !backlog_enabled()) {
+        log_error("socket buffer full, %d datagrams lost", send_count - i);
+        stats.send_errors += send_count - i;
+        i = send_count;
+    }
+    for (; i < send_count; i++) {
+        struct msghdr *hdr = &send_msgs[i].msg_hdr;
+        backlog_add((const struct sockaddr_in *)hdr->msg_name, hdr->msg_iov, (int)hdr->msg_iovlen);
+    }
+    stats.send_packets += sent;
+    send_count = 0;
+    arena_used = 0;
+    watch_backlog();
+    return sent;
+}
+
+void net_set_writable_callback(net_writable_callback callback) {
+    writable_callback = callback;
+}
+
+int net_drain(int sockfd) {
+    int sent = 0;
+    while (backlog_count()) {
+        int count = backlog_peek(drain_msgs, drain_iovs, NET_MAX_BATCH);
+        int n = send_batch(sockfd, drain_msgs, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            //not a full buffer; drop the datagram the kernel refused so the queue cannot wedge
+            log_error("sendmmsg failed: %s", strerror(errno));
+            stats.send_errors++;
+            n = 1;
+        } else {
+            sent += n;
+        }
+        backlog_sent(n);
+    }
+    stats.send_packets += sent;
+    watch_backlog();
+    return sent;
+}
+
+int net_flush(void) {
+    int sent = send_queued();
+    frame_used = 0;
+    return sent;
+}
+
+//takes the next send slot, flushing first if the batch is full or the socket changes
+static int next_slot(int sockfd, const struct sockaddr_in *dest) {
+    if ((send_fd != sockfd && send_count > 0) || send_count == NET_MAX_BATCH) {
+        send_queued();
+    }
+    send_fd = sockfd;
+    int slot = send_count++;
+    send_addrs[slot] = *dest;
+    struct msghdr *hdr = &send_msgs[slot].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &send_addrs[slot];
+    hdr->msg_namelen = sizeof(struct sockaddr_in);
+    hdr->msg_iov = &send_iovs[(size_t)slot * NET_MAX_IOV];
+    return slot;
+}
+
+int net_send(int sockfd, const void *buf, size_t len, const struct sockaddr_in *dest) {
+    if (len > NET_ARENA_SIZE) {
+        //too big to batch, keep ordering by sending the queue first
+        send_queued();
+        stats.send_calls++;
+        if (sendto(sockfd, buf, len, 0, (const struct sockaddr *)dest, sizeof(*dest)) < 0) {
+            stats.send_errors++;
+            return -1;
+        }
+        stats.send_packets++;
+        return 0;
+    }
+    if (arena_used + len > NET_ARENA_SIZE) {
+        send_queued();
+    }
+
+    int slot = next_slot(sockfd, dest);
+    char *copy = send_arena + arena_used;
+    memcpy(copy, buf, len);
+    arena_used += len;
+
+    struct msghdr *hdr = &send_msgs[slot].msg_hdr;
+    hdr->msg_iov[0].iov_base = copy;
+    hdr->msg_iov[0].iov_len = len;
+    hdr->msg_iovlen = 1;
+    return 0;
+}
+
+void *net_frame_alloc(size_t len) {
+    len = (len + 7) & ~(size_t)7;
+    if (len > NET_FRAME_AREA_SIZE) {
+        return NULL;
+    }
+    if (frame_used + len > NET_FRAME_AREA_SIZE) {
+        //nothing queued may point at the area once it is reused
+        net_flush();
+    }
+    void *frame = frame_area + frame_used;
+    frame_used += len;
+    return frame;
+}
+
+int net_sendv(int sockfd, const struct iovec *iov, int iovcnt, const struct sockaddr_in *dest) {
+    if (iovcnt <= 0 || iovcnt > NET_MAX_IOV) {
+        return -1;
+    }
+    int slot = next_slot(sockfd, dest);
+    struct msghdr *hdr = &send_msgs[slot].msg_hdr;
+    memcpy(hdr->msg_iov, iov, iovcnt * sizeof(struct iovec));
+    hdr->msg_iovlen = iovcnt;
+    return 0;
+}
+
+void net_get_stats(NetStats *out) {
+    *out = stats;
+    if (use_pipeline) {
+        pipeline_add_net_stats(out);
+    }
+}
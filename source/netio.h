@@ -0,0 +1,118 @@
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+/* Batched datagram I/O for the server socket.
+ *
+ * net_recv_batch() drains up to the configured batch size of datagrams
+ * with a single recvmmsg(2).  Handlers call net_send() instead of
+ * sendto(); the datagram is copied into an outgoing batch and the whole
+ * batch goes out with one sendmmsg(2) when net_flush() is called (the
+ * main loop does this after dispatching a receive batch) or when the
+ * batch fills up.  Datagrams to the same destination keep their order.
+ *
+ * net_sendv() is the zero-copy variant: the datagram is gathered by the
+ * kernel straight from the caller's buffers (a received datagram, a
+ * channel name, a header from net_frame_alloc()), so one payload can be
+ * queued for many destinations without being copied for each.  Those
+ * buffers must stay valid and unchanged until net_flush().  Received
+ * datagrams qualify as long as the caller flushes before the next
+ * net_recv_batch(), which the main loop does.
+ *
+ * When the socket buffer is full, whatever sendmmsg() could not send
+ * is queued per destination in the backlog (see backlog.h) instead of
+ * being dropped.  While anything waits, netio asks through the writable
+ * callback for a wakeup when the socket drains, and the event loop then
+ * calls net_drain().  New datagrams queue behind the backlog, so each
+ * destination still gets its datagrams in order.
+ *
+ * net_use_uring() moves the server socket onto io_uring (see uring.h),
+ * and net_use_pipeline() hands receiving and sending to threads of
+ * their own (see pipeline.h).  Callers do not change, except that the
+ * event loop must poll net_poll_fd() rather than the socket.
+ */
+
+#define NET_DEFAULT_BATCH 64
+#define NET_MAX_BATCH 1024
+#define NET_RECV_BUFFER 1472
+/* Most pieces one net_sendv() datagram can be gathered from. */
+#define NET_MAX_IOV 4
+
+typedef struct NetPacket {
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int len;
+    char *data;
+} NetPacket;
+
+typedef struct NetStats {
+    uint64_t recv_calls;
+    uint64_t recv_packets;
+    uint64_t send_calls;
+    uint64_t send_packets;
+    uint64_t send_errors;
+} NetStats;
+
+/* Allocates the receive and send batches.  Returns -1 on failure. */
+int net_init(int batch_size);
+
+/* Switches sockfd to the io_uring backend.  Call once, after net_init()
+ * and in the process that will use the socket.  Returns -1 with errno
+ * set if the kernel cannot do it; the recvmmsg path is then kept. */
+int net_use_uring(int sockfd);
+
+/* Starts the receive thread and `threads` send threads for sockfd.
+ * Call once, after net_init() and in the process that will use the
+ * socket.  Returns -1 with errno set if they cannot be started; the
+ * socket is then left to the event loop. */
+int net_use_pipeline(int sockfd, int threads);
+
+/* The descriptor that becomes readable when sockfd has datagrams. */
+int net_poll_fd(int sockfd);
+
+/* "pipeline", "io_uring" or "recvmmsg", for the stats. */
+const char *net_backend(void);
+
+/* Receives up to batch_size datagrams without blocking.  *packets points
+ * at storage owned by netio that stays valid until the next call.
+ * Returns the number received, 0 if none were waiting, -1 on error. */
+int net_recv_batch(int sockfd, NetPacket **packets);
+
+/* Percent of the receive queue in use after the last net_recv_batch():
+ * the rx ring with the pipeline, else the socket's receive buffer, or
+ * with io_uring the provided buffers if they are fuller.  Returns 0 if
+ * it cannot be read. */
+int net_recv_fill(int sockfd);
+
+/* Queues a datagram.  Returns 0 once queued, -1 if it could not be sent. */
+int net_send(int sockfd, const void *buf, size_t len, const struct sockaddr_in *dest);
+
+/* Queues a datagram gathered from iov without copying it.  Returns -1
+ * if iovcnt is out of range. */
+int net_sendv(int sockfd, const struct iovec *iov, int iovcnt, const struct sockaddr_in *dest);
+
+/* Scratch space for per-message frame headers, valid until net_flush().
+ * May flush, so a frame can only be queued until the next call.
+ * Returns NULL if len is larger than the whole area. */
+void *net_frame_alloc(size_t len);
+
+/* Sends everything queued, or hands it to the send threads.  Returns
+ * the number of datagrams sent or handed over. */
+int net_flush(void);
+
+/* Called with 1 when datagrams start waiting in the backlog and with 0
+ * once it is empty again. */
+typedef void (*net_writable_callback)(int wanted);
+void net_set_writable_callback(net_writable_callback callback);
+
+/* Sends what the backlog holds, until the socket is full again.
+ * Returns the number of datagrams sent. */
+int net_drain(int sockfd);
+
+void net_get_stats(NetStats *stats);
+
+#endif
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "pipeline.h"
+#include "spsc.h"
+#include "log.h"
+
+/* See pipeline.h for usage information */
+
+//how long the receive thread naps when the event loop is a whole rx ring behind
+#define PIPELINE_FULL_WAIT_NS 100000L
+
+typedef struct RxSlot {
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int len;
+    char data[NET_RECV_BUFFER];
+} RxSlot;
+
+typedef struct SendSlot {
+    struct sockaddr_in dest;
+    int len;
+    char data[NET_RECV_BUFFER];
+} SendSlot;
+
+typedef struct Sender {
+    Spsc ring;
+    int wake_fd;
+    int sleeping;     //set by the thread before it blocks on wake_fd
+    uint64_t pending; //filled by the event loop, not yet published
+    uint64_t full;
+    NetStats stats;   //written by the thread only
+    pthread_t thread;
+} Sender;
+
+static int socket_fd = -1;
+static int batch_size = 0;
+static int event_fd = -1;
+
+static Spsc rx_ring;
+static RxSlot *rx_slots = NULL;
+//the loop's read position, taken slots included; the receive thread wakes the loop when it has caught up
+static uint64_t rx_taken = 0;
+static uint64_t rx_held = 0;
+static uint64_t rx_full = 0;
+static NetStats rx_stats;
+static pthread_t receiver;
+
+static Sender *senders = NULL;
+static int sender_count = 0;
+static uint64_t oversized = 0;
+
+//counters are written by one thread and read by the metrics scrape
+static inline void count(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static void wake(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+static void *receive_main(void *arg) {
+    static struct mmsghdr msgs[NET_MAX_BATCH];
+    static struct iovec iovs[NET_MAX_BATCH];
+    (void)arg;
+    while (1) {
+        int room = (int)spsc_free(&rx_ring, batch_size);
+        if (room == 0) {
+            //the socket buffer holds what arrives until the loop catches up
+            count(&rx_full, 1);
+            struct timespec pause = {0, PIPELINE_FULL_WAIT_NS};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        for (int i = 0; i < room; i++) {
+            RxSlot *slot = (RxSlot *)spsc_slot(&rx_ring, rx_ring.head + i);
+            iovs[i].iov_base = slot->data;
+            iovs[i].iov_len = NET_RECV_BUFFER;
+            memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &slot->addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        count(&rx_stats.recv_calls, 1);
+        int n = recvmmsg(socket_fd, msgs, room, MSG_DONTWAIT, NULL);
+        if (n <= 0) {
+            if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd readable = {socket_fd, POLLIN, 0};
+                poll(&readable, 1, -1);
+            }
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            RxSlot *slot = (RxSlot *)spsc_slot(&rx_ring, rx_ring.head + i);
+            slot->addr_len = msgs[i].msg_hdr.msg_namelen;
+            slot->len = (int)msgs[i].msg_len;
+        }
+        count(&rx_stats.recv_packets, n);
+
+        //the loop sleeps once it has taken everything; either it sees the new head or we see it caught up
+        uint64_t old_head = rx_ring.head;
+        spsc_publish(&rx_ring, n);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rx_taken, __ATOMIC_RELAXED) == old_head) {
+            wake(event_fd);
+        }
+    }
+    return NULL;
+}
+
+//sends one drained run of the ring, waiting out a full socket buffer instead of dropping
+static void send_run(Sender *sender, struct mmsghdr *msgs, struct iovec *iovs, int n) {
+    for (int i = 0; i < n; i++) {
+        SendSlot *slot = (SendSlot *)spsc_slot(&sender->ring, sender->ring.tail + i);
+        iovs[i].iov_base = slot->data;
+        iovs[i].iov_len = slot->len;
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &slot->dest;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int i = 0;
+    while (i < n) {
+        count(&sender->stats.send_calls, 1);
+        int sent = sendmmsg(socket_fd, msgs + i, n - i, 0);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd writable = {socket_fd, POLLOUT, 0};
+                poll(&writable, 1, -1);
+                continue;
+            }
+            //skip the datagram the kernel refused and keep going
+            count(&sender->stats.send_errors, 1);
+            i++;
+            continue;
+        }
+        count(&sender->stats.send_packets, sent);
+        i += sent;
+    }
+}
+
+static void *sender_main(void *arg) {
+    Sender *sender = (Sender *)arg;
+    struct mmsghdr *msgs = (struct mmsghdr *)calloc(NET_MAX_BATCH, sizeof(struct mmsghdr));
+    struct iovec *iovs = (struct iovec *)calloc(NET_MAX_BATCH, sizeof(struct iovec));
+    if (!msgs || !iovs) {
+        abort();
+    }
+    while (1) {
+        int n = (int)spsc_ready(&sender->ring, NET_MAX_BATCH);
+        if (n == 0) {
+            //either the loop sees the flag or we see its datagrams
+            __atomic_store_n(&sender->sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (spsc_ready(&sender->ring, 1) == 0) {
+                uint64_t wakeups;
+                if (read(sender->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EINTR) {
+                    abort();
+                }
+            }
+            __atomic_store_n(&sender->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        send_run(sender, msgs, iovs, n);
+        spsc_release(&sender->ring, n);
+    }
+    return NULL;
+}
+
+static void sender_publish(Sender *sender) {
+    if (!sender->pending) {
+        return;
+    }
+    spsc_publish(&sender->ring, sender->pending);
+    sender->pending = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sender->sleeping, __ATOMIC_RELAXED)) {
+        wake(sender->wake_fd);
+    }
+}
+
+//one thread per destination keeps each user's and neighbor's datagrams in order
+static Sender *sender_for(const struct sockaddr_in *dest) {
+    uint64_t key = ((uint64_t)dest->sin_addr.s_addr << 16) | dest->sin_port;
+    return &senders[(key * 0x9E3779B97F4A7C15ULL >> 32) % sender_count];
+}
+
+static void pipeline_free(int started) {
+    //threads are stopped at a cancellation point: poll, read or nanosleep
+    for (int i = 0; i < started; i++) {
+        pthread_t thread = i == 0 ? receiver : senders[i - 1].thread;
+        pthread_cancel(thread);
+        pthread_join(thread, NULL);
+    }
+    for (int i = 0; senders && i < sender_count; i++) {
+        if (senders[i].wake_fd >= 0) close(senders[i].wake_fd);
+        free(senders[i].ring.slots);
+    }
+    free(senders);
+    senders = NULL;
+    sender_count = 0;
+    free(rx_slots);
+    rx_slots = NULL;
+    if (event_fd >= 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
+}
+
+int pipeline_start(int sockfd, int size, int threads) {
+    if (threads < 1 || threads > PIPELINE_MAX_SENDERS) {
+        errno = EINVAL;
+        return -1;
+    }
+    socket_fd = sockfd;
+    batch_size = size;
+    rx_slots = (RxSlot *)malloc(PIPELINE_RX_SLOTS * sizeof(RxSlot));
+    //the rings' indexes sit on their own cache lines, so the array must start on one
+    void *area = NULL;
+    if (posix_memalign(&area, SPSC_CACHE_LINE, threads * sizeof(Sender)) == 0) {
+        senders = (Sender *)area;
+        memset(senders, 0, threads * sizeof(Sender));
+        sender_count = threads;
+        for (int i = 0; i < threads; i++) {
+            senders[i].wake_fd = -1;
+        }
+    }
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!rx_slots || !senders || event_fd < 0) {
+        int err = senders && rx_slots ? errno : ENOMEM;
+        pipeline_free(0);
+        errno = err;
+        return -1;
+    }
+    spsc_init(&rx_ring, rx_slots, sizeof(RxSlot), PIPELINE_RX_SLOTS);
+    rx_taken = rx_held = 0;
+    for (int i = 0; i < threads; i++) {
+        Sender *sender = &senders[i];
+        //blocking, the thread sleeps in read()
+        sender->wake_fd = eventfd(0, EFD_CLOEXEC);
+        void *slots = malloc(PIPELINE_SEND_SLOTS * sizeof(SendSlot));
+        spsc_init(&sender->ring, slots, sizeof(SendSlot), PIPELINE_SEND_SLOTS);
+        if (sender->wake_fd < 0 || !slots) {
+            int err = slots ? errno : ENOMEM;
+            pipeline_free(0);
+            errno = err;
+            return -1;
+        }
+    }
+
+    int started = 0;
+    int err = pthread_create(&receiver, NULL, receive_main, NULL);
+    if (err == 0) {
+        pthread_setname_np(receiver, "duckchat-rx");
+        started++;
+    }
+    for (int i = 0; err == 0 && i < threads; i++) {
+        err = pthread_create(&senders[i].thread, NULL, sender_main, &senders[i]);
+        if (err == 0) {
+            char name[16];
+            snprintf(name, sizeof(name), "duckchat-tx%d", i);
+            pthread_setname_np(senders[i].thread, name);
+            started++;
+        }
+    }
+    if (err != 0) {
+        pipeline_free(started);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int pipeline_event_fd(void) {
+    return event_fd;
+}
+
+int pipeline_recv(NetPacket *packets, int max) {
+    //clear the wakeup before looking, so anything published from here on wakes the loop again
+    uint64_t wakeups;
+    if (read(event_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        log_error("pipeline eventfd read failed: %s", strerror(errno));
+    }
+
+    //the previous batch has been dispatched and flushed, its slots can be filled again
+    spsc_release(&rx_ring, rx_held);
+    int n = (int)spsc_ready(&rx_ring, max);
+    for (int i = 0; i < n; i++) {
+        RxSlot *slot = (RxSlot *)spsc_slot(&rx_ring, rx_ring.tail + i);
+        packets[i].addr = slot->addr;
+        packets[i].addr_len = slot->addr_len;
+        packets[i].len = slot->len;
+        packets[i].data = slot->data;
+    }
+    rx_held = n;
+
+    uint64_t taken = rx_ring.tail + n;
+    __atomic_store_n(&rx_taken, taken, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rx_ring.head, __ATOMIC_RELAXED) != taken) {
+        //more than one batch was waiting, come back for the rest
+        wake(event_fd);
+    }
+    return n;
+}
+
+int pipeline_rx_fill(void) {
+    uint64_t waiting = __atomic_load_n(&rx_ring.head, __ATOMIC_ACQUIRE) - rx_ring.tail - rx_held;
+    return (int)(waiting * 100 / PIPELINE_RX_SLOTS);
+}
+
+int pipeline_send(int sockfd, struct mmsghdr *msgs, int total, NetStats *stats) {
+    int queued = 0;
+    for (int i = 0; i < total; i++) {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        size_t len = 0;
+        for (size_t part = 0; part < hdr->msg_iovlen; part++) {
+            len += hdr->msg_iov[part].iov_len;
+        }
+        if (len > NET_RECV_BUFFER) {
+            //larger than any datagram the server builds, but do not lose it
+            oversized++;
+            stats->send_calls++;
+            if (sendmsg(sockfd, hdr, 0) < 0) {
+                stats->send_errors++;
+            } else {
+                stats->send_packets++;
+            }
+            continue;
+        }
+
+        Sender *sender = sender_for((const struct sockaddr_in *)hdr->msg_name);
+        if (spsc_free(&sender->ring, sender->pending + 1) <= sender->pending) {
+            //the thread is a whole ring behind; hand it what we have and wait rather than drop
+            count(&sender->full, 1);
+            sender_publish(sender);
+            while (spsc_free(&sender->ring, 1) == 0) {
+                sched_yield();
+            }
+        }
+        SendSlot *slot = (SendSlot *)spsc_slot(&sender->ring, sender->ring.head + sender->pending);
+        slot->dest = *(const struct sockaddr_in *)hdr->msg_name;
+        slot->len = (int)len;
+        char *out = slot->data;
+        for (size_t part = 0; part < hdr->msg_iovlen; part++) {
+            memcpy(out, hdr->msg_iov[part].iov_base, hdr->msg_iov[part].iov_len);
+            out += hdr->msg_iov[part].iov_len;
+        }
+        sender->pending++;
+        queued++;
+    }
+    for (int i = 0; i < sender_count; i++) {
+        sender_publish(&senders[i]);
+    }
+    return queued;
+}
+
+void pipeline_add_net_stats(NetStats *stats) {
+    stats->recv_calls += __atomic_load_n(&rx_stats.recv_calls, __ATOMIC_RELAXED);
+    stats->recv_packets += __atomic_load_n(&rx_stats.recv_packets, __ATOMIC_RELAXED);
+    for (int i = 0; i < sender_count; i++) {
+        NetStats *sender = &senders[i].stats;
+        stats->send_calls += __atomic_load_n(&sender->send_calls, __ATOMIC_RELAXED);
+        stats->send_packets += __atomic_load_n(&sender->send_packets, __ATOMIC_RELAXED);
+        stats->send_errors += __atomic_load_n(&sender->send_errors, __ATOMIC_RELAXED);
+    }
+}
+
+static void queue_stats(PipelineQueueStats *out, const Spsc *ring, const uint64_t *full) {
+    out->depth = spsc_depth(ring);
+    out->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+    out->full = __atomic_load_n(full, __ATOMIC_RELAXED);
+}
+
+void pipeline_get_stats(PipelineStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->senders = sender_count;
+    if (!sender_count) {
+        return;
+    }
+    queue_stats(&stats->rx, &rx_ring, &rx_full);
+    for (int i = 0; i < sender_count; i++) {
+        queue_stats(&stats->send[i], &senders[i].ring, &senders[i].full);
+    }
+    stats->oversized = oversized;
+}
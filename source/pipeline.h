@@ -0,0 +1,78 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include "netio.h"
+
+/* Staged packet path for netio, selected with net_use_pipeline().
+ *
+ * Without it the event loop receives a batch, routes it and sends the
+ * fan-out itself, so while a big channel's SAY goes out nobody reads the
+ * socket and a burst overflows the kernel's receive buffer.  Here each
+ * of those steps gets its own thread, joined by SPSC rings (spsc.h):
+ *
+ *   receive thread --rx ring--> event loop --send rings--> send threads
+ *
+ * The receive thread recvmmsg()s straight into the rx ring's slots and
+ * wakes the event loop through an eventfd, which the loop polls instead
+ * of the socket.  The loop routes as before: a batch handed out by
+ * pipeline_recv() stays in the ring until the next call, like the
+ * recvmmsg batch it replaces.
+ *
+ * On flush every queued datagram is copied into the ring of the send
+ * thread that owns its destination, so each thread drains the queues of
+ * its own share of users and neighbors and per-destination order holds.
+ * When a send ring is full the loop waits for its thread rather than
+ * dropping, and the rx ring (then the socket buffer) takes up the slack.
+ *
+ * Logging already has its own writer thread.  The receive and send
+ * threads never log; their failures show up in the stats.
+ */
+
+/* Most send threads. */
+#define PIPELINE_MAX_SENDERS 16
+/* Slots in the rx ring and in each send ring, powers of two. */
+#define PIPELINE_RX_SLOTS 8192
+#define PIPELINE_SEND_SLOTS 4096
+
+typedef struct PipelineQueueStats {
+    uint64_t depth;      /* datagrams waiting now */
+    uint64_t high_water; /* most ever waiting */
+    uint64_t full;       /* times the producer found the ring full */
+} PipelineQueueStats;
+
+typedef struct PipelineStats {
+    PipelineQueueStats rx;
+    int senders;
+    PipelineQueueStats send[PIPELINE_MAX_SENDERS];
+    uint64_t oversized; /* datagrams too big for a slot, sent by the loop */
+} PipelineStats;
+
+/* Starts the receive thread and `threads` send threads on sockfd.
+ * Call after forking.  Returns -1 with errno set, leaving nothing
+ * running. */
+int pipeline_start(int sockfd, int batch_size, int threads);
+
+/* Readable when the rx ring has datagrams. */
+int pipeline_event_fd(void);
+
+/* Takes up to max datagrams from the rx ring, releasing the previous
+ * batch.  Returns the number taken. */
+int pipeline_recv(NetPacket *packets, int max);
+
+/* Percent of the rx ring waiting behind the batch pipeline_recv()
+ * handed out last. */
+int pipeline_rx_fill(void);
+
+/* Copies total datagrams from msgs into the send rings.  Returns how
+ * many were queued; oversized ones are sent inline and counted in
+ * stats. */
+int pipeline_send(int sockfd, struct mmsghdr *msgs, int total, NetStats *stats);
+
+/* Adds the threads' socket counters to stats. */
+void pipeline_add_net_stats(NetStats *stats);
+
+void pipeline_get_stats(PipelineStats *stats);
+
+#endif
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+/* See pool.h for usage information */
+
+//objects hold the free list link while free, and keep the alignment malloc would give
+#define POOL_ALIGN 16
+
+static int use_hugepages = 0;
+
+void pool_use_hugepages(int enabled) {
+    use_hugepages = enabled;
+}
+
+static size_t round_up(size_t value, size_t to) {
+    return (value + to - 1) / to * to;
+}
+
+//only a slab of a hugepage or more goes on hugepages, a small pool would leave most of one unused
+static void *map_slab(size_t *bytes, int *huge) {
+    *huge = 0;
+    int want_huge = use_hugepages && *bytes >= POOL_HUGEPAGE;
+    if (want_huge) {
+        *bytes = round_up(*bytes, POOL_HUGEPAGE);
+        void *slab = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            *huge = 1;
+            return slab;
+        }
+    } else {
+        *bytes = round_up(*bytes, (size_t)sysconf(_SC_PAGESIZE));
+    }
+    void *slab = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        return NULL;
+    }
+    if (want_huge) {
+        madvise(slab, *bytes, MADV_HUGEPAGE);
+    }
+    return slab;
+}
+
+//maps a slab of at least bytes and threads its objects onto the free list
+static int grow(Pool *pool, size_t bytes) {
+    if (pool->stats.slabs == pool->slab_capacity) {
+        int capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 8;
+        void **slabs = (void **)realloc(pool->slabs, capacity * sizeof(void *));
+        if (!slabs) return -1;
+        pool->slabs = slabs;
+        size_t *slab_bytes = (size_t *)realloc(pool->slab_bytes, capacity * sizeof(size_t));
+        if (!slab_bytes) return -1;
+        pool->slab_bytes = slab_bytes;
+        pool->slab_capacity = capacity;
+    }
+    int huge;
+    char *slab = (char *)map_slab(&bytes, &huge);
+    if (!slab) {
+        return -1;
+    }
+    pool->slabs[pool->stats.slabs] = slab;
+    pool->slab_bytes[pool->stats.slabs] = bytes;
+    pool->stats.slabs++;
+    pool->stats.huge_slabs += huge;
+    pool->stats.bytes += bytes;
+
+    //pushed in reverse so the first allocations come from the start of the slab
+    size_t count = bytes / pool->stats.object_size;
+    for (size_t i = count; i-- > 0;) {
+        void **object = (void **)(slab + i * pool->stats.object_size);
+        *object = pool->free_list;
+        pool->free_list = object;
+    }
+    pool->stats.capacity += count;
+    return 0;
+}
+
+int pool_init(Pool *pool, const char *name, size_t object_size, size_t prealloc) {
+    memset(pool, 0, sizeof(*pool));
+    pool->stats.name = name;
+    pool->stats.object_size = round_up(object_size < sizeof(void *) ? sizeof(void *) : object_size, POOL_ALIGN);
+    if (prealloc == 0) {
+        return 0;
+    }
+    return grow(pool, prealloc * pool->stats.object_size);
+}
+
+void *pool_alloc(Pool *pool) {
+    if (!pool->free_list) {
+        size_t bytes = POOL_GROW_BYTES > pool->stats.object_size ? POOL_GROW_BYTES : pool->stats.object_size;
+        //a pool that already fills a hugepage grows by whole ones
+        if (use_hugepages && pool->stats.bytes >= POOL_HUGEPAGE && bytes < POOL_HUGEPAGE) {
+            bytes = POOL_HUGEPAGE;
+        }
+        if (grow(pool, bytes) < 0) {
+            pool->stats.failures++;
+            return NULL;
+        }
+    }
+    void **object = (void **)pool->free_list;
+    pool->free_list = *object;
+    pool->stats.allocs++;
+    pool->stats.live++;
+    if (pool->stats.live > pool->stats.peak) {
+        pool->stats.peak = pool->stats.live;
+    }
+    return object;
+}
+
+void pool_free(Pool *pool, void *object) {
+    if (!object) {
+        return;
+    }
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->stats.frees++;
+    pool->stats.live--;
+}
+
+void pool_destroy(Pool *pool) {
+    for (int i = 0; i < pool->stats.slabs; i++) {
+        munmap(pool->slabs[i], pool->slab_bytes[i]);
+    }
+    free(pool->slabs);
+    free(pool->slab_bytes);
+    memset(pool, 0, sizeof(*pool));
+}
+
+void pool_get_stats(const Pool *pool, PoolStats *stats) {
+    *stats = pool->stats;
+}
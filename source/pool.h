@@ -0,0 +1,64 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Typed slab pools for the server's small fixed-size records (users,
+ * channels, subscriptions, neighbors).
+ *
+ * Each pool carves one object size out of slabs mapped with mmap(2).
+ * Freed objects go on an intrusive free list and are handed out again
+ * most recent first, so a busy record type keeps reusing the same warm
+ * cache lines.  Slabs are never returned to the system: a long-running
+ * server's RSS settles at its peak and allocation is a pointer pop.
+ *
+ * pool_init() maps the preallocated capacity up front; a pool that runs
+ * out maps another slab of POOL_GROW_BYTES.  With hugepages on, only
+ * slabs of at least POOL_HUGEPAGE use them: a large preallocation, and
+ * the growth of a pool that has already mapped a hugepage's worth, which
+ * then grows a hugepage at a time.  Those are asked for with MAP_HUGETLB
+ * and fall back to transparent hugepages (MADV_HUGEPAGE) when none are
+ * reserved.  Smaller pools stay on normal pages rather than round a few
+ * kilobytes of records up to 2 MB.
+ */
+
+#define POOL_GROW_BYTES (64 * 1024)
+#define POOL_HUGEPAGE (2 * 1024 * 1024)
+
+typedef struct PoolStats {
+    const char *name;
+    size_t object_size;  /* after alignment */
+    size_t live;         /* objects handed out */
+    size_t peak;
+    size_t capacity;     /* objects in all slabs */
+    size_t bytes;        /* mapped */
+    int slabs;
+    int huge_slabs;      /* slabs backed by MAP_HUGETLB */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures;   /* allocations that could not map a slab */
+} PoolStats;
+
+typedef struct Pool {
+    PoolStats stats;
+    void *free_list;
+    void **slabs;        /* start of each mapping, for pool_destroy() */
+    size_t *slab_bytes;
+    int slab_capacity;
+} Pool;
+
+/* Hugepage backing for slabs mapped from now on. */
+void pool_use_hugepages(int enabled);
+
+/* Returns -1 if the preallocated slab could not be mapped. */
+int pool_init(Pool *pool, const char *name, size_t object_size, size_t prealloc);
+/* Returns NULL if the pool is empty and no slab can be mapped.  The
+ * object is not zeroed. */
+void *pool_alloc(Pool *pool);
+void pool_free(Pool *pool, void *object);
+void pool_destroy(Pool *pool);
+
+void pool_get_stats(const Pool *pool, PoolStats *stats);
+
+#endif
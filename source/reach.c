@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include "reach.h"
+#include "index.h"
+
+/* See reach.h for usage information */
+
+typedef struct Server {
+    struct sockaddr_in addr;
+    uint64_t id;
+    int best;       //neighbor index of the shortest way there, -1 while held down
+    int best_hops;
+    time_t held_until; //0 unless the route got worse and is held down
+} Server;
+
+static struct sockaddr_in self_addr;
+static uint64_t self_id;
+static int neighbor_count = 0;
+
+//every other server reachable through some neighbor, in no order
+static Server servers[REACH_MAX_SERVERS];
+static int server_count = 0;
+//hops through each neighbor, one row of neighbor_count per servers[] slot
+static unsigned char *hops = NULL;
+//when each neighbor last sent a REACH, 0 for never
+static time_t *heard = NULL;
+
+static ReachStats stats;
+
+int reach_init(const struct sockaddr_in *self, int neighbors) {
+    self_addr = *self;
+    self_id = addr_key(self);
+    neighbor_count = neighbors;
+    if (neighbors > 0) {
+        hops = (unsigned char *)malloc((size_t)REACH_MAX_SERVERS * neighbors);
+        heard = (time_t *)calloc(neighbors, sizeof(time_t));
+        if (!hops || !heard) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static unsigned char *row(int slot) {
+    return hops + (size_t)slot * neighbor_count;
+}
+
+static int find_server(uint64_t id) {
+    for (int s = 0; s < server_count; s++) {
+        if (servers[s].id == id) {
+            return s;
+        }
+    }
+    return -1;
+}
+
+static int add_server(const struct sockaddr_in *addr, uint64_t id) {
+    if (server_count == REACH_MAX_SERVERS) {
+        return -1;
+    }
+    int slot = server_count++;
+    servers[slot].addr = *addr;
+    servers[slot].id = id;
+    servers[slot].best = -1;
+    servers[slot].best_hops = REACH_INFINITY;
+    servers[slot].held_until = 0;
+    memset(row(slot), REACH_INFINITY, neighbor_count);
+    return slot;
+}
+
+static void clear_neighbor(int neighbor) {
+    for (int s = 0; s < server_count; s++) {
+        row(s)[neighbor] = REACH_INFINITY;
+    }
+}
+
+//picks every server's shortest way again, keeping the current one on a tie so routes do not flap,
+//and drops the servers no neighbor leads to any more.  a route that gets worse is held down
+//instead: whatever replaced it may be an old one that runs back through here
+static int choose_routes(time_t now) {
+    int changed = 0;
+    int s = 0;
+    while (s < server_count) {
+        if (servers[s].held_until) {
+            if (now < servers[s].held_until) {
+                s++;
+                continue;
+            }
+            servers[s].held_until = 0;
+            changed = 1;
+        }
+        unsigned char *through = row(s);
+        int best = servers[s].best;
+        int best_hops = best >= 0 ? through[best] : REACH_INFINITY;
+        for (int n = 0; n < neighbor_count; n++) {
+            if (through[n] < best_hops) {
+                best = n;
+                best_hops = through[n];
+            }
+        }
+        if (best_hops > servers[s].best_hops) {
+            servers[s].best = -1;
+            servers[s].best_hops = REACH_INFINITY;
+            servers[s].held_until = now + REACH_HOLDDOWN;
+            stats.holddowns++;
+            changed = 1;
+            s++;
+            continue;
+        }
+        if (best_hops >= REACH_INFINITY) {
+            int last = --server_count;
+            if (s != last) {
+                servers[s] = servers[last];
+                memcpy(through, row(last), neighbor_count);
+            }
+            changed = 1;
+            continue;
+        }
+        if (best != servers[s].best || best_hops != servers[s].best_hops) {
+            servers[s].best = best;
+            servers[s].best_hops = best_hops;
+            changed = 1;
+        }
+        s++;
+    }
+    if (changed) {
+        stats.changes++;
+    }
+    return changed;
+}
+
+int reach_update(int neighbor, const WireMessage *reach, time_t now) {
+    if (neighbor < 0 || neighbor >= neighbor_count) {
+        return 0;
+    }
+    stats.updates++;
+    heard[neighbor] = now;
+    clear_neighbor(neighbor);
+    size_t offset = 0;
+    struct sockaddr_in server;
+    int server_hops;
+    while (wire_next_reach(reach, &offset, &server, &server_hops) == 0) {
+        uint64_t id = addr_key(&server);
+        int through = server_hops + 1;
+        if (id == self_id || through >= REACH_INFINITY) {
+            continue;
+        }
+        int slot = find_server(id);
+        if (slot < 0 && (slot = add_server(&server, id)) < 0) {
+            continue;
+        }
+        if (through < row(slot)[neighbor]) {
+            row(slot)[neighbor] = (unsigned char)through;
+        }
+    }
+    return choose_routes(now);
+}
+
+int reach_expire(time_t now) {
+    int expired = 0;
+    for (int n = 0; n < neighbor_count; n++) {
+        if (heard[n] && now - heard[n] > REACH_TIMEOUT) {
+            clear_neighbor(n);
+            heard[n] = 0;
+            expired = 1;
+        }
+    }
+    for (int s = 0; s < server_count && !expired; s++) {
+        expired = servers[s].held_until && now >= servers[s].held_until;
+    }
+    return expired ? choose_routes(now) : 0;
+}
+
+size_t reach_encode(int neighbor, void *buf) {
+    char *out = (char *)buf;
+    wire_reach_begin(out);
+    size_t len = WIRE_V2_HEADER;
+    wire_reach_entry(out + len, &self_addr, 0);
+    len += WIRE_REACH_ENTRY;
+    //a neighbor that is the way to a server hears it is unreachable from here, so its own way
+    //never runs back through here; held down servers are unreachable to everyone
+    for (int s = 0; s < server_count && len + WIRE_REACH_ENTRY <= REACH_MAX_SIZE; s++) {
+        int server_hops = servers[s].best == neighbor ? REACH_INFINITY : servers[s].best_hops;
+        wire_reach_entry(out + len, &servers[s].addr, server_hops);
+        len += WIRE_REACH_ENTRY;
+    }
+    return len;
+}
+
+//splitmix64 finalizer, so servers with close addresses still get unrelated weights
+static uint64_t weight(uint64_t channel_hash, uint64_t id) {
+    uint64_t x = channel_hash ^ (id * 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+int reach_core_hop(const char *channel) {
+    uint64_t channel_hash = name_hash(channel);
+    uint64_t best = weight(channel_hash, self_id);
+    int hop = -1;
+    for (int s = 0; s < server_count; s++) {
+        if (servers[s].best < 0) {
+            continue;
+        }
+        uint64_t w = weight(channel_hash, servers[s].id);
+        if (w > best) {
+            best = w;
+            hop = servers[s].best;
+        }
+    }
+    return hop;
+}
+
+void reach_get_stats(ReachStats *out) {
+    *out = stats;
+    out->servers = server_count + 1;
+}
@@ -0,0 +1,72 @@
+#ifndef REACH_H
+#define REACH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "wire.h"
+
+/* Which servers exist and which neighbor leads to each, for core-based
+ * trees (-R in the server).
+ *
+ * Servers only know their neighbors from the command line, so they tell
+ * each other the rest with REACH datagrams: every server a neighbor can
+ * reach and in how many hops, a distance vector as in RIP.  A REACH
+ * replaces everything its sender said before.  Servers the receiver is
+ * itself the way to are listed as REACH_INFINITY hops (poison reverse),
+ * which keeps two neighbors from counting up between themselves.  In a
+ * larger loop a stale route can still come back around, so a route that
+ * gets worse is not replaced straight away: the server is held down,
+ * advertised as unreachable and ignored for REACH_HOLDDOWN seconds, long
+ * enough for the old route to be withdrawn everywhere, and the best way
+ * left is taken after that.  A neighbor that sends nothing for
+ * REACH_TIMEOUT seconds is forgotten with everything it said.
+ *
+ * reach_core_hop() picks a channel's core from the known servers by
+ * rendezvous hashing: every server hashes the channel name with each
+ * server's address and the highest hash wins.  Servers that know the
+ * same set agree on every core without talking about channels at all,
+ * and a server that comes or goes only moves the channels it wins.
+ */
+
+#define REACH_MAX_SERVERS 128
+#define REACH_INFINITY 16
+/* Seconds between the REACHes every server sends each neighbor. */
+#define REACH_INTERVAL 10
+#define REACH_TIMEOUT (3 * REACH_INTERVAL + 5)
+/* Seconds a route that got worse stays unreachable. */
+#define REACH_HOLDDOWN (2 * REACH_INTERVAL)
+/* Largest REACH: this server and every other one. */
+#define REACH_MAX_SIZE (WIRE_V2_HEADER + (REACH_MAX_SERVERS + 1) * WIRE_REACH_ENTRY)
+
+typedef struct ReachStats {
+    int servers;      /* known, this one included */
+    uint64_t updates; /* REACHes taken in */
+    uint64_t changes;   /* updates or timeouts that changed a route */
+    uint64_t holddowns; /* routes held down for getting worse */
+} ReachStats;
+
+/* self is this server's address as its neighbors know it; neighbors is
+ * how many there are, numbered from 0.  Returns -1 if out of memory. */
+int reach_init(const struct sockaddr_in *self, int neighbors);
+
+/* Takes in a REACH from a neighbor.  Returns 1 if any route changed,
+ * so this server's own REACHes must go out again. */
+int reach_update(int neighbor, const WireMessage *reach, time_t now);
+
+/* Forgets neighbors not heard from in REACH_TIMEOUT seconds and ends
+ * hold-downs that are over.  Returns 1 if any route changed. */
+int reach_expire(time_t now);
+
+/* Builds the REACH for a neighbor in buf, REACH_MAX_SIZE bytes.
+ * Returns its length. */
+size_t reach_encode(int neighbor, void *buf);
+
+/* The neighbor on the way to the channel's core, or -1 if this server
+ * is the core. */
+int reach_core_hop(const char *channel);
+
+void reach_get_stats(ReachStats *stats);
+
+#endif
@@ -6,498 +6,1037 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include "duckchat.h"
+#include "index.h"
+#include "dedup.h"
+#include "netio.h"
+#include "event.h"
+#include "shard.h"
+#include "msgid.h"
+#include "log.h"
+#include "intern.h"
+#include "bitset.h"
+#include "wheel.h"
+#include "metrics.h"
+#include "wire.h"
+#include "coalesce.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "backlog.h"
+#include "admit.h"
+#include "reach.h"
 #include <cerrno>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include <time.h>
 
 #define BUFFER_SIZE 1024
+//default preallocated pool capacities, the pools grow past them when needed
 #define MAX_USERS 100
 #define MAX_CHANNELS 100
+//soft-state timing, in seconds
+#define SOFT_JOIN_INTERVAL 60
+#define SOFT_STATE_TIMEOUT 120
+#define STATS_INTERVAL 60
+//hand-offs received before the replies gathered from them must be flushed
+#define HANDOFF_RING 64
+
+//TXT_SAY and S2S_SAY share their channel, username and text fields, only the header differs
+#define SAY_PAYLOAD_SIZE (CHANNEL_MAX + USERNAME_MAX + SAY_MAX)
+static_assert(sizeof(struct text_say) == sizeof(text_t) + SAY_PAYLOAD_SIZE, "text_say layout");
+static_assert(sizeof(struct s2s_say) == offsetof(struct s2s_say, txt_channel) + SAY_PAYLOAD_SIZE, "s2s_say layout");
+static const text_t txt_say_header = TXT_SAY;
+static const unsigned char v2_txt_say_header[WIRE_V2_HEADER] = {WIRE_MAGIC, WIRE_TEXT | TXT_SAY};
+
+//the parts of an outgoing S2S_SAY a local SAY does not already carry
+struct say_frame {
+    request_t req_type;
+    uint64_t id;
+    char username[USERNAME_MAX];
+} packed;
+
+struct Channel;
 
 typedef struct User {
     char username[USERNAME_MAX];
     struct sockaddr_in addr;
     struct User *next;  
+    struct User *prev;
+    int fanout_slot; //position of addr in the list's fanout array
+    int version; //wire version of the user's requests, replies use the same one
+    //channels joined, kept on the users list entry only, so logout touches just these
+    struct Channel **joined;
+    int joined_count;
+    int joined_capacity;
 } User;
 
+//the indexes mirror the list so lookups never walk it
 typedef struct UserList {
     User *head;         
+    NameIndex by_name;
+    AddrIndex by_addr;
+    //every member's address packed together so delivery is one tight loop
+    struct sockaddr_in *fanout;
+    unsigned char *fanout_versions;
+    User **fanout_users;
+    int fanout_count;
+    int fanout_capacity;
 } UserList;
 
+//LIST or WHO reply pages in each wire version, built by the first request after a change
+typedef struct ReplyCache {
+    WirePages pages[2];
+    int valid[2];
+} ReplyCache;
+
 typedef struct Channel {
     char name[CHANNEL_MAX];
     struct UserList user_list;              
+    ReplyCache who; //dropped whenever a member joins or leaves
     struct Channel* next_channel;  
+    struct Channel* prev_channel;
     int user_count;
 } Channel;
 
 typedef struct channel_sub{
-    char name[CHANNEL_MAX];
+    int channel; //interned name, holds the route's reference
     struct channel_sub *next;
+    struct channel_sub *prev;
     time_t last_renewed;
+    WheelTimer renew;  //sends the soft join every SOFT_JOIN_INTERVAL
+    WheelTimer expiry; //pushed back by every join received for the channel
+    uint64_t tree; //with -T, the tree this server's tree links belong to
+    int upstream; //with -R, index of the neighbor on the way to the channel's core, -1 at the core
 }channel_sub;
 
 typedef struct Neighbor {
     struct sockaddr_in addr;
-    channel_sub* subscriptions;
+    int index; //bit position in every route's neighbor set
+    int version; //wire version of the last S2S message or HELLO it sent
+    uint64_t packets_in;
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+    int bundles; //unpacks BUNDLEs, from its HELLO
+    int trees; //builds channel trees, from its HELLO
     struct Neighbor *next;
+    CoalesceBundle bundle; //S2S messages waiting for the flush deadline, with -C
 } Neighbor;
 
-typedef struct MessageID {
-    uint64_t id;
-    time_t timestamp;
-    struct MessageID *next;
-} MessageID;
+//per interned channel: this server's subscription and the neighbors subscribed to it
+typedef struct Route {
+    int count; //bits set in the route's row of route_bits
+    channel_sub *sub;
+} Route;
 
-//global list of message ids
-MessageID *message_ids = NULL;
+//fixed-size records come from slab pools instead of malloc
+Pool user_pool;     //users list entries and channel members
+Pool channel_pool;
+Pool sub_pool;
+Pool neighbor_pool;
 
 //global list of all neighbors
 Neighbor *neighbors = NULL;
+//neighbors by index, so a set bit maps straight back to its neighbor
+Neighbor **neighbor_table = NULL;
+int neighbor_count = 0;
 //global list of all subscriptions
 channel_sub* subscriptions = NULL;
 
+//soft-state timers run from the wheel, outside any request, so they keep the socket here
+int server_sockfd = -1;
+//-T: links to neighbors that also run it form one loop-free tree per channel
+int tree_mode = 0;
+//-R: a channel's joins only travel toward its rendezvous core, see join_toward_core()
+int core_mode = 0;
+
 UserList users = {NULL};
 Channel *channels;
+//hash indexes over the channels and neighbors lists
+NameIndex channel_index = {NULL, 0, 0};
+AddrIndex neighbor_index = {NULL, 0, 0};
+//routes by channel id; route_bits holds route_words words per id, one bit per neighbor
+Route *routes = NULL;
+uint64_t *route_bits = NULL;
+int route_capacity = 0;
+int route_words = 0;
 int user_count = 0;
 int channel_count = 0;
 struct sockaddr_in server_addr;
 struct sockaddr_in server_addr_for_ip_display;
 
 Neighbor* find_neighbor_by_address(struct sockaddr_in *addr){
-    Neighbor* current = neighbors;
-    while (current) {
-        if (current->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
-            current->addr.sin_port == addr->sin_port) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
+    return (Neighbor*)addr_index_find(&neighbor_index, addr_key(addr));
 }
 
 Channel* find_channel_by_name(char *channel_name){
-    Channel *current = channels;
-    while (current != NULL) {
-        if (strcmp(current->name, channel_name) == 0) {
-            return current;
-        }
-        current = current->next_channel;
-    }
-    return NULL;
+    return (Channel*)name_index_find(&channel_index, channel_name);
 }
 
-int is_subscribed(Neighbor *neighbor, const char *channel_name) {
-    
-    channel_sub *subscription = neighbor->subscriptions;
-    while (subscription) {
-        if (strcmp(subscription->name, channel_name) == 0) {
-            return 1;
-        }
-        subscription = subscription->next;
+//neighbors are all added at startup, so the row width is fixed once the first route exists
+int route_reserve(int channel) {
+    if (channel < route_capacity) {
+        return 0;
+    }
+    int capacity = route_capacity ? route_capacity : 64;
+    while (capacity <= channel) {
+        capacity *= 2;
+    }
+    if (route_words == 0) {
+        route_words = BITSET_WORDS(neighbor_count > 0 ? neighbor_count : 1);
     }
-    return 0; 
+    Route *grown = (Route*)realloc(routes, capacity * sizeof(Route));
+    if (!grown) return -1;
+    routes = grown;
+    uint64_t *grown_bits = (uint64_t*)realloc(route_bits, (size_t)capacity * route_words * sizeof(uint64_t));
+    if (!grown_bits) return -1;
+    route_bits = grown_bits;
+    memset(routes + route_capacity, 0, (capacity - route_capacity) * sizeof(Route));
+    memset(route_bits + (size_t)route_capacity * route_words, 0,
+           (size_t)(capacity - route_capacity) * route_words * sizeof(uint64_t));
+    route_capacity = capacity;
+    return 0;
 }
 
-void send_s2s_leave(int sockfd, struct sockaddr_in *addr, const char *channel_name) {
+uint64_t *route_neighbors(int channel) {
+    return route_bits + (size_t)channel * route_words;
+}
 
-    struct s2s_leave leave_message;
+int route_live(int channel) {
+    return routes[channel].count > 0 || routes[channel].sub;
+}
 
-    leave_message.req_type = S2S_LEAVE; 
-    strncpy(leave_message.channel, channel_name, CHANNEL_MAX - 1);
-    leave_message.channel[CHANNEL_MAX - 1] = '\0';
+//a route keeps its name interned while any neighbor or this server is subscribed
+void route_changed(int channel, int was_live) {
+    int live = route_live(channel);
+    if (live && !was_live) {
+        intern_retain(channel);
+    } else if (!live && was_live) {
+        intern_release(channel);
+    }
+}
 
-    if (sendto(sockfd, &leave_message, sizeof(leave_message), 0, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
-        printf("Error sending S2S Leave");
-    } else {
-        printf("%s:%d %s:%d send S2S Leave %s\n", inet_ntoa(server_addr.sin_addr), ntohs(server_addr.sin_port), inet_ntoa(addr->sin_addr), ntohs(addr->sin_port),channel_name);
+int is_subscribed(Neighbor *neighbor, int channel) {
+    if (channel == INTERN_NONE || channel >= route_capacity) {
+        return 0;
     }
-    
+    return bitset_test(route_neighbors(channel), neighbor->index);
 }
 
-//here is a function to check if the conditions for pruning have been met 
-int should_send_leave(char *channel_name) { 
+void count_neighbor_send(Neighbor *neighbor, int kind, size_t len) {
+    metrics_sent(kind, len, 1);
+    if (neighbor) {
+        neighbor->packets_out++;
+        neighbor->bytes_out += len;
+    }
+}
 
-    Channel *channel = find_channel_by_name(channel_name);
-    int sub_neighbors = 0;
-    int at_least_1_local_user = 0;
+//with -C, S2S messages to neighbors that unpack bundles are packed together
+int neighbor_coalesces(Neighbor *neighbor) {
+    return neighbor && neighbor->bundles && neighbor->version == WIRE_V2 && coalesce_enabled();
+}
 
-    //if channel exists and has local users 
-    if (channel && channel->user_list.head) {
-        at_least_1_local_user = 1;
-    }
+//with -T, channels are joined over tree links to neighbors that said they build trees
+int neighbor_in_tree(Neighbor *neighbor) {
+    return tree_mode && neighbor->trees && neighbor->version == WIRE_V2;
+}
 
-    //count subscribed users to channel
-    Neighbor *current = neighbors;
-    while (current) {
-        if (is_subscribed(current, channel_name)) {
-            sub_neighbors++;
-        }
-        current = current->next;
+//queues an S2S message that lives in a local buffer, copying it either way
+int neighbor_send(int sockfd, Neighbor *neighbor, const void *message, size_t len, struct sockaddr_in *addr) {
+    if (neighbor_coalesces(neighbor)) {
+        struct iovec iov = {(void *)message, len};
+        return coalesce_add(&neighbor->bundle, &iov, 1);
     }
-    
-    return ((at_least_1_local_user == 0) && (sub_neighbors == 1));
+    return net_send(sockfd, message, len, addr);
 }
 
-void leave_channel(int sockfd, Neighbor *neighbor, char *channel_name) {
-    if (!neighbor || !channel_name) return;
+void send_s2s_leave(int sockfd, struct sockaddr_in *addr, const char *channel_name) {
 
-    // Remove the channel subscription from the neighbor
-    channel_sub *current = neighbor->subscriptions;
-    channel_sub *prev = NULL;
+    Neighbor *neighbor = find_neighbor_by_address(addr);
+    WireMessage leave;
+    wire_message(&leave, S2S_LEAVE);
+    strncpy(leave.channel, channel_name, CHANNEL_MAX - 1);
+    char leave_message[sizeof(struct s2s_leave)];
+    size_t len = wire_encode(neighbor ? neighbor->version : WIRE_V1, &leave, leave_message, sizeof(leave_message));
 
-    while (current) {
-        if (strcmp(current->name, channel_name) == 0) {
-     
-            if (prev == NULL) {
-                neighbor->subscriptions = current->next; // Remove head
-            } else {
-                prev->next = current->next; // Remove middle or tail
-            }
+    if (neighbor_send(sockfd, neighbor, leave_message, len, addr) < 0) {
+        log_error("Error sending S2S Leave");
+    } else {
+        count_neighbor_send(neighbor, S2S_LEAVE, len);
+        log_trace(LOG_EVENT_S2S_LEAVE_SEND, addr, channel_name);
+    }
+    
+}
 
-            /*printf("Neighbor %s:%d unsubscribed from channel %s\n",
-                   inet_ntoa(neighbor->addr.sin_addr), ntohs(neighbor->addr.sin_port), channel_name);*/
-            free(current);
+//tells a peer which wire versions this server speaks
+void send_hello(int sockfd, struct sockaddr_in *addr, int flags) {
+    WireMessage hello;
+    wire_message(&hello, WIRE_HELLO);
+    hello.hello_version = WIRE_V2;
+    hello.hello_flags = flags | WIRE_HELLO_BUNDLES | (tree_mode ? WIRE_HELLO_TREE : 0);
+    char buffer[WIRE_V2_HEADER + 2];
+    size_t len = wire_encode(WIRE_V2, &hello, buffer, sizeof(buffer));
+    if (net_send(sockfd, buffer, len, addr) == 0) {
+        metrics_sent(METRICS_HELLO, len, 1);
+    }
+}
 
-            // Check if thi
+//here is a function to check if the conditions for pruning have been met 
+int should_send_leave(int channel) { 
+    //core trees are pruned by LEAVEs when interest goes, not by SAYs that find none
+    if (core_mode || channel == INTERN_NONE || channel >= route_capacity) {
+        return 0;
+    }
 
-            return; 
-        }
-        prev = current;
-        current = current->next;
+    //if channel exists and has local users 
+    Channel *local = find_channel_by_name((char*)intern_name(channel));
+    if (local && local->user_list.head) {
+        return 0;
     }
 
-    printf("Neighbor %s:%d was not subscribed to channel %s\n",
-           inet_ntoa(neighbor->addr.sin_addr), ntohs(neighbor->addr.sin_port), channel_name);
+    //count subscribed neighbors to channel
+    return routes[channel].count == 1;
 }
 
-void handle_s2s_leave(int sockfd, struct sockaddr_in *sender, struct s2s_leave *buffer) {
-    if (!sender || !buffer) return;
+void leave_channel(int sockfd, Neighbor *neighbor, int channel) {
+    if (!neighbor) return;
 
-    char *channel_name = buffer->channel;
-
-    // Find the neighbor corresponding to the sender
-    Neighbor *neighbor = find_neighbor_by_address(sender);
-    if (!neighbor) {
-        printf("unknown neighbor");
+    if (!is_subscribed(neighbor, channel)) {
+        if (channel != INTERN_NONE) {
+            log_debug("Neighbor %s:%d was not subscribed to channel %s",
+                      inet_ntoa(neighbor->addr.sin_addr), ntohs(neighbor->addr.sin_port), intern_name(channel));
+        }
         return;
     }
 
-    printf("%s:%d %s:%d recv S2S Leave %s\n", inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(server_addr.sin_port), inet_ntoa(sender->sin_addr), ntohs(sender->sin_port),
-           channel_name);
-
-    // Remove the neighbor's subscription to the channel
-    leave_channel(sockfd, neighbor, channel_name);
-
+    log_debug("Neighbor %s:%d unsubscribed from channel %s",
+              inet_ntoa(neighbor->addr.sin_addr), ntohs(neighbor->addr.sin_port), intern_name(channel));
+    int was_live = route_live(channel);
+    bitset_clear(route_neighbors(channel), neighbor->index);
+    routes[channel].count--;
+    route_changed(channel, was_live);
 }
 
-void add_channel_to_neighbor(Neighbor *neighbor, char* channel_name){
-    channel_sub* current = neighbor->subscriptions; 
-    while (current){
-        if(strcmp(current->name, channel_name) == 0){
-            return; 
-        }
-        current = current->next;
+void add_channel_to_neighbor(Neighbor *neighbor, int channel){
+    if (route_reserve(channel) < 0) {
+        log_error("Failed to allocate neighbor subscription");
+        return;
     }
-    channel_sub* new_sub = (channel_sub*)malloc(sizeof(channel_sub));
-    if(!new_sub){
-        printf("Failed ");
+    uint64_t *subscribed = route_neighbors(channel);
+    if (bitset_test(subscribed, neighbor->index)) {
         return;
     }
+    int was_live = route_live(channel);
+    bitset_set(subscribed, neighbor->index);
+    routes[channel].count++;
+    route_changed(channel, was_live);
+}
 
-    strncpy(new_sub->name, channel_name, CHANNEL_MAX-1);
-    new_sub->name[CHANNEL_MAX-1] = '\0';
-    new_sub->next = neighbor->subscriptions;
-    neighbor->subscriptions = new_sub;
+void subscribe_all_neighbors(int channel){
+    if (neighbor_count == 0) {
+        return;
+    }
+    if (route_reserve(channel) < 0) {
+        log_error("Failed to allocate neighbor subscription");
+        return;
+    }
+    //tree neighbors are linked one by one, see handle_tree()
+    if (tree_mode) {
+        for (int i = 0; i < neighbor_count; i++) {
+            if (!neighbor_in_tree(neighbor_table[i])) {
+                add_channel_to_neighbor(neighbor_table[i], channel);
+            }
+        }
+        return;
+    }
+    //fill whole words, then trim the bits past the last neighbor
+    uint64_t *subscribed = route_neighbors(channel);
+    int was_live = route_live(channel);
+    for (int w = 0; w < route_words; w++) {
+        subscribed[w] = ~0ULL;
+    }
+    if (neighbor_count & 63) {
+        subscribed[route_words - 1] = (1ULL << (neighbor_count & 63)) - 1;
+    }
+    routes[channel].count = neighbor_count;
+    route_changed(channel, was_live);
 }
 
-void subscribe_all_neighbors(char* channel_name){
-    Neighbor* current = neighbors;
-    while(current){
-        add_channel_to_neighbor(current, channel_name);
-        current = current->next;
+void send_s2s_join(int sockfd, Neighbor *neighbor, const char *channel_name, int is_soft_join) {
+    WireMessage join;
+    wire_message(&join, S2S_JOIN);
+    strncpy(join.channel, channel_name, CHANNEL_MAX - 1);
+    char join_message[sizeof(struct request_join)];
+    size_t len = wire_encode(neighbor->version, &join, join_message, sizeof(join_message));
+
+    if (neighbor_send(sockfd, neighbor, join_message, len, &neighbor->addr) < 0) {
+        log_error("Error sending S2S Join");
+    } else {
+        count_neighbor_send(neighbor, S2S_JOIN, len);
+        log_trace(is_soft_join ? LOG_EVENT_S2S_SOFT_JOIN_SEND : LOG_EVENT_S2S_JOIN_SEND, &neighbor->addr, channel_name);
     }
 }
 
-void broadcast_s2s_join(int sockfd, struct sockaddr_in *sender ,char* channel_name, int is_soft_join){
-    struct request_join join_message;
-    join_message.req_type = S2S_JOIN;
-    strncpy(join_message.req_channel, channel_name, CHANNEL_MAX-1);
-    join_message.req_channel[CHANNEL_MAX-1] = '\0';
+void broadcast_s2s_join(int sockfd, struct sockaddr_in *sender ,const char* channel_name, int is_soft_join){
+    WireMessage join;
+    wire_message(&join, S2S_JOIN);
+    strncpy(join.channel, channel_name, CHANNEL_MAX-1);
+    //encoded once per version, the first time a neighbor speaking it comes up
+    char join_message[2][sizeof(struct request_join)];
+    size_t len[2] = {0, 0};
 
     Neighbor *current = neighbors;
 
-    //evalute address for printing 
-    struct sockaddr_in actual_addr;
-    socklen_t addr_len = sizeof(actual_addr);
-    getsockname(sockfd, (struct sockaddr *)&actual_addr, &addr_len);
-
     //if the sender is NULL than the broadcast was triggered by a local join 
     while(current){
-        if(find_neighbor_by_address(&(current->addr))){
-            if (!sender || current->addr.sin_addr.s_addr != sender->sin_addr.s_addr || current->addr.sin_port != sender->sin_port){
-                sendto(sockfd, &join_message, sizeof(join_message), 0, (struct sockaddr*)&current->addr, sizeof(current->addr));
-                if(is_soft_join){
-                    printf("%s:%d %s:%d send S2S soft Join %s\n",
-                   inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(actual_addr.sin_port),
-                   inet_ntoa(current->addr.sin_addr), ntohs(current->addr.sin_port),
-                   channel_name);
-                }else{
-                 printf("%s:%d %s:%d send S2S Join %s\n",
-                   inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(actual_addr.sin_port),
-                   inet_ntoa(current->addr.sin_addr), ntohs(current->addr.sin_port),
-                   channel_name);
-                }
-
+        //tree neighbors are offered the tree instead
+        if (!neighbor_in_tree(current) &&
+            (!sender || current->addr.sin_addr.s_addr != sender->sin_addr.s_addr || current->addr.sin_port != sender->sin_port)){
+            int v = current->version - 1;
+            if (!len[v]) {
+                len[v] = wire_encode(current->version, &join, join_message[v], sizeof(join_message[v]));
             }
+            neighbor_send(sockfd, current, join_message[v], len[v], &current->addr);
+            count_neighbor_send(current, S2S_JOIN, len[v]);
+            log_trace(is_soft_join ? LOG_EVENT_S2S_SOFT_JOIN_SEND : LOG_EVENT_S2S_JOIN_SEND,
+                      &current->addr, channel_name);
         }
         current = current->next; 
     }
 }
 
-void broadcast_s2s_say(int sockfd, struct s2s_say* message, struct sockaddr_in* sender) {
+//offers the channel's tree (flags 0) or keeps a link to it (WIRE_TREE_LINK)
+void send_tree(int sockfd, Neighbor *neighbor, int channel, int flags) {
+    WireMessage tree;
+    wire_message(&tree, WIRE_TREE);
+    tree.id = routes[channel].sub->tree;
+    tree.tree_flags = flags;
+    strncpy(tree.channel, intern_name(channel), CHANNEL_MAX - 1);
+    char message[WIRE_V2_HEADER + WIRE_V2_ID_SIZE + 1 + CHANNEL_MAX];
+    size_t len = wire_encode(WIRE_V2, &tree, message, sizeof(message));
+
+    if (neighbor_send(sockfd, neighbor, message, len, &neighbor->addr) < 0) {
+        log_error("Error sending S2S Tree");
+    } else {
+        count_neighbor_send(neighbor, METRICS_TREE, len);
+        log_trace(flags & WIRE_TREE_LINK ? LOG_EVENT_TREE_LINK_SEND : LOG_EVENT_TREE_OFFER_SEND,
+                  &neighbor->addr, tree.channel);
+    }
+}
 
-    Neighbor *current = neighbors;
-    while (current) {
+void offer_tree(int sockfd, int channel, Neighbor *except) {
+    for (Neighbor *current = neighbors; current; current = current->next) {
+        if (current != except && neighbor_in_tree(current)) {
+            send_tree(sockfd, current, channel, 0);
+        }
+    }
+}
+
+//largest encoding of one SAY frame in each version
+#define SAY_SLOT_SIZE(version, text_len) ((version) == WIRE_V1 ? sizeof(struct s2s_say) : WIRE_V2_SAY_OVERHEAD + (text_len))
+
+//one SAY in the encoding each destination wants, indexed by version - 1. Frames that can be
+//gathered from the received datagram are set up by the handler; the others get a slot from
+//say_frames_reserve and are encoded the first time a destination needs them
+typedef struct SayFrames {
+    const WireMessage *say;
+    struct iovec text[2][4]; //TXT_SAY for users
+    int text_parts[2];
+    char *text_slot[2];
+    struct iovec s2s[2][4];  //S2S_SAY for neighbors
+    int s2s_parts[2];
+    char *s2s_slot[2];
+} SayFrames;
+
+//one frame area allocation: extra bytes for the caller, then a slot per frame not set up yet
+char *say_frames_reserve(SayFrames *frames, size_t extra) {
+    size_t size = extra;
+    for (int v = 0; v < 2; v++) {
+        size += (frames->text_parts[v] ? 0 : SAY_SLOT_SIZE(v + 1, frames->say->text_len)) +
+                (frames->s2s_parts[v] ? 0 : SAY_SLOT_SIZE(v + 1, frames->say->text_len));
+    }
+    char *area = (char *)net_frame_alloc(size);
+    if (!area) {
+        return NULL;
+    }
+    char *slot = area + extra;
+    for (int v = 0; v < 2; v++) {
+        if (!frames->text_parts[v]) {
+            frames->text_slot[v] = slot;
+            slot += SAY_SLOT_SIZE(v + 1, frames->say->text_len);
+        }
+        if (!frames->s2s_parts[v]) {
+            frames->s2s_slot[v] = slot;
+            slot += SAY_SLOT_SIZE(v + 1, frames->say->text_len);
+        }
+    }
+    return area;
+}
+
+static void say_encode(SayFrames *frames, int version, int type, char *slot, struct iovec *iov, int *parts) {
+    WireMessage msg = *frames->say;
+    msg.type = type;
+    iov[0].iov_base = slot;
+    iov[0].iov_len = wire_encode(version, &msg, slot, SAY_SLOT_SIZE(version, msg.text_len));
+    *parts = 1;
+}
+
+const struct iovec *say_text_frame(SayFrames *frames, int version, int *parts) {
+    int v = version - 1;
+    if (!frames->text_parts[v]) {
+        say_encode(frames, version, WIRE_TEXT | TXT_SAY, frames->text_slot[v], frames->text[v], &frames->text_parts[v]);
+    }
+    *parts = frames->text_parts[v];
+    return frames->text[v];
+}
+
+const struct iovec *say_s2s_frame(SayFrames *frames, int version, int *parts) {
+    int v = version - 1;
+    if (!frames->s2s_parts[v]) {
+        say_encode(frames, version, S2S_SAY, frames->s2s_slot[v], frames->s2s[v], &frames->s2s_parts[v]);
+    }
+    *parts = frames->s2s_parts[v];
+    return frames->s2s[v];
+}
+
+size_t frame_len(const struct iovec *frame, int parts) {
+    size_t len = 0;
+    for (int i = 0; i < parts; i++) {
+        len += frame[i].iov_len;
+    }
+    return len;
+}
+
+//returns the number of neighbors the SAY was sent to
+int broadcast_s2s_say(int sockfd, SayFrames *frames, struct sockaddr_in* sender) {
+
+    //only subscribed neighbors have their bit set, no need to check the others
+    const WireMessage *say = frames->say;
+    int channel = intern_find(say->channel);
+    if (channel == INTERN_NONE || channel >= route_capacity) {
+        return 0;
+    }
+    int sent = 0;
+    uint64_t *subscribed = route_neighbors(channel);
+    for (int i = bitset_next(subscribed, route_words, 0); i >= 0; i = bitset_next(subscribed, route_words, i + 1)) {
+        Neighbor *current = neighbor_table[i];
         //dont send too sender
-        if (sender && ntohl(current->addr.sin_addr.s_addr) == ntohl(sender->sin_addr.s_addr) && ntohs(current->addr.sin_port) == ntohs(sender->sin_port)) {
-            current = current->next;
+        if (sender && current->addr.sin_addr.s_addr == sender->sin_addr.s_addr && current->addr.sin_port == sender->sin_port) {
             continue;
         }
-        if (is_subscribed(current, message->txt_channel) && (!sender || current->addr.sin_addr.s_addr != sender->sin_addr.s_addr || current->addr.sin_port != sender->sin_port)) {
-            if (sendto(sockfd, message, sizeof(*message), 0, (struct sockaddr*)&current->addr, sizeof(current->addr)) < 0) {
-                perror("Error broadcasting S2S_SAY");
-            } else {
-                printf("%s:%d %s:%d send S2S_SAY %s \"%s\"\n", inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(server_addr.sin_port), inet_ntoa(current->addr.sin_addr), ntohs(current->addr.sin_port),
-                    message->txt_channel, message->txt_text);
+        int parts;
+        const struct iovec *frame = say_s2s_frame(frames, current->version, &parts);
+        int queued = neighbor_coalesces(current) ? coalesce_add(&current->bundle, frame, parts)
+                                                 : net_sendv(sockfd, frame, parts, &current->addr);
+        if (queued < 0) {
+            log_error("Error broadcasting S2S_SAY");
+        } else {
+            count_neighbor_send(current, S2S_SAY, frame_len(frame, parts));
+            sent++;
+            log_trace_text(LOG_EVENT_S2S_SAY_SEND, &current->addr, say->channel, say->text, say->text_len);
+        }
+    }
+    return sent;
+}
 
-            }
-        }else{
-            printf("checked, not subscribed!");
+//with -R a channel's tree grows toward its core (see reach.h) instead of being flooded: a
+//subscription joins only the neighbor on the way there, which subscribes and joins on in
+//turn until the join reaches the core or a server already in the tree. SAYs then travel
+//the tree's links both ways, so only servers with users in a channel, and the ones on
+//their way to its core, keep any state for it. When routes change and the way to the core
+//moves, the old neighbor is left and the new one joined
+void join_toward_core(int sockfd, int channel, int is_soft_join) {
+    channel_sub *sub = routes[channel].sub;
+    int hop = reach_core_hop(intern_name(channel));
+    if (hop != sub->upstream) {
+        if (sub->upstream >= 0) {
+            Neighbor *old = neighbor_table[sub->upstream];
+            send_s2s_leave(sockfd, &old->addr, intern_name(channel));
+            leave_channel(sockfd, old, channel);
+        }
+        sub->upstream = hop;
+    }
+    if (hop >= 0) {
+        Neighbor *upstream = neighbor_table[hop];
+        add_channel_to_neighbor(upstream, channel);
+        send_s2s_join(sockfd, upstream, intern_name(channel), is_soft_join);
+    }
+}
+
+int remove_channel_sub(int channel) {
+    channel_sub *current = channel != INTERN_NONE && channel < route_capacity ? routes[channel].sub : NULL;
+    if (!current) {
+        // If the channel is not found in the list
+        log_debug("channel %s not found in server subscriptions", channel != INTERN_NONE ? intern_name(channel) : "?");
+        return 0;
+    }
+
+    if (current->prev == NULL) {
+        subscriptions = current->next; 
+    } else {
+        current->prev->next = current->next; 
+    }
+    if (current->next) {
+        current->next->prev = current->prev;
+    }
+    wheel_cancel(&current->renew);
+    wheel_cancel(&current->expiry);
+    int was_live = route_live(channel);
+    routes[channel].sub = NULL;
+    pool_free(&sub_pool, current);
+    route_changed(channel, was_live);
+    return 1; 
+}
+
+//with -R, once neither local users nor neighbors further from the core need a channel it is
+//left toward the core. A LEAVE from the way to the core while something here still needs
+//the channel is answered with a join, so the link is made again
+void core_prune(int sockfd, int channel, Neighbor *from) {
+    channel_sub *sub = channel != INTERN_NONE && channel < route_capacity ? routes[channel].sub : NULL;
+    if (!sub) {
+        return;
+    }
+    Channel *local = find_channel_by_name((char *)intern_name(channel));
+    int downstream = routes[channel].count;
+    if (sub->upstream >= 0 && bitset_test(route_neighbors(channel), sub->upstream)) {
+        downstream--;
+    }
+    if ((local && local->user_list.head) || downstream > 0) {
+        if (from && from->index == sub->upstream) {
+            join_toward_core(sockfd, channel, 0);
+        }
+        return;
+    }
+    if (sub->upstream >= 0) {
+        Neighbor *upstream = neighbor_table[sub->upstream];
+        if (is_subscribed(upstream, channel)) {
+            send_s2s_leave(sockfd, &upstream->addr, intern_name(channel));
+            leave_channel(sockfd, upstream, channel);
+        }
+    }
+    metrics.prunes++;
+    remove_channel_sub(channel);
+}
+
+//routes changed, so a channel's core or the way to it may have moved
+void core_rehome_all(int sockfd) {
+    channel_sub *sub = subscriptions;
+    while (sub) {
+        channel_sub *next = sub->next;
+        if (reach_core_hop(intern_name(sub->channel)) != sub->upstream) {
+            metrics.core_moves++;
+            join_toward_core(sockfd, sub->channel, 0);
+            //a server left with nothing but its old way to the core drops out
+            core_prune(sockfd, sub->channel, NULL);
         }
-        current = current->next;
+        sub = next;
+    }
+}
+
+void handle_s2s_leave(int sockfd, struct sockaddr_in *sender, WireMessage *req) {
+    if (!sender || !req) return;
+
+    char *channel_name = req->channel;
+
+    // Find the neighbor corresponding to the sender
+    Neighbor *neighbor = find_neighbor_by_address(sender);
+    if (!neighbor) {
+        log_warn("S2S Leave from unknown neighbor %s:%d", inet_ntoa(sender->sin_addr), ntohs(sender->sin_port));
+        return;
+    }
+    neighbor->version = req->version;
+
+    log_trace(LOG_EVENT_S2S_LEAVE_RECV, sender, channel_name);
+
+    // Remove the neighbor's subscription to the channel
+    int channel = intern_find(channel_name);
+    if (channel == INTERN_NONE) {
+        log_debug("Neighbor %s:%d was not subscribed to channel %s",
+                  inet_ntoa(neighbor->addr.sin_addr), ntohs(neighbor->addr.sin_port), channel_name);
+        return;
+    }
+    leave_channel(sockfd, neighbor, channel);
+    if (core_mode) {
+        core_prune(sockfd, channel, neighbor);
     }
 }
 
-int add_channel_sub(char* channel_name){
-    channel_sub* current = subscriptions; 
-    while (current){
-        if(strcmp(current->name, channel_name) == 0){
-            return 0; 
+//send join every 60 seconds.
+void renew_subscription(WheelTimer *timer, void *arg) {
+    channel_sub *sub = (channel_sub*)arg;
+    if (core_mode) {
+        join_toward_core(server_sockfd, sub->channel, 1);
+        wheel_schedule(timer, SOFT_JOIN_INTERVAL * 1000L);
+        return;
+    }
+    subscribe_all_neighbors(sub->channel);
+    broadcast_s2s_join(server_sockfd, NULL, intern_name(sub->channel), 1);
+    //tree links are kept up one by one, the tree is not offered again
+    uint64_t *subscribed = route_neighbors(sub->channel);
+    for (int i = bitset_next(subscribed, route_words, 0); i >= 0; i = bitset_next(subscribed, route_words, i + 1)) {
+        if (neighbor_in_tree(neighbor_table[i])) {
+            send_tree(server_sockfd, neighbor_table[i], sub->channel, WIRE_TREE_LINK);
         }
-        current = current->next;
     }
-    channel_sub* new_sub = (channel_sub*)malloc(sizeof(channel_sub));
+    wheel_schedule(timer, SOFT_JOIN_INTERVAL * 1000L);
+}
+
+//no join for this channel in SOFT_STATE_TIMEOUT seconds
+void expire_subscription(WheelTimer *timer, void *arg) {
+    channel_sub *sub = (channel_sub*)arg;
+    int channel = sub->channel;
+    const char *channel_name = intern_name(channel);
+    //with -R nobody sends joins toward the edge of a tree, local users keep it up there
+    Channel *local = core_mode ? find_channel_by_name((char *)channel_name) : NULL;
+    if (local && local->user_list.head) {
+        sub->last_renewed = time(NULL);
+        wheel_schedule(timer, (SOFT_STATE_TIMEOUT + 1) * 1000L);
+        return;
+    }
+    log_debug("channel %s expired after %.0fs", channel_name, difftime(time(NULL), sub->last_renewed));
+    metrics.expiries++;
+
+    //send a leave to every subscribed neighbor
+    uint64_t *subscribed = route_neighbors(channel);
+    for (int i = bitset_next(subscribed, route_words, 0); i >= 0; i = bitset_next(subscribed, route_words, i + 1)) {
+        Neighbor *neighbor = neighbor_table[i];
+        send_s2s_leave(server_sockfd, &neighbor->addr, channel_name); //send leave 
+        leave_channel(server_sockfd, neighbor, channel); //remove locally in forwarding table 
+    }
+    remove_channel_sub(channel); //channel did not receive soft join so remove it from subscriptions list
+}
+
+int add_channel_sub(int channel){
+    if (route_reserve(channel) < 0) {
+        log_error("Failed to allocate channel subscription");
+        return -1;
+    }
+    if (routes[channel].sub) {
+        return 0;
+    }
+    channel_sub* new_sub = (channel_sub*)pool_alloc(&sub_pool);
     if(!new_sub){
-        printf("Failed bad things happend, everybody take cover");
+        log_error("Failed to allocate channel subscription");
         return -1;
     }
 
-    strncpy(new_sub->name, channel_name, CHANNEL_MAX-1);
-    new_sub->name[CHANNEL_MAX-1] = '\0';
+    new_sub->channel = channel;
+    new_sub->prev = NULL;
     new_sub->next = subscriptions;
+    if (subscriptions) {
+        subscriptions->prev = new_sub;
+    }
     new_sub->last_renewed = time(NULL);
+    new_sub->upstream = -1;
     subscriptions = new_sub;
-    //printf("channel added to server: %s\n", channel_name);
+    int was_live = route_live(channel);
+    routes[channel].sub = new_sub;
+    route_changed(channel, was_live);
+    wheel_timer_init(&new_sub->renew, renew_subscription, new_sub);
+    wheel_timer_init(&new_sub->expiry, expire_subscription, new_sub);
+    wheel_schedule(&new_sub->renew, SOFT_JOIN_INTERVAL * 1000L);
+    wheel_schedule(&new_sub->expiry, (SOFT_STATE_TIMEOUT + 1) * 1000L);
     return 1;
 }
 
-int remove_channel_sub(char *channel_name) {
-
-    channel_sub *current = subscriptions;
-    channel_sub *prev = NULL;
+//a new subscription subscribes every neighbor outside the trees and sends it a join, and
+//offers tree neighbors a new tree with this server at its root
+void flood_subscription(int sockfd, int channel, struct sockaddr_in *sender) {
+    if (core_mode) {
+        join_toward_core(sockfd, channel, 0);
+        return;
+    }
+    subscribe_all_neighbors(channel);
+    broadcast_s2s_join(sockfd, sender, intern_name(channel), 0);
+    if (tree_mode) {
+        routes[channel].sub->tree = msgid_next_ordered();
+        offer_tree(sockfd, channel, NULL);
+    }
+}
 
-    // Traverse the subscriptions list
-    while (current) {
-        if (strcmp(current->name, channel_name) == 0) { 
-            if (prev == NULL) {
-                subscriptions = current->next; 
-            } else {
-                prev->next = current->next; 
+//links this server to the tree through parent and offers the tree on. The links of a
+//tree it was in before are dropped at both ends, so no loop is left through them
+void adopt_tree(int sockfd, int channel, uint64_t tree, Neighbor *parent) {
+    int added = add_channel_sub(channel);
+    if (added < 0) {
+        return;
+    }
+    if (added == 0) {
+        metrics.tree_switches++;
+        uint64_t *subscribed = route_neighbors(channel);
+        for (int i = bitset_next(subscribed, route_words, 0); i >= 0; i = bitset_next(subscribed, route_words, i + 1)) {
+            Neighbor *neighbor = neighbor_table[i];
+            if (neighbor_in_tree(neighbor)) {
+                send_s2s_leave(sockfd, &neighbor->addr, intern_name(channel));
+                leave_channel(sockfd, neighbor, channel);
             }
-
-            free(current); 
-            return 1; 
         }
+    }
+    routes[channel].sub->tree = tree;
+    add_channel_to_neighbor(parent, channel);
+    metrics.tree_links++;
+    send_tree(sockfd, parent, channel, WIRE_TREE_LINK);
+    offer_tree(sockfd, channel, parent);
+    if (added > 0) {
+        subscribe_all_neighbors(channel);
+        broadcast_s2s_join(sockfd, NULL, intern_name(channel), 0);
+    }
+}
 
-        prev = current;  
-        current = current->next; 
+//with -T a channel's tree grows from the server that subscribed first: each server links
+//to the first neighbor that offers it the tree and offers it to the rest. Taking an offer
+//of a tree it is already in would close a loop, so it is refused, and SAYs then only
+//travel tree links. Trees started at the same time merge into the one with the lower
+//number, links are kept up by soft state, and a LEAVE drops one like any subscription
+void handle_tree(int sockfd, struct sockaddr_in *sender, WireMessage *req) {
+    Neighbor *neighbor = find_neighbor_by_address(sender);
+    if (!neighbor) {
+        log_warn("S2S Tree from unknown neighbor %s:%d", inet_ntoa(sender->sin_addr), ntohs(sender->sin_port));
+        return;
+    }
+    neighbor->version = req->version;
+    int link = (req->tree_flags & WIRE_TREE_LINK) != 0;
+    log_trace(link ? LOG_EVENT_TREE_LINK_RECV : LOG_EVENT_TREE_OFFER_RECV, sender, req->channel);
+    if (!tree_mode) {
+        return;
     }
+    //it is only sent to servers that build trees, so this stands in for a HELLO that was lost
+    neighbor->trees = 1;
 
-    // If the channel is not found in the list
-    printf("channel %s not found in server subscriptions\n", channel_name);
-    return 0; 
+    int channel = intern_acquire(req->channel);
+    if (channel == INTERN_NONE) {
+        return;
+    }
+    channel_sub *sub = channel < route_capacity ? routes[channel].sub : NULL;
+    if (!sub || req->id < sub->tree) {
+        adopt_tree(sockfd, channel, req->id, neighbor);
+    } else if (req->id > sub->tree) {
+        //ours is older, the sender moves over when it gets the offer
+        send_tree(sockfd, neighbor, channel, 0);
+    } else if (link) {
+        if (!is_subscribed(neighbor, channel)) {
+            metrics.tree_links++;
+        }
+        add_channel_to_neighbor(neighbor, channel);
+        sub->last_renewed = time(NULL);
+        wheel_schedule(&sub->expiry, (SOFT_STATE_TIMEOUT + 1) * 1000L);
+    } else {
+        metrics.tree_loops++;
+    }
+    intern_release(channel);
 }
 
 User* find_user_by_address(UserList *user_list, struct sockaddr_in *addr) {
-    User *current = user_list->head;
-    while (current) {
-        if (current->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
-            current->addr.sin_port == addr->sin_port) {
-            return current;
-        }
-        current = current->next;
-    }
-    return NULL;
+    return (User*)addr_index_find(&user_list->by_addr, addr_key(addr));
 }
 
-void handle_s2s_join(int sockfd, struct sockaddr_in *sender, struct request_join *buffer){
+void handle_s2s_join(int sockfd, struct sockaddr_in *sender, WireMessage *req){
 
-    char* channel_name = buffer->req_channel;
+    char* channel_name = req->channel;
     Neighbor* send_neighbor = find_neighbor_by_address(sender);
-    if (send_neighbor) {//check if there is a neighbor ie if its a join sent from a noneighbor 
-        channel_sub *current = subscriptions;
-        while (current) {
-            if (strcmp(current->name, channel_name) == 0) {
-                current->last_renewed = time(NULL);
-                break;
-            }
-            current = current->next;
-        }
+    if (send_neighbor) {
+        send_neighbor->version = req->version;
     }
-
-    if(find_neighbor_by_address(sender)){//check if neighbor exists
-        add_channel_to_neighbor(send_neighbor, channel_name);// still subscribe neighbor even if channel already exists 
-        if(add_channel_sub(channel_name)){
-            subscribe_all_neighbors(channel_name); //subscribe everybody if this is a new channel join 
-            broadcast_s2s_join(sockfd, sender ,channel_name, 0); //broadcast since this is a new join
+    //the name is interned once here, everything below works on the id
+    int channel = send_neighbor ? intern_acquire(channel_name) : INTERN_NONE;
+    if (channel != INTERN_NONE) {//check if there is a neighbor ie if its a join sent from a noneighbor 
+        if (channel < route_capacity && routes[channel].sub) {
+            routes[channel].sub->last_renewed = time(NULL);
+            wheel_schedule(&routes[channel].sub->expiry, (SOFT_STATE_TIMEOUT + 1) * 1000L);
         }
+        add_channel_to_neighbor(send_neighbor, channel);// still subscribe neighbor even if channel already exists 
+        if(add_channel_sub(channel) > 0){
+            flood_subscription(sockfd, channel, sender); //subscribe everybody if this is a new channel join 
+        }
+        intern_release(channel);
     }
-    printf("%s:%d %s:%d recv S2S Join %s\n", inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(server_addr.sin_port), inet_ntoa(sender->sin_addr), ntohs(sender->sin_port),
-           channel_name);
+    log_trace(LOG_EVENT_S2S_JOIN_RECV, sender, channel_name);
 
 }
 
-void send_error(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, const char *error_message) {
-    struct text_error response;
-    response.txt_type = TXT_ERROR;
-
-    strncpy(response.txt_error, error_message, SAY_MAX - 1);
-    response.txt_error[SAY_MAX - 1] = '\0'; 
+void send_error(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, int version, const char *error_message) {
+    WireMessage error;
+    wire_message(&error, WIRE_TEXT | TXT_ERROR);
+    error.text = error_message;
+    error.text_len = strnlen(error_message, SAY_MAX - 1);
+    char response[sizeof(struct text_error)];
+    size_t len = wire_encode(version, &error, response, sizeof(response));
 
-    if (sendto(sockfd, &response, sizeof(struct text_error), 0, (struct sockaddr *)client_addr, client_len) < 0) {
-        printf("Error sending error response lol");
+    if (net_send(sockfd, response, len, client_addr) < 0) {
+        log_error("Error sending error response");
     } else {
-        printf("Error sent to client %s:%d: %s\n", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), response.txt_error);
+        metrics_sent(METRICS_TXT_ERROR, len, 1);
+        log_debug("Error sent to client %s:%d: %s", inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), error_message);
     }
 }
 
+//node prefix plus counter, see msgid.h for why these stay unique
 uint64_t generate_id(){
-    uint64_t id;
-    FILE *urandom = fopen("/dev/urandom", "r");
-    fread(&id, sizeof(id), 1, urandom);
-    fclose(urandom);
-    return id;
+    return msgid_next();
 }
 
+//message ids are kept in the bounded dedup table, see dedup.h
 void add_message_id(uint64_t id) {
-    MessageID *new_id = (MessageID*)malloc(sizeof(MessageID));
-    new_id->id = id;
-    new_id->timestamp = time(NULL);
-    new_id->next = message_ids;
-    message_ids = new_id;
+    dedup_insert(id, time(NULL));
 }
 
-int handle_say(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, struct request_say *buffer){
+//sends a SAY to every member of the channel in the version each one speaks; returns how many
+int deliver_say(int sockfd, Channel *channel, SayFrames *frames) {
+    UserList *members = &channel->user_list;
+    int sent[2] = {0, 0};
+    for (int i = 0; i < members->fanout_count; i++) {
+        int version = members->fanout_versions[i];
+        int parts;
+        const struct iovec *frame = say_text_frame(frames, version, &parts);
+        if (net_sendv(sockfd, frame, parts, &members->fanout[i]) < 0) {
+            log_error("Error sending say response");
+        } else {
+            sent[version - 1]++;
+        }
+    }
+    for (int v = 0; v < 2; v++) {
+        if (sent[v]) {
+            int parts;
+            const struct iovec *frame = say_text_frame(frames, v + 1, &parts);
+            metrics_sent(METRICS_TXT_SAY, frame_len(frame, parts), sent[v]);
+        }
+    }
+    return members->fanout_count;
+}
 
-    struct text_say *response = (struct text_say *)malloc(sizeof(struct text_say));
+int handle_say(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req, char *buffer){
 
-    response->txt_type = TXT_SAY;
-    char* channel_name = buffer->req_channel;
-    char* say = buffer->req_text;
+    char* channel_name = req->channel;
     User *user = find_user_by_address(&users, client_addr);
-    strncpy(response->txt_channel, buffer->req_channel, CHANNEL_MAX);
     Channel* channel = find_channel_by_name(channel_name);
     if(channel == NULL){
-        send_error(sockfd, client_addr, client_len, "Channel does not exist");
+        send_error(sockfd, client_addr, client_len, req->version, "Channel does not exist");
+        return -1;
+    }
+    if (user == NULL) {
         return -1;
     }
-    strncpy(response->txt_username, user->username, USERNAME_MAX);
-    strncpy(response->txt_text, say, SAY_MAX);
 
-    User* current_user = channel->user_list.head;
-    while(current_user != NULL){
-        if (sendto(sockfd, response, sizeof(struct text_say), 0, (struct sockaddr *)&current_user->addr, sizeof(current_user->addr)) < 0) {
-            perror("Error sending say response");
+    //the id and username are new, the rest comes from the request.
+    //the username is copied since a LOGOUT later in the batch may free the user before the flush
+    WireMessage say = *req;
+    say.id = generate_id();
+    strncpy(say.username, user->username, USERNAME_MAX);
+    SayFrames frames;
+    memset(&frames, 0, sizeof(frames));
+    frames.say = &say;
+    struct say_frame *frame = NULL;
+    if (req->version == WIRE_V1) {
+        //v1 frames gather the channel and text straight from the request
+        frames.text_parts[0] = 4;
+        frames.s2s_parts[0] = 4;
+        frame = (struct say_frame *)say_frames_reserve(&frames, sizeof(struct say_frame));
+    } else if (!say_frames_reserve(&frames, 0)) {
+        return -1;
+    }
+    if (req->version == WIRE_V1) {
+        if (!frame) {
+            return -1;
+        }
+        struct request_say *request = (struct request_say *)buffer;
+        frame->req_type = S2S_SAY;
+        frame->id = say.id;
+        strncpy(frame->username, user->username, USERNAME_MAX);
+        struct iovec *response = frames.text[0];
+        response[0] = (struct iovec){(void *)&txt_say_header, sizeof(txt_say_header)};
+        response[1] = (struct iovec){request->req_channel, CHANNEL_MAX};
+        response[2] = (struct iovec){frame->username, USERNAME_MAX};
+        response[3] = (struct iovec){request->req_text, SAY_MAX};
+        frames.s2s[0][0] = (struct iovec){frame, offsetof(struct say_frame, username)};
+        for (int i = 1; i < 4; i++) {
+            frames.s2s[0][i] = response[i];
         }
-        current_user = current_user->next;
     }
-    printf("say request sent \n");
 
-    struct s2s_say s2s_message;
-    s2s_message.req_type = S2S_SAY;
-    s2s_message.id = generate_id();
-    strncpy(s2s_message.txt_channel, channel_name, CHANNEL_MAX);
-    strncpy(s2s_message.txt_username, user->username, USERNAME_MAX);
-    strncpy(s2s_message.txt_text, say, SAY_MAX);
+    metrics_observe(&metrics.say_users, deliver_say(sockfd, channel, &frames));
+    log_debug("say request sent");
 
-    add_message_id(s2s_message.id); // Prevent rebroadcast of the same message
-    broadcast_s2s_say(sockfd, &s2s_message, NULL);
+    add_message_id(say.id); // Prevent rebroadcast of the same message
+    metrics_observe(&metrics.say_neighbors, broadcast_s2s_say(sockfd, &frames, NULL));
     
     return 1;
 }
 
 int message_id_exists(uint64_t id) {
-    MessageID *current = message_ids;
-    while (current) {
-        if (current->id == id) return 1;
-        current = current->next;
-    }
-    return 0;
+    return dedup_seen(id, time(NULL));
+}
+
+void print_dedup_stats() {
+    DedupStats stats;
+    dedup_get_stats(&stats);
+    log_info("dedup: %zu/%zu ids, window %ds, %llu hits, %llu expired, %llu evicted early (%.4f%%), false positives %.4f%%",
+           stats.occupancy, stats.capacity, stats.window,
+           (unsigned long long)stats.hits, (unsigned long long)stats.expired,
+           (unsigned long long)stats.evicted_early, dedup_early_eviction_rate() * 100.0,
+           dedup_false_positive_rate() * 100.0);
 }
 
-void handle_s2s_say(int sockfd, struct sockaddr_in *sender, struct s2s_say*buffer){
+void handle_s2s_say(int sockfd, struct sockaddr_in *sender, WireMessage *req, char *buffer, int len){
     Neighbor *sender_neighbor = find_neighbor_by_address(sender);
+    if (sender_neighbor) {
+        sender_neighbor->version = req->version;
+    }
+    int channel_id = intern_find(req->channel);
     //check for duplicates 
-    if (message_id_exists(buffer->id)) {
+    if (message_id_exists(req->id)) {
         
         
-        printf("%s:%d %s:%d recv duplicate S2S_SAY %s \"%s\"\n",
-               inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(server_addr.sin_port),
-               inet_ntoa(sender->sin_addr), ntohs(sender->sin_port),
-               buffer->txt_channel, buffer->txt_text);
+        log_trace_text(LOG_EVENT_S2S_SAY_DUPLICATE, sender, req->channel, req->text, req->text_len);
 
-    if (sender_neighbor) {
-        leave_channel(sockfd, sender_neighbor, buffer->txt_channel);
-        send_s2s_leave(sockfd, sender, buffer->txt_channel);
+    //a core tree link is wanted even if a duplicate slipped through while routes settled
+    if (sender_neighbor && !core_mode) {
+        leave_channel(sockfd, sender_neighbor, channel_id);
+        send_s2s_leave(sockfd, sender, req->channel);
     }
         return;
     }
 
     // Add the message ID to prevent future duplicates
-    add_message_id(buffer->id);
+    add_message_id(req->id);
 
     // Log the received message
-    printf("%s:%d %s:%d recv S2S_SAY %s \"%s\"\n", inet_ntoa(server_addr_for_ip_display.sin_addr), ntohs(server_addr.sin_port), inet_ntoa(sender->sin_addr), ntohs(sender->sin_port),
-        buffer->txt_channel, buffer->txt_text);
-
-    Channel* channel = find_channel_by_name(buffer->txt_channel);
-    if (channel) {
-        User* current_user = channel->user_list.head;
-        struct text_say response;
-        response.txt_type = TXT_SAY;
-        strncpy(response.txt_channel, buffer->txt_channel, CHANNEL_MAX);
-        strncpy(response.txt_username, buffer->txt_username, USERNAME_MAX);
-        strncpy(response.txt_text, buffer->txt_text, SAY_MAX);
-
-        while (current_user) {
-            if (sendto(sockfd, &response, sizeof(response), 0,
-                       (struct sockaddr*)&current_user->addr, sizeof(current_user->addr)) < 0) {
-                printf("Error sending S2S_SAY to local user");
-            }
-            current_user = current_user->next;
-        }
+    log_trace_text(LOG_EVENT_S2S_SAY_RECV, sender, req->channel, req->text, req->text_len);
+
+    //in the version it arrived in, the datagram is forwarded as is and users get its payload
+    //behind a TXT_SAY header; the other version is encoded only if someone needs it
+    SayFrames frames;
+    memset(&frames, 0, sizeof(frames));
+    frames.say = req;
+    if (req->version == WIRE_V1) {
+        frames.s2s[0][0] = (struct iovec){buffer, sizeof(struct s2s_say)};
+        frames.s2s_parts[0] = 1;
+        frames.text[0][0] = (struct iovec){(void *)&txt_say_header, sizeof(txt_say_header)};
+        frames.text[0][1] = (struct iovec){buffer + offsetof(struct s2s_say, txt_channel), SAY_PAYLOAD_SIZE};
+        frames.text_parts[0] = 2;
+    } else {
+        frames.s2s[1][0] = (struct iovec){buffer, (size_t)len};
+        frames.s2s_parts[1] = 1;
+        frames.text[1][0] = (struct iovec){(void *)v2_txt_say_header, WIRE_V2_HEADER};
+        frames.text[1][1] = (struct iovec){buffer + WIRE_V2_HEADER + WIRE_V2_ID_SIZE, (size_t)len - WIRE_V2_HEADER - WIRE_V2_ID_SIZE};
+        frames.text_parts[1] = 2;
+    }
+    if (!say_frames_reserve(&frames, 0)) {
+        return;
     }
 
+    Channel* channel = find_channel_by_name(req->channel);
+    metrics_observe(&metrics.say_users, channel ? deliver_say(sockfd, channel, &frames) : 0);
+
     //if there is nowhere too forward leave
-    if (should_send_leave(buffer->txt_channel)) {
-        leave_channel(sockfd, sender_neighbor, buffer->txt_channel);
-        send_s2s_leave(sockfd, sender, buffer->txt_channel);
-        remove_channel_sub(buffer->txt_channel);
+    if (should_send_leave(channel_id)) {
+        metrics.prunes++;
+        metrics_observe(&metrics.say_neighbors, 0);
+        leave_channel(sockfd, sender_neighbor, channel_id);
+        send_s2s_leave(sockfd, sender, req->channel);
+        remove_channel_sub(channel_id);
         return;
     }
-    broadcast_s2s_say(sockfd, buffer, sender);
+    metrics_observe(&metrics.say_neighbors, broadcast_s2s_say(sockfd, &frames, sender));
 }
 
 void add_neighbor(char* ip, int port){
@@ -505,314 +1044,1314 @@ void add_neighbor(char* ip, int port){
     char resolved_ip[16];
     if (strcmp(ip, "localhost") == 0) {
         strncpy(resolved_ip, "127.0.0.1", sizeof(resolved_ip));
-        resolved_ip[sizeof(resolved_ip) - 1] = '\0';
+    } else {
+        //workers must all agree on neighbor addresses, never use an uninitialized one
+        strncpy(resolved_ip, ip, sizeof(resolved_ip));
     }
+    resolved_ip[sizeof(resolved_ip) - 1] = '\0';
     
-    Neighbor* neighbor_new = (Neighbor*)malloc(sizeof(Neighbor));
+    Neighbor* neighbor_new = (Neighbor*)pool_alloc(&neighbor_pool);
+    if (!neighbor_new) {
+        log_error("Failed to allocate neighbor");
+        return;
+    }
+    memset(neighbor_new, 0, sizeof(Neighbor));
     neighbor_new->addr.sin_family = AF_INET;
     neighbor_new->addr.sin_port = htons(port);
+    //v1 until it says otherwise
+    neighbor_new->version = WIRE_V1;
+    coalesce_bundle_init(&neighbor_new->bundle, &neighbor_new->addr);
 
     inet_pton(AF_INET, resolved_ip, &neighbor_new->addr.sin_addr);
 
+    Neighbor **grown = (Neighbor**)realloc(neighbor_table, (neighbor_count + 1) * sizeof(Neighbor*));
+    if (!grown) {
+        log_error("Failed to allocate neighbor table");
+        pool_free(&neighbor_pool, neighbor_new);
+        return;
+    }
+    neighbor_table = grown;
+    neighbor_new->index = neighbor_count;
+    neighbor_table[neighbor_count++] = neighbor_new;
     neighbor_new->next = neighbors;
     neighbors = neighbor_new;
-    printf("Added neighbor %s:%d\n", resolved_ip, port);
+    addr_index_insert(&neighbor_index, addr_key(&neighbor_new->addr), neighbor_new);
+    log_debug("Added neighbor %s:%d", resolved_ip, port);
 }
 
-User* find_user_by_name(UserList *user_list, char *username) {
-    User *current = user_list->head;
-    while (current != NULL) {
-        if (strncmp(current->username, username, USERNAME_MAX) == 0) {
-            return current;  // User found
-        }
-        current = current->next;
-    }
-    return NULL;
+//channel names owned by other workers, so LIST can answer from any worker
+NameIndex remote_channels = {NULL, 0, 0};
+//dropped whenever a channel is created or deleted, here or on another worker
+ReplyCache list_reply;
+
+void reply_cache_invalidate(ReplyCache *cache) {
+    cache->valid[0] = cache->valid[1] = 0;
 }
 
-int remove_user_from_list(UserList *user_list, char *username) {
-    //remove all users of a specific name in order to deal with duplicates for users who did not sign out
-    User *current = user_list->head;
-    User *previous = NULL;
-    int removed_count = 0;
+void reply_cache_free(ReplyCache *cache) {
+    wire_pages_free(&cache->pages[0]);
+    wire_pages_free(&cache->pages[1]);
+    reply_cache_invalidate(cache);
+}
 
-    while (current != NULL) {
-        if (strncmp(current->username, username, USERNAME_MAX) == 0) {
-            User *to_delete = current;
+size_t reply_cache_bytes(ReplyCache *cache) {
+    return wire_pages_bytes(&cache->pages[0]) + wire_pages_bytes(&cache->pages[1]);
+}
 
-            if (previous == NULL) {
-        
-                user_list->head = current->next;
-            } else {
-                previous->next = current->next;
-            }
-            current = current->next;  
-            free(to_delete);  
-            printf("User %s removed\n", username);
-            removed_count++;
-        } else {
-            previous = current;
-            current = current->next;
+//each page is copied into the send batch, so the cache can change before the flush
+int send_reply_pages(int sockfd, struct sockaddr_in *addr, WirePages *pages, int kind) {
+    for (int i = 0; i < pages->count; i++) {
+        size_t len;
+        const char *page = wire_page(pages, i, &len);
+        if (net_send(sockfd, page, len, addr) < 0) {
+            log_error("Error sending reply: %s", strerror(errno));
+            return -1;
         }
+        metrics_sent(kind, len, 1);
     }
-    if (removed_count == 0) {
-        printf("User %s not found\n", username);
-        return 0;  
+    return pages->count;
+}
+
+//tell the other workers a channel this worker owns was created or deleted
+void announce_channel(int kind, char *channel_name) {
+    if (shard_count() > 1) {
+        char name[CHANNEL_MAX];
+        memset(name, 0, CHANNEL_MAX);
+        strncpy(name, channel_name, CHANNEL_MAX - 1);
+        shard_broadcast(kind, NULL, NULL, name, CHANNEL_MAX);
     }
-    return removed_count;  
 }
 
-int remove_user_from_channel(Channel *channel, char *username) {
-    remove_user_from_list(&(channel->user_list), username);
-    channel->user_count -= 1;
+User* find_user_by_name(UserList *user_list, char *username) {
+    return (User*)name_index_find(&user_list->by_name, username);
+}
 
-    if (channel->user_count == 0) {
-        Channel *current = channels;
-        Channel *previous = NULL;
-        // Search for
-        while (current != NULL) {
-            if (current == channel) {
-                if (previous == NULL) {
-                    channels = current->next_channel;
-                } else {
-                    previous->next_channel = current->next_channel;
-                }
+int fanout_add(UserList *user_list, User *user) {
+    user->fanout_slot = -1;
+    if (user_list->fanout_count == user_list->fanout_capacity) {
+        int capacity = user_list->fanout_capacity ? user_list->fanout_capacity * 2 : 8;
+        struct sockaddr_in *addrs = (struct sockaddr_in *)realloc(user_list->fanout, capacity * sizeof(struct sockaddr_in));
+        if (!addrs) return -1;
+        user_list->fanout = addrs;
+        User **owners = (User **)realloc(user_list->fanout_users, capacity * sizeof(User *));
+        if (!owners) return -1;
+        user_list->fanout_users = owners;
+        unsigned char *versions = (unsigned char *)realloc(user_list->fanout_versions, capacity);
+        if (!versions) return -1;
+        user_list->fanout_versions = versions;
+        user_list->fanout_capacity = capacity;
+    }
+    user->fanout_slot = user_list->fanout_count++;
+    user_list->fanout[user->fanout_slot] = user->addr;
+    user_list->fanout_users[user->fanout_slot] = user;
+    user_list->fanout_versions[user->fanout_slot] = user->version;
+    return 0;
+}
 
-                free(current);
-                printf("Channel %s deleted\n", channel->name);
-                channel_count--;  // Update global channel count
-                return 1;  // Success
-            }
-            previous = current;
-            current = current->next_channel;
-        }
+void fanout_remove(UserList *user_list, User *user) {
+    //swap the last address into the hole
+    int slot = user->fanout_slot;
+    if (slot < 0) return;
+    int last = --user_list->fanout_count;
+    if (slot != last) {
+        user_list->fanout[slot] = user_list->fanout[last];
+        user_list->fanout_users[slot] = user_list->fanout_users[last];
+        user_list->fanout_versions[slot] = user_list->fanout_versions[last];
+        user_list->fanout_users[slot]->fanout_slot = slot;
     }
-    printf("User %s removed from channel %s.\n", username, channel->name);
-    return 1;  
 }
 
-int add_user(UserList *user_list, const char *username, struct sockaddr_in addr) {
-    User *current = user_list->head;
+void free_user_list_indexes(UserList *user_list) {
+    name_index_free(&user_list->by_name);
+    addr_index_free(&user_list->by_addr);
+    free(user_list->fanout);
+    free(user_list->fanout_users);
+    free(user_list->fanout_versions);
+    user_list->fanout = NULL;
+    user_list->fanout_users = NULL;
+    user_list->fanout_versions = NULL;
+    user_list->fanout_count = 0;
+    user_list->fanout_capacity = 0;
+}
 
-    // Check if the user already exists in the list
-    while (current) {
-        if (strncmp(current->username, username, USERNAME_MAX) == 0) {
-            // Update the existing user's address
-            current->addr = addr;
-            printf("User %s reconnected and updated.\n", username);
-            return 0;
-        }
-        current = current->next;
+//drop the address mapping only if it still points at this user
+static void unindex_user_addr(UserList *user_list, User *user) {
+    uint64_t key = addr_key(&user->addr);
+    if (addr_index_find(&user_list->by_addr, key) == user) {
+        addr_index_remove(&user_list->by_addr, key);
     }
-    //create new user 
-    User *new_user = (User *)malloc(sizeof(User));
-    if (!new_user) {
-        perror("Failed to allocate memory for new user");
-        return -1;
+}
+
+int remove_user_from_list(UserList *user_list, char *username) {
+    //names are unique within a list since add_user updates duplicates in place
+    User *to_delete = find_user_by_name(user_list, username);
+    if (to_delete == NULL) {
+        log_debug("User %s not found", username);
+        return 0;  
+    }
+
+    if (to_delete->prev == NULL) {
+        user_list->head = to_delete->next;
+    } else {
+        to_delete->prev->next = to_delete->next;
+    }
+    if (to_delete->next) {
+        to_delete->next->prev = to_delete->prev;
+    }
+    name_index_remove(&user_list->by_name, to_delete->username);
+    unindex_user_addr(user_list, to_delete);
+    fanout_remove(user_list, to_delete);
+    log_debug("User %s removed", username);
+    free(to_delete->joined);
+    pool_free(&user_pool, to_delete);
+    return 1;  
+}
+
+int remove_user_from_channel(Channel *channel, char *username) {
+    if (!remove_user_from_list(&(channel->user_list), username)) {
+        return 0;
+    }
+    reply_cache_invalidate(&channel->who);
+    channel->user_count -= 1;
+
+    if (channel->user_count == 0) {
+        if (channel->prev_channel == NULL) {
+            channels = channel->next_channel;
+        } else {
+            channel->prev_channel->next_channel = channel->next_channel;
+        }
+        if (channel->next_channel) {
+            channel->next_channel->prev_channel = channel->prev_channel;
+        }
+        name_index_remove(&channel_index, channel->name);
+        announce_channel(SHARD_CHANNEL_DEL, channel->name);
+        if (core_mode) {
+            core_prune(server_sockfd, intern_find(channel->name), NULL);
+        }
+        reply_cache_invalidate(&list_reply);
+        free_user_list_indexes(&channel->user_list);
+        reply_cache_free(&channel->who);
+
+        log_debug("Channel %s deleted", channel->name);
+        pool_free(&channel_pool, channel);
+        channel_count--;  // Update global channel count
+        return 1;  // Success
+    }
+    log_debug("User %s removed from channel %s.", username, channel->name);
+    return 1;  
+}
+
+int add_user(UserList *user_list, const char *username, struct sockaddr_in addr, int version) {
+    User *current = (User*)name_index_find(&user_list->by_name, username);
+
+    // Check if the user already exists in the list
+    if (current) {
+        // Update the existing user's address
+        unindex_user_addr(user_list, current);
+        current->addr = addr;
+        current->version = version;
+        addr_index_insert(&user_list->by_addr, addr_key(&addr), current);
+        if (current->fanout_slot >= 0) {
+            user_list->fanout[current->fanout_slot] = addr;
+            user_list->fanout_versions[current->fanout_slot] = version;
+        }
+        log_debug("User %s reconnected and updated.", username);
+        return 0;
+    }
+    //create new user 
+    User *new_user = (User *)pool_alloc(&user_pool);
+    if (!new_user) {
+        log_error("Failed to allocate memory for new user");
+        return -1;
     }
 
     strncpy(new_user->username, username, USERNAME_MAX - 1);
     new_user->username[USERNAME_MAX - 1] = '\0';  
     new_user->addr = addr;
+    new_user->version = version;
+    new_user->joined = NULL;
+    new_user->joined_count = 0;
+    new_user->joined_capacity = 0;
+    //a user only goes in the list once every index has it, so a failure leaves no trace.
+    //another user at the same address loses the address mapping, unless this one is undone
+    uint64_t key = addr_key(&addr);
+    void *addr_owner = addr_index_find(&user_list->by_addr, key);
+    if (name_index_insert(&user_list->by_name, new_user->username, new_user) < 0) {
+        log_error("Failed to index new user");
+        pool_free(&user_pool, new_user);
+        return -1;
+    }
+    if (addr_index_insert(&user_list->by_addr, key, new_user) < 0) {
+        log_error("Failed to index new user");
+        name_index_remove(&user_list->by_name, new_user->username);
+        pool_free(&user_pool, new_user);
+        return -1;
+    }
+    if (fanout_add(user_list, new_user) < 0) {
+        log_error("Failed to index new user");
+        if (addr_owner) {
+            addr_index_insert(&user_list->by_addr, key, addr_owner);
+        } else {
+            addr_index_remove(&user_list->by_addr, key);
+        }
+        name_index_remove(&user_list->by_name, new_user->username);
+        pool_free(&user_pool, new_user);
+        return -1;
+    }
+    new_user->prev = NULL;
     new_user->next = user_list->head; 
+    if (user_list->head) {
+        user_list->head->prev = new_user;
+    }
     user_list->head = new_user;
 
-    printf("User %s added to list.\n", username);
+    log_debug("User %s added to list.", username);
     return 1;
 }
 
+int joined_add(User *user, Channel *channel) {
+    if (user->joined_count == user->joined_capacity) {
+        int capacity = user->joined_capacity ? user->joined_capacity * 2 : 4;
+        Channel **joined = (Channel **)realloc(user->joined, capacity * sizeof(Channel *));
+        if (!joined) return -1;
+        user->joined = joined;
+        user->joined_capacity = capacity;
+    }
+    user->joined[user->joined_count++] = channel;
+    return 0;
+}
+
+void joined_remove(User *user, Channel *channel) {
+    for (int i = 0; i < user->joined_count; i++) {
+        if (user->joined[i] == channel) {
+            user->joined[i] = user->joined[--user->joined_count];
+            return;
+        }
+    }
+}
+
 Channel* join_channel(int sockfd, char *channel_name, User *user) {
-    Channel *current = channels;
+    Channel *current = find_channel_by_name(channel_name);
 
-    // Search for the channel in the linked list
-    while (current != NULL) {
-        if (strcmp(current->name, channel_name) == 0) {
-            if(add_user(&(current->user_list), user->username, user->addr)){
-                current->user_count++;
+    if (current != NULL) {
+        int added = add_user(&(current->user_list), user->username, user->addr, user->version);
+        if (added < 0) {
+            return NULL;
+        }
+        if (added > 0) {
+            current->user_count++;
+            reply_cache_invalidate(&current->who);
+            //a member the user does not know it is in would never be taken out again
+            if (joined_add(user, current) < 0) {
+                remove_user_from_channel(current, user->username);
+                return NULL;
             }
-            printf("User %s joined existing channel %s\n", user->username, channel_name);
-            return current;
         }
-        current = current->next_channel;
+        log_debug("User %s joined existing channel %s", user->username, channel_name);
+        return current;
     }
 
     // Channel does not exist, create a new channel
-    Channel *new_channel = (Channel *)malloc(sizeof(Channel));
+    Channel *new_channel = (Channel *)pool_alloc(&channel_pool);
     if (!new_channel) {
         return NULL;
     }
-    channel_count += 1;
     strncpy(new_channel->name, channel_name, CHANNEL_MAX - 1);
     new_channel->name[CHANNEL_MAX - 1] = '\0';
-    new_channel->user_list.head = NULL;
-    add_user(&(new_channel->user_list), user->username, user->addr);
+    memset(&new_channel->user_list, 0, sizeof(new_channel->user_list));
+    memset(&new_channel->who, 0, sizeof(new_channel->who));
+    //nothing else can see the channel yet, so a failure here just frees it
+    if (add_user(&(new_channel->user_list), user->username, user->addr, user->version) < 0) {
+        free_user_list_indexes(&new_channel->user_list);
+        pool_free(&channel_pool, new_channel);
+        return NULL;
+    }
+    if (joined_add(user, new_channel) < 0) {
+        remove_user_from_list(&new_channel->user_list, user->username);
+        free_user_list_indexes(&new_channel->user_list);
+        pool_free(&channel_pool, new_channel);
+        return NULL;
+    }
+    channel_count += 1;
     new_channel->user_count = 1;
+    new_channel->prev_channel = NULL;
     new_channel->next_channel = channels;
+    if (channels) {
+        channels->prev_channel = new_channel;
+    }
     channels = new_channel;
+    name_index_insert(&channel_index, new_channel->name, new_channel);
+    announce_channel(SHARD_CHANNEL_ADD, new_channel->name);
+    reply_cache_invalidate(&list_reply);
     
-    printf("User %s created and joined new channel %s\n", user->username, channel_name);
+    log_debug("User %s created and joined new channel %s", user->username, channel_name);
 
-    if(add_channel_sub(channel_name)){
-        subscribe_all_neighbors(channel_name);
-        broadcast_s2s_join(sockfd, NULL ,channel_name, 0);
+    int channel = intern_acquire(channel_name);
+    if (channel != INTERN_NONE) {
+        if(add_channel_sub(channel) > 0){
+            flood_subscription(sockfd, channel, NULL);
+        }
+        intern_release(channel);
     }
     
     return new_channel;
 }
 
-int handle_login(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len,  request_login *buffer){
-    char* username = buffer->req_username;
-    add_user(&users, username, *client_addr);
-    return 1;
+//adds or updates a user; a user that comes back from a new address or version gets it
+//in the channels it is in too, so deliveries follow it
+User *login_user(const char *username, struct sockaddr_in addr, int version) {
+    int added = add_user(&users, username, addr, version);
+    User *user = (User *)name_index_find(&users.by_name, username);
+    if (added == 0 && user) {
+        for (int i = 0; i < user->joined_count; i++) {
+            add_user(&user->joined[i]->user_list, username, addr, version);
+        }
+    }
+    return user;
 }
 
-int handle_logout(int sockfd, struct sockaddr_in *client_addr, struct request_logout * buffer){
-    Channel *current_channel = channels;
+//takes the user out of the channels it joined and off the server
+void drop_user(User *user) {
+    char username[USERNAME_MAX];
+    memcpy(username, user->username, USERNAME_MAX);
+    //a channel may be freed once its last member goes, so it is not touched again
+    for (int i = 0; i < user->joined_count; i++) {
+        remove_user_from_channel(user->joined[i], username);
+    }
+    user->joined_count = 0;
+    remove_user_from_list(&users, username);
+}
 
+int handle_login(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req){
+    login_user(req->username, *client_addr, req->version);
+    return 1;
+}
+
+int handle_logout(int sockfd, struct sockaddr_in *client_addr, WireMessage *req){
     User *user = find_user_by_address(&users, client_addr);
-    char *username = user->username;
-    while (current_channel != NULL) {
-        remove_user_from_channel(current_channel, username);
-        current_channel = current_channel->next_channel;
+    if (user == NULL) {
+        return -1;
     }
-    remove_user_from_list(&users, username);
+    drop_user(user);
     return 1;
 }
 
-int handle_join(int sockfd, struct sockaddr_in *client_addr,  struct request_join *buffer){
-    char* channel = buffer->req_channel;
+int handle_join(int sockfd, struct sockaddr_in *client_addr, WireMessage *req){
+    char* channel = req->channel;
     User *user = find_user_by_address(&users, client_addr);
-    join_channel(sockfd, channel, user);
+    if (user == NULL) {
+        return -1;
+    }
+    if (!join_channel(sockfd, channel, user)) {
+        send_error(sockfd, client_addr, sizeof(*client_addr), req->version, "Could not join channel");
+        return -1;
+    }
     return 1;
 }
 
-int handle_leave(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len,  struct request_leave *buffer){
-    char* channel_name = buffer->req_channel;
+int handle_leave(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req){
+    char* channel_name = req->channel;
     Channel* channel = find_channel_by_name(channel_name);
     if(channel == NULL){
-        send_error(sockfd, client_addr, client_len, "Channel does not exist");
+        send_error(sockfd, client_addr, client_len, req->version, "Channel does not exist");
+        return -1;
+    }
+    User *user = find_user_by_address(&users, client_addr);
+    if (user == NULL) {
         return -1;
     }
-    User *user = find_user_by_address(&(channel->user_list), client_addr);
-    char* username = user->username;
-    remove_user_from_channel(channel, username);
+    //the channel may be freed by the removal
+    joined_remove(user, channel);
+    remove_user_from_channel(channel, user->username);
     return 1;
 }
 
 
 
-int handle_list(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len){
+int handle_list(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req){
 
-    struct text_list *response;
-    response = (struct text_list *)malloc(sizeof(struct text_list) + sizeof(struct channel_info) * channel_count);
-    response->txt_type = TXT_LIST;
-    response->txt_nchannels = channel_count;
-    
-    Channel *current_channel = channels;
-
-    int i = 0;
-    while (current_channel != NULL) {
-        strncpy(response->txt_channels[i].ch_channel, current_channel->name, CHANNEL_MAX - 1);
-        response->txt_channels[i].ch_channel[CHANNEL_MAX - 1] = '\0'; 
-        i++;
-        current_channel = current_channel->next_channel;
+    int v = req->version - 1;
+    WirePages *pages = &list_reply.pages[v];
+    if (list_reply.valid[v]) {
+        metrics.reply_cache_hits++;
+    } else {
+        metrics.reply_cache_builds++;
+        wire_pages_begin(pages, req->version, WIRE_TEXT | TXT_LIST, NULL);
+        Channel *current_channel = channels;
+        while (current_channel != NULL) {
+            wire_pages_add(pages, current_channel->name);
+            current_channel = current_channel->next_channel;
+        }
+        //channels owned by other workers
+        for (size_t slot = 0; slot < remote_channels.capacity; slot++) {
+            if (remote_channels.slots[slot].value) {
+                wire_pages_add(pages, remote_channels.slots[slot].name);
+            }
+        }
+        if (wire_pages_end(pages) < 0) {
+            log_error("Failed to allocate list response");
+            return -1;
+        }
+        list_reply.valid[v] = 1;
     }
 
-     if (sendto(sockfd, response, sizeof(struct text_list) + sizeof(struct channel_info) * channel_count, 0, (struct sockaddr *)client_addr, client_len) < 0) {
-        perror("Error sending list response");
-        return -1;
-    }
-    free(response);
-    printf("List response sent with %d channels.\n", channel_count);
-    return 1;
+    int sent = send_reply_pages(sockfd, client_addr, pages, METRICS_TXT_LIST);
+    log_debug("List response sent in %d pages.", sent);
+    return sent < 0 ? -1 : 1;
 }
 
-int handle_who(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, struct request_who *buffer){
+int handle_who(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req){
 
-    char* channel_ch = buffer->req_channel;
+    char* channel_ch = req->channel;
     Channel* channel  = find_channel_by_name(channel_ch);
     if (channel == NULL) {
-        send_error(sockfd, client_addr, client_len, "Channel does not exist");
+        send_error(sockfd, client_addr, client_len, req->version, "Channel does not exist");
         return -1;
     }
-    struct text_who *response;
-    int user_c = channel->user_count;
 
-    response = (struct text_who *)malloc(sizeof(struct text_who) + sizeof(struct user_info) * user_c);
-    response->txt_type = TXT_WHO;
-    response->txt_nusernames = user_c;
-    strncpy(response->txt_channel, channel_ch, CHANNEL_MAX-1);
-    response->txt_channel[CHANNEL_MAX-1] = '\0';
+    int v = req->version - 1;
+    WirePages *pages = &channel->who.pages[v];
+    if (channel->who.valid[v]) {
+        metrics.reply_cache_hits++;
+    } else {
+        metrics.reply_cache_builds++;
+        wire_pages_begin(pages, req->version, WIRE_TEXT | TXT_WHO, channel->name);
+        User* current_user = channel->user_list.head;
+        while (current_user != NULL) {
+            wire_pages_add(pages, current_user->username);
+            current_user = current_user->next;
+        }
+        if (wire_pages_end(pages) < 0) {
+            log_error("Failed to allocate who response");
+            return -1;
+        }
+        channel->who.valid[v] = 1;
+    }
 
-    int i = 0;
-    User* current_user = channel->user_list.head;
+    int sent = send_reply_pages(sockfd, client_addr, pages, METRICS_TXT_WHO);
+    log_debug("Who response sent in %d pages.", sent);
+    return sent < 0 ? -1 : 1;
+}
 
-    while (current_user != NULL) {
-        strncpy(response->txt_users[i].us_username, current_user->username, USERNAME_MAX - 1);
-        response->txt_users[i].us_username[USERNAME_MAX - 1] = '\0'; 
-        i++;
-        current_user = current_user->next;
+//a v2 neighbor or client announces itself; answer so it learns this server speaks v2 too.
+//every v2 neighbor gets the servers reachable through here; one worker sends for all
+void send_reach(int sockfd, Neighbor *neighbor) {
+    char message[REACH_MAX_SIZE];
+    size_t len = reach_encode(neighbor->index, message);
+    if (net_send(sockfd, message, len, &neighbor->addr) == 0) {
+        count_neighbor_send(neighbor, METRICS_REACH, len);
     }
+}
 
-     if (sendto(sockfd, response, sizeof(struct text_who) + sizeof(struct user_info) * user_c, 0, (struct sockaddr *)client_addr, client_len) < 0) {
-        perror("Error sending list response");
-        return -1;
+void send_reach_all(int sockfd) {
+    if (shard_index() != 0) {
+        return;
+    }
+    for (Neighbor *neighbor = neighbors; neighbor; neighbor = neighbor->next) {
+        if (neighbor->version == WIRE_V2) {
+            send_reach(sockfd, neighbor);
+        }
+    }
+}
+
+//the neighbors hear about a change straight away, and channels whose core moved follow it
+void routes_changed(int sockfd) {
+    send_reach_all(sockfd);
+    core_rehome_all(sockfd);
+}
+
+//resends the routes every REACH_INTERVAL and forgets neighbors that stopped sending theirs
+void reach_tick(int timer_fd, uint32_t expirations, void *arg) {
+    if (reach_expire(time(NULL))) {
+        routes_changed(server_sockfd);
+    } else {
+        send_reach_all(server_sockfd);
+    }
+    net_flush();
+}
+
+//clients need no state here, a user's version follows its requests
+void handle_hello(int sockfd, struct sockaddr_in *sender, WireMessage *req) {
+    Neighbor *neighbor = find_neighbor_by_address(sender);
+    if (neighbor) {
+        neighbor->version = req->hello_version >= WIRE_V2 ? WIRE_V2 : WIRE_V1;
+        neighbor->bundles = (req->hello_flags & WIRE_HELLO_BUNDLES) != 0;
+        neighbor->trees = (req->hello_flags & WIRE_HELLO_TREE) != 0;
+    }
+    if (!(req->hello_flags & WIRE_HELLO_ACK)) {
+        send_hello(sockfd, sender, WIRE_HELLO_ACK);
+    }
+    //a neighbor that speaks v2 can be told the routes right away instead of at the next round
+    if (core_mode && neighbor && neighbor->version == WIRE_V2 && shard_index() == 0) {
+        send_reach(sockfd, neighbor);
     }
-    free(response);
-    printf("Who response sent with %d users.\n", user_c);
-    return 1;
 }
 
-void handle_request(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, char *buffer) {
-    struct request *req = (struct request*)buffer;
+//with -R, neighbors' REACHes tell this server which servers there are and the way to each
+void handle_reach(int sockfd, struct sockaddr_in *sender, WireMessage *req) {
+    Neighbor *neighbor = find_neighbor_by_address(sender);
+    if (!core_mode || !neighbor) {
+        return;
+    }
+    if (reach_update(neighbor->index, req, time(NULL))) {
+        routes_changed(sockfd);
+    }
+}
 
-    switch (req->req_type) {
+void handle_request(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req, char *buffer, int len) {
+    switch (req->type) {
         case REQ_LOGIN:
-            handle_login(sockfd, client_addr, client_len, (struct request_login *)buffer);
+            handle_login(sockfd, client_addr, client_len, req);
             break;
         case REQ_LOGOUT:
-            handle_logout(sockfd, client_addr, (struct request_logout *)buffer);
+            handle_logout(sockfd, client_addr, req);
             break;
         case REQ_JOIN:
-            handle_join(sockfd, client_addr, (struct request_join *)buffer);
+            handle_join(sockfd, client_addr, req);
             break;
         case REQ_LEAVE:
-            handle_leave(sockfd, client_addr, client_len, (struct request_leave *)buffer);
+            handle_leave(sockfd, client_addr, client_len, req);
             break;
         case REQ_SAY:
-            handle_say(sockfd, client_addr, client_len, (struct request_say *)buffer);
+            handle_say(sockfd, client_addr, client_len, req, buffer);
             break;
         case REQ_LIST:
-            handle_list(sockfd, client_addr, client_len);
+            handle_list(sockfd, client_addr, client_len, req);
             break;
         case REQ_WHO:
-            handle_who(sockfd, client_addr, client_len, (struct request_who *)buffer);
+            handle_who(sockfd, client_addr, client_len, req);
             break;
         case S2S_JOIN:
-            handle_s2s_join(sockfd, client_addr, (struct request_join *)buffer);
+            handle_s2s_join(sockfd, client_addr, req);
             break;
         case S2S_LEAVE:
-            handle_s2s_leave(sockfd, client_addr, (struct s2s_leave*)buffer);
+            handle_s2s_leave(sockfd, client_addr, req);
             break;
         case S2S_SAY: 
-            handle_s2s_say(sockfd, client_addr, (struct s2s_say *)buffer);
+            handle_s2s_say(sockfd, client_addr, req, buffer, len);
+            break;
+        case WIRE_HELLO:
+            handle_hello(sockfd, client_addr, req);
+            break;
+        case WIRE_TREE:
+            handle_tree(sockfd, client_addr, req);
+            break;
+        case WIRE_REACH:
+            handle_reach(sockfd, client_addr, req);
             break;
         default:
             break;  
     }
 }
 
+//channel a request is about, or NULL for requests every worker answers itself
+char* request_channel(WireMessage *req) {
+    switch (req->type) {
+        case REQ_JOIN:
+        case REQ_LEAVE:
+        case REQ_WHO:
+        case REQ_SAY:
+        case S2S_JOIN:
+        case S2S_LEAVE:
+        case S2S_SAY:
+        case WIRE_TREE:
+            return req->channel;
+        default:
+            return NULL;
+    }
+}
+
+int message_kind(WireMessage *req) {
+    switch (req->type) {
+        case WIRE_HELLO: return METRICS_HELLO;
+        case WIRE_BUNDLE: return METRICS_BUNDLE;
+        case WIRE_TREE: return METRICS_TREE;
+        case WIRE_REACH: return METRICS_REACH;
+        default: return metrics_kind(req->type);
+    }
+}
+
+//per-type counts are of packets off the wire, hand-offs between workers are not counted again
+void count_received(struct sockaddr_in *addr, int kind, int version, int len) {
+    metrics_received(kind, len);
+    if (version == WIRE_V2) {
+        metrics.received_v2++;
+    }
+    if (kind == S2S_JOIN || kind == S2S_LEAVE || kind == S2S_SAY || kind == METRICS_HELLO || kind == METRICS_BUNDLE || kind == METRICS_TREE || kind == METRICS_REACH) {
+        Neighbor *neighbor = find_neighbor_by_address(addr);
+        if (neighbor) {
+            neighbor->packets_in++;
+            neighbor->bytes_in += len;
+        }
+    }
+}
+
+//in multi-worker mode, hand channel requests to the worker that owns the channel
+void route_request(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, WireMessage *req, char *buffer, int len) {
+    if (shard_count() > 1) {
+        char *channel_name = request_channel(req);
+        if (channel_name) {
+            int owner = shard_owner(channel_name);
+            if (owner != shard_index()) {
+                User *user = find_user_by_address(&users, client_addr);
+                shard_send(owner, SHARD_REQUEST, client_addr, user ? user->username : NULL, buffer, len);
+                return;
+            }
+        } else if (req->type == REQ_LOGOUT) {
+            shard_broadcast(SHARD_LOGOUT, client_addr, NULL, NULL, 0);
+        } else if (req->type == WIRE_HELLO) {
+            //every worker sends to the neighbor, so every worker must learn its version;
+            //they get it as an ack so only this worker answers
+            WireMessage ack = *req;
+            ack.hello_flags |= WIRE_HELLO_ACK;
+            char hello[WIRE_V2_HEADER + 2];
+            size_t hello_len = wire_encode(WIRE_V2, &ack, hello, sizeof(hello));
+            shard_broadcast(SHARD_REQUEST, client_addr, NULL, hello, hello_len);
+        } else if (req->type == WIRE_REACH) {
+            //every worker routes its own channels, so every worker keeps the routes
+            shard_broadcast(SHARD_REQUEST, client_addr, NULL, buffer, len);
+        }
+    }
+    handle_request(sockfd, client_addr, client_len, req, buffer, len);
+}
+
+//bundled messages are handled one by one, as if each had come in its own datagram
+void unpack_bundle(int sockfd, struct sockaddr_in *sender, socklen_t sender_len, WireMessage *bundle) {
+    size_t offset = 0;
+    const char *data;
+    size_t len;
+    while (wire_next_bundled(bundle, &offset, &data, &len) == 0) {
+        WireMessage req;
+        if (wire_decode(data, len, 0, &req) < 0 || req.type == WIRE_BUNDLE) {
+            metrics_received(METRICS_UNKNOWN, len);
+            continue;
+        }
+        metrics_received(message_kind(&req), len);
+        //the bundle got in as control, its says still have to get past shedding
+        if (req.type == S2S_SAY && admit_enabled() && !admit(sender, ADMIT_DATA, 1)) {
+            continue;
+        }
+        route_request(sockfd, sender, sender_len, &req, (char *)data, (int)len);
+    }
+}
+
+void dispatch_request(int sockfd, struct sockaddr_in *client_addr, socklen_t client_len, char *buffer, int len) {
+    //says are forwarded from the receive buffer as is, so a short or malformed one is dropped here
+    WireMessage req;
+    if (wire_decode(buffer, len, 0, &req) < 0) {
+        count_received(client_addr, METRICS_UNKNOWN, 0, len);
+        return;
+    }
+    count_received(client_addr, message_kind(&req), req.version, len);
+    if (req.type == WIRE_BUNDLE) {
+        unpack_bundle(sockfd, client_addr, client_len, &req);
+        return;
+    }
+    route_request(sockfd, client_addr, client_len, &req, buffer, len);
+}
+
+void receive_handoffs(int fd, uint32_t events, void *arg) {
+    int sockfd = *(int *)arg;
+    //replies gather from the hand-off payloads, so each one is kept until the flush
+    static struct shard_message handoffs[HANDOFF_RING];
+    int len;
+    WireMessage req;
+    for (int i = 0; i < NET_MAX_BATCH; i++) {
+        if (i > 0 && i % HANDOFF_RING == 0) {
+            net_flush();
+        }
+        struct shard_message *message = &handoffs[i % HANDOFF_RING];
+        if ((len = shard_recv(fd, message)) < 0) {
+            break;
+        }
+        switch (message->kind) {
+            case SHARD_REQUEST:
+                //the sending worker already checked it
+                if (wire_decode(message->payload, len, 0, &req) < 0) {
+                    break;
+                }
+                //remember who sent it so the handlers can find the username
+                if (message->username[0]) {
+                    User *user = find_user_by_address(&users, &message->origin);
+                    if (!user || strncmp(user->username, message->username, USERNAME_MAX) != 0) {
+                        login_user(message->username, message->origin, req.version);
+                    }
+                }
+                handle_request(sockfd, &message->origin, sizeof(message->origin), &req, message->payload, len);
+                break;
+            case SHARD_LOGOUT:
+                if (find_user_by_address(&users, &message->origin)) {
+                    handle_logout(sockfd, &message->origin, NULL);
+                }
+                break;
+            case SHARD_CHANNEL_ADD:
+                name_index_insert(&remote_channels, message->payload, &remote_channels);
+                reply_cache_invalidate(&list_reply);
+                break;
+            case SHARD_CHANNEL_DEL:
+                name_index_remove(&remote_channels, message->payload);
+                reply_cache_invalidate(&list_reply);
+                break;
+            default:
+                break;
+        }
+    }
+    net_flush();
+}
+
+void print_net_stats() {
+    NetStats stats;
+    net_get_stats(&stats);
+    log_info("net (%s): %llu packets in %llu recv calls, %llu packets in %llu send calls, %llu send errors",
+           net_backend(), (unsigned long long)stats.recv_packets, (unsigned long long)stats.recv_calls,
+           (unsigned long long)stats.send_packets, (unsigned long long)stats.send_calls,
+           (unsigned long long)stats.send_errors);
+}
+
+void print_backlog_stats() {
+    BacklogStats stats;
+    backlog_get_stats(&stats);
+    if (!stats.queued) {
+        return;
+    }
+    log_info("backlog: %llu datagrams waiting for %llu destinations, %llu queued, %llu sent, %llu dropped, %llu kept past the bound",
+             (unsigned long long)stats.datagrams, (unsigned long long)stats.destinations,
+             (unsigned long long)stats.queued, (unsigned long long)stats.sent,
+             (unsigned long long)stats.dropped, (unsigned long long)stats.kept);
+}
+
+void print_admit_stats() {
+    if (!admit_enabled()) {
+        return;
+    }
+    AdmitStats stats;
+    admit_get_stats(&stats);
+    for (int klass = 0; klass < ADMIT_CLASSES; klass++) {
+        log_info("admission %s: %llu admitted, %llu rate limited, %llu shed", admit_class_name(klass),
+                 (unsigned long long)stats.admitted[klass], (unsigned long long)stats.limited[klass],
+                 (unsigned long long)stats.shed[klass]);
+    }
+    log_info("admission: %llu sources, %llu datagrams on the shared bucket, shed %llu times, receive queue %d%% full",
+             (unsigned long long)stats.sources, (unsigned long long)stats.overflowed,
+             (unsigned long long)stats.shed_periods, stats.fill);
+}
+
+void print_wheel_stats() {
+    WheelStats stats;
+    wheel_get_stats(&stats);
+    log_info("timers: %zu pending, %llu fired, %llu cancelled, %llu cascaded, %llu wakeups",
+             stats.pending, (unsigned long long)stats.fired, (unsigned long long)stats.cancelled,
+             (unsigned long long)stats.cascaded, (unsigned long long)stats.wakeups);
+}
+
+void print_pool_stats() {
+    Pool *pools[] = {&user_pool, &channel_pool, &sub_pool, &neighbor_pool};
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        PoolStats stats;
+        pool_get_stats(pools[i], &stats);
+        log_info("pool %s: %zu of %zu live (peak %zu), %zu bytes in %d slabs (%d huge), %llu failures",
+                 stats.name, stats.live, stats.capacity, stats.peak, stats.bytes, stats.slabs, stats.huge_slabs,
+                 (unsigned long long)stats.failures);
+    }
+}
+
+//print stats every minute
+void report_stats(int timer_fd, uint32_t expirations, void *arg) {
+    print_dedup_stats();
+    print_net_stats();
+    print_backlog_stats();
+    print_admit_stats();
+    admit_expire();
+    print_wheel_stats();
+    print_pool_stats();
+    if (log_dropped()) {
+        log_warn("log: %lu records dropped, writer fell behind", log_dropped());
+    }
+}
+
+size_t name_index_bytes(NameIndex *index) {
+    return index->capacity * sizeof(NameIndexSlot);
+}
+
+size_t user_list_bytes(UserList *list) {
+    return list->by_name.capacity * sizeof(NameIndexSlot) + list->by_addr.capacity * sizeof(AddrIndexSlot) +
+           list->fanout_capacity * (sizeof(struct sockaddr_in) + sizeof(User *));
+}
+
+//answers a scrape of the metrics socket, see metrics.h
+void render_metrics(MetricsWriter *out) {
+    char labels[64];
+    for (int kind = 0; kind < METRICS_KINDS; kind++) {
+        if (metrics.received[kind]) {
+            snprintf(labels, sizeof(labels), "type=\"%s\"", metrics_kind_name(kind));
+            metrics_counter(out, "duckchat_packets_received_total", labels, metrics.received[kind]);
+        }
+    }
+    for (int kind = 0; kind < METRICS_KINDS; kind++) {
+        if (metrics.received[kind]) {
+            snprintf(labels, sizeof(labels), "type=\"%s\"", metrics_kind_name(kind));
+            metrics_counter(out, "duckchat_bytes_received_total", labels, metrics.received_bytes[kind]);
+        }
+    }
+    for (int kind = 0; kind < METRICS_KINDS; kind++) {
+        if (metrics.sent[kind]) {
+            snprintf(labels, sizeof(labels), "type=\"%s\"", metrics_kind_name(kind));
+            metrics_counter(out, "duckchat_packets_sent_total", labels, metrics.sent[kind]);
+        }
+    }
+    for (int kind = 0; kind < METRICS_KINDS; kind++) {
+        if (metrics.sent[kind]) {
+            snprintf(labels, sizeof(labels), "type=\"%s\"", metrics_kind_name(kind));
+            metrics_counter(out, "duckchat_bytes_sent_total", labels, metrics.sent_bytes[kind]);
+        }
+    }
+
+    //neighbors in the order they were given on the command line
+    const char *neighbor_metrics[] = {"duckchat_neighbor_packets_received_total", "duckchat_neighbor_bytes_received_total",
+                                      "duckchat_neighbor_packets_sent_total", "duckchat_neighbor_bytes_sent_total"};
+    for (int m = 0; m < 4; m++) {
+        for (int i = 0; i < neighbor_count; i++) {
+            Neighbor *neighbor = neighbor_table[i];
+            uint64_t values[] = {neighbor->packets_in, neighbor->bytes_in, neighbor->packets_out, neighbor->bytes_out};
+            snprintf(labels, sizeof(labels), "neighbor=\"%s:%d\"", inet_ntoa(neighbor->addr.sin_addr), ntohs(neighbor->addr.sin_port));
+            metrics_counter(out, neighbor_metrics[m], labels, values[m]);
+        }
+    }
+
+    metrics_histogram(out, "duckchat_say_user_fanout", &metrics.say_users);
+    metrics_histogram(out, "duckchat_say_neighbor_fanout", &metrics.say_neighbors);
+
+    DedupStats dedup;
+    dedup_get_stats(&dedup);
+    metrics_counter(out, "duckchat_dedup_lookups_total", NULL, dedup.lookups);
+    metrics_counter(out, "duckchat_dedup_hits_total", NULL, dedup.hits);
+    metrics_counter(out, "duckchat_dedup_evicted_early_total", NULL, dedup.evicted_early);
+    metrics_gauge(out, "duckchat_dedup_ids", NULL, dedup.occupancy);
+    metrics_counter(out, "duckchat_prunes_total", NULL, metrics.prunes);
+    metrics_counter(out, "duckchat_soft_state_expiries_total", NULL, metrics.expiries);
+    metrics_counter(out, "duckchat_received_v2_total", NULL, metrics.received_v2);
+    metrics_counter(out, "duckchat_reply_cache_total", "result=\"hit\"", metrics.reply_cache_hits);
+    metrics_counter(out, "duckchat_reply_cache_total", "result=\"build\"", metrics.reply_cache_builds);
+    metrics_counter(out, "duckchat_tree_links_total", NULL, metrics.tree_links);
+    metrics_counter(out, "duckchat_tree_loops_refused_total", NULL, metrics.tree_loops);
+    metrics_counter(out, "duckchat_tree_switches_total", NULL, metrics.tree_switches);
+    if (core_mode) {
+        ReachStats reach;
+        reach_get_stats(&reach);
+        int cores = 0;
+        for (channel_sub *sub = subscriptions; sub; sub = sub->next) {
+            cores += sub->upstream < 0;
+        }
+        metrics_gauge(out, "duckchat_core_servers", NULL, reach.servers);
+        metrics_gauge(out, "duckchat_core_channels", NULL, cores);
+        metrics_counter(out, "duckchat_core_route_changes_total", NULL, reach.changes);
+        metrics_counter(out, "duckchat_core_holddowns_total", NULL, reach.holddowns);
+        metrics_counter(out, "duckchat_core_moves_total", NULL, metrics.core_moves);
+    }
+
+    CoalesceStats coalesce;
+    coalesce_get_stats(&coalesce);
+    metrics_counter(out, "duckchat_coalesced_messages_total", NULL, coalesce.messages);
+    metrics_counter(out, "duckchat_coalesce_datagrams_total", "carried=\"bundle\"", coalesce.bundles);
+    metrics_counter(out, "duckchat_coalesce_datagrams_total", "carried=\"single\"", coalesce.singles);
+    metrics_counter(out, "duckchat_coalesce_full_flushes_total", NULL, coalesce.full_flushes);
+    metrics_counter(out, "duckchat_coalesce_deadlines_total", NULL, coalesce.deadlines);
+
+    //live objects, walked at scrape time so the packet path keeps no extra counts
+    size_t members = 0;
+    size_t channel_bytes = name_index_bytes(&channel_index);
+    int local_channels = 0;
+    for (Channel *channel = channels; channel; channel = channel->next_channel) {
+        local_channels++;
+        members += channel->user_list.fanout_count;
+        channel_bytes += sizeof(Channel) + channel->user_list.fanout_count * sizeof(User) + user_list_bytes(&channel->user_list) +
+                         reply_cache_bytes(&channel->who);
+    }
+    int subscription_count = 0;
+    for (channel_sub *sub = subscriptions; sub; sub = sub->next) {
+        subscription_count++;
+    }
+    long neighbor_subscriptions = 0;
+    for (int channel = 0; channel < route_capacity; channel++) {
+        neighbor_subscriptions += routes[channel].count;
+    }
+    metrics_gauge(out, "duckchat_users", NULL, users.by_name.count);
+    metrics_gauge(out, "duckchat_channels", NULL, local_channels);
+    metrics_gauge(out, "duckchat_remote_channels", NULL, remote_channels.count);
+    metrics_gauge(out, "duckchat_channel_members", NULL, members);
+    metrics_gauge(out, "duckchat_subscriptions", NULL, subscription_count);
+    metrics_gauge(out, "duckchat_neighbor_subscriptions", NULL, neighbor_subscriptions);
+    metrics_gauge(out, "duckchat_neighbors", NULL, neighbor_count);
+    metrics_gauge(out, "duckchat_memory_bytes", "kind=\"users\"", users.by_name.count * sizeof(User) + user_list_bytes(&users));
+    metrics_gauge(out, "duckchat_memory_bytes", "kind=\"channels\"",
+                  channel_bytes + name_index_bytes(&remote_channels) + reply_cache_bytes(&list_reply));
+    metrics_gauge(out, "duckchat_memory_bytes", "kind=\"subscriptions\"",
+                  subscription_count * sizeof(channel_sub) + route_capacity * (sizeof(Route) + route_words * sizeof(uint64_t)));
+
+    NetStats net;
+    net_get_stats(&net);
+    metrics_counter(out, "duckchat_recv_calls_total", NULL, net.recv_calls);
+    metrics_counter(out, "duckchat_send_calls_total", NULL, net.send_calls);
+    metrics_counter(out, "duckchat_send_errors_total", NULL, net.send_errors);
+    snprintf(labels, sizeof(labels), "backend=\"%s\"", net_backend());
+    metrics_gauge(out, "duckchat_net_backend", labels, 1);
+    BacklogStats backlog;
+    backlog_get_stats(&backlog);
+    metrics_gauge(out, "duckchat_backlog_datagrams", NULL, backlog.datagrams);
+    metrics_gauge(out, "duckchat_backlog_bytes", NULL, backlog.bytes);
+    metrics_gauge(out, "duckchat_backlog_destinations", NULL, backlog.destinations);
+    metrics_counter(out, "duckchat_backlog_queued_total", NULL, backlog.queued);
+    metrics_counter(out, "duckchat_backlog_sent_total", NULL, backlog.sent);
+    metrics_counter(out, "duckchat_backlog_dropped_total", NULL, backlog.dropped);
+    metrics_counter(out, "duckchat_backlog_kept_total", NULL, backlog.kept);
+    if (admit_enabled()) {
+        AdmitStats admission;
+        admit_get_stats(&admission);
+        char class_labels[ADMIT_CLASSES][32];
+        for (int klass = 0; klass < ADMIT_CLASSES; klass++) {
+            snprintf(class_labels[klass], sizeof(class_labels[klass]), "class=\"%s\"", admit_class_name(klass));
+        }
+        for (int klass = 0; klass < ADMIT_CLASSES; klass++) metrics_counter(out, "duckchat_admission_admitted_total", class_labels[klass], admission.admitted[klass]);
+        for (int klass = 0; klass < ADMIT_CLASSES; klass++) metrics_counter(out, "duckchat_admission_rate_limited_total", class_labels[klass], admission.limited[klass]);
+        for (int klass = 0; klass < ADMIT_CLASSES; klass++) metrics_counter(out, "duckchat_admission_shed_total", class_labels[klass], admission.shed[klass]);
+        metrics_gauge(out, "duckchat_admission_shedding", NULL, admission.shedding);
+        metrics_counter(out, "duckchat_admission_shed_periods_total", NULL, admission.shed_periods);
+        metrics_gauge(out, "duckchat_admission_receive_queue_percent", NULL, admission.fill);
+        metrics_gauge(out, "duckchat_admission_sources", NULL, admission.sources);
+        metrics_counter(out, "duckchat_admission_overflowed_total", NULL, admission.overflowed);
+    }
+    PipelineStats pipeline;
+    pipeline_get_stats(&pipeline);
+    if (pipeline.senders) {
+        const int queue_count = 1 + pipeline.senders;
+        PipelineQueueStats *queues[1 + PIPELINE_MAX_SENDERS];
+        char queue_labels[1 + PIPELINE_MAX_SENDERS][32];
+        queues[0] = &pipeline.rx;
+        snprintf(queue_labels[0], sizeof(queue_labels[0]), "queue=\"rx\"");
+        for (int i = 0; i < pipeline.senders; i++) {
+            queues[1 + i] = &pipeline.send[i];
+            snprintf(queue_labels[1 + i], sizeof(queue_labels[1 + i]), "queue=\"send%d\"", i);
+        }
+        for (int i = 0; i < queue_count; i++) metrics_gauge(out, "duckchat_pipeline_queue_depth", queue_labels[i], queues[i]->depth);
+        for (int i = 0; i < queue_count; i++) metrics_gauge(out, "duckchat_pipeline_queue_high_water", queue_labels[i], queues[i]->high_water);
+        for (int i = 0; i < queue_count; i++) metrics_counter(out, "duckchat_pipeline_queue_full_total", queue_labels[i], queues[i]->full);
+        metrics_counter(out, "duckchat_pipeline_oversized_total", NULL, pipeline.oversized);
+    }
+    WheelStats wheel;
+    wheel_get_stats(&wheel);
+    metrics_gauge(out, "duckchat_timers_pending", NULL, wheel.pending);
+    metrics_counter(out, "duckchat_timers_fired_total", NULL, wheel.fired);
+    metrics_counter(out, "duckchat_log_dropped_total", NULL, log_dropped());
+    metrics_counter(out, "duckchat_handoffs_dropped_total", NULL, shard_dropped());
+
+    Pool *pools[] = {&user_pool, &channel_pool, &sub_pool, &neighbor_pool};
+    const int pool_count = sizeof(pools) / sizeof(pools[0]);
+    PoolStats pool_stats[pool_count];
+    char pool_labels[pool_count][48];
+    for (int i = 0; i < pool_count; i++) {
+        pool_get_stats(pools[i], &pool_stats[i]);
+        snprintf(pool_labels[i], sizeof(pool_labels[i]), "pool=\"%s\"", pool_stats[i].name);
+    }
+    //one metric at a time, so each gets a single # TYPE line
+    for (int i = 0; i < pool_count; i++) metrics_gauge(out, "duckchat_pool_live", pool_labels[i], pool_stats[i].live);
+    for (int i = 0; i < pool_count; i++) metrics_gauge(out, "duckchat_pool_peak", pool_labels[i], pool_stats[i].peak);
+    for (int i = 0; i < pool_count; i++) metrics_gauge(out, "duckchat_pool_capacity", pool_labels[i], pool_stats[i].capacity);
+    for (int i = 0; i < pool_count; i++) metrics_gauge(out, "duckchat_pool_bytes", pool_labels[i], pool_stats[i].bytes);
+    for (int i = 0; i < pool_count; i++) metrics_gauge(out, "duckchat_pool_huge_slabs", pool_labels[i], pool_stats[i].huge_slabs);
+    for (int i = 0; i < pool_count; i++) metrics_counter(out, "duckchat_pool_allocs_total", pool_labels[i], pool_stats[i].allocs);
+    for (int i = 0; i < pool_count; i++) metrics_counter(out, "duckchat_pool_failures_total", pool_labels[i], pool_stats[i].failures);
+}
+
+//soft-state timers queue joins and leaves, send them together
+void flush_timer_output() {
+    net_flush();
+}
+
+//only SAYs may be dropped from a neighbor's backlog; losing a join, leave or tree link would bend routing
+int backlog_keep(const struct sockaddr_in *dest, const void *data, size_t len) {
+    if (!find_neighbor_by_address((struct sockaddr_in *)dest)) {
+        return 0;
+    }
+    WireMessage msg;
+    if (wire_decode(data, len, 0, &msg) < 0) {
+        return 1;
+    }
+    if (msg.type != WIRE_BUNDLE) {
+        return msg.type != S2S_SAY;
+    }
+    size_t offset = 0;
+    const char *bundled;
+    size_t bundled_len;
+    while (wire_next_bundled(&msg, &offset, &bundled, &bundled_len) == 0) {
+        WireMessage inner;
+        if (wire_decode(bundled, bundled_len, 0, &inner) < 0 || inner.type != S2S_SAY) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//handles a batch one admission class at a time, neighbors' control first and says last
+//the pass of each source's latest datagram in the batch, open addressing on the address;
+//entries from earlier batches are told apart by their stamp
+#define BATCH_SOURCES (2 * NET_MAX_BATCH)
+static uint64_t batch_source_keys[BATCH_SOURCES];
+static unsigned char batch_source_passes[BATCH_SOURCES];
+static uint32_t batch_source_stamps[BATCH_SOURCES];
+static uint32_t batch_stamp = 0;
+
+//a datagram goes no earlier than the one before it from the same source, so nobody's
+//SAY and LEAVE swap places; returns the pass it goes in
+int batch_pass(const struct sockaddr_in *source, int klass) {
+    uint64_t key = addr_key(source);
+    size_t slot = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 53) & (BATCH_SOURCES - 1);
+    while (batch_source_stamps[slot] == batch_stamp && batch_source_keys[slot] != key) {
+        slot = (slot + 1) & (BATCH_SOURCES - 1);
+    }
+    if (batch_source_stamps[slot] == batch_stamp && batch_source_passes[slot] > klass) {
+        klass = batch_source_passes[slot];
+    }
+    batch_source_stamps[slot] = batch_stamp;
+    batch_source_keys[slot] = key;
+    batch_source_passes[slot] = (unsigned char)klass;
+    return klass;
+}
+
+void dispatch_admitted(int sockfd, NetPacket *packets, int received) {
+    static unsigned char passes[NET_MAX_BATCH];
+    admit_begin_batch(net_recv_fill(sockfd));
+    if (++batch_stamp == 0) {
+        memset(batch_source_stamps, 0, sizeof(batch_source_stamps));
+        batch_stamp = 1;
+    }
+    for (int i = 0; i < received; i++) {
+        passes[i] = ADMIT_CLASSES;
+        if (packets[i].len > 0) {
+            int from_neighbor = find_neighbor_by_address(&packets[i].addr) != NULL;
+            int klass = admit_class(wire_peek_type(packets[i].data, packets[i].len), from_neighbor);
+            if (admit(&packets[i].addr, klass, from_neighbor)) {
+                passes[i] = (unsigned char)batch_pass(&packets[i].addr, klass);
+            }
+        }
+    }
+    for (int pass = 0; pass < ADMIT_CLASSES; pass++) {
+        for (int i = 0; i < received; i++) {
+            if (passes[i] == pass) {
+                dispatch_request(sockfd, &packets[i].addr, packets[i].addr_len, packets[i].data, packets[i].len);
+            }
+        }
+    }
+}
+
+void receive_datagrams(int fd, uint32_t events, void *arg) {
+    int sockfd = *(int *)arg;
+    if (events & EPOLLOUT) {
+        net_drain(sockfd);
+        if (!(events & ~EPOLLOUT)) {
+            return;
+        }
+    }
+    //drain a batch, dispatch it, then send every reply in one go
+    NetPacket *packets;
+    int received = net_recv_batch(sockfd, &packets);
+    if (received < 0) {
+        log_error("%s receive failed: %s", net_backend(), strerror(errno));
+        return;
+    }
+    if (admit_enabled()) {
+        dispatch_admitted(sockfd, packets, received);
+    } else {
+        for (int i = 0; i < received; i++) {
+            if (packets[i].len > 0) {
+                dispatch_request(sockfd, &packets[i].addr, packets[i].addr_len, packets[i].data, packets[i].len);
+            }
+        }
+    }
+    net_flush();
+}
+
+//SIGINT or SIGTERM: leave the event loop so main() removes the metrics socket and flushes the log
+void stop_on_signal(int fd, uint32_t events, void *arg) {
+    struct signalfd_siginfo info;
+    if (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        log_info("Stopping on signal %u", info.ssi_signo);
+    }
+    event_stop();
+}
+
+//EPOLLOUT is watched only while the backlog holds datagrams, a UDP socket is writable nearly always
+void watch_writable(int wanted) {
+    uint32_t events = wanted ? EPOLLOUT : 0;
+    if (net_poll_fd(server_sockfd) == server_sockfd) {
+        events |= EPOLLIN;
+    }
+    //with -U the loop polls the ring's eventfd, so the socket is only registered for this
+    if (event_mod_fd(server_sockfd, events) < 0 &&
+        (errno != ENOENT || event_add_fd(server_sockfd, events, receive_datagrams, &server_sockfd) < 0)) {
+        log_error("watching the socket for room failed: %s", strerror(errno));
+    }
+}
+
+void usage(char *prog){
+    fprintf(stderr, "Usage: %s [-W dedup_window_seconds] [-M dedup_capacity] [-B batch_size] [-w workers] [-l error|warn|info|debug] [-b binary_log_file] [-m metrics_socket] [-C coalesce_flush_us] [-P users,channels] [-H] [-T] [-U] [-S send_threads] [-Q backlog_depth[,oldest|newest]] [-A say_rate[,burst[,watermark]]] [-R] <server_ip> <port> [<neighbor_ip> <neighbor_port>]...\n", prog);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]){
 
-    if (argc < 3 || (argc % 2 != 1)) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
+    int dedup_window = DEDUP_DEFAULT_WINDOW;
+    long dedup_capacity = DEDUP_DEFAULT_CAPACITY;
+    int batch_size = NET_DEFAULT_BATCH;
+    int workers = 1;
+    int log_level = LOG_LEVEL_INFO;
+    char *binary_log = NULL;
+    char *metrics_path = NULL;
+    long coalesce_us = 0;
+    long pool_users = MAX_USERS;
+    long pool_channels = MAX_CHANNELS;
+    int hugepages = 0;
+    int uring = 0;
+    int send_threads = 0;
+    int backlog_depth = BACKLOG_DEFAULT_DEPTH;
+    int backlog_policy = BACKLOG_DROP_OLDEST;
+    char policy_name[16];
+    double say_rate = 0;
+    double say_burst = 0;
+    int watermark = ADMIT_DEFAULT_WATERMARK;
+    int opt;
+    while ((opt = getopt(argc, argv, "W:M:B:w:l:b:m:C:P:HTUS:Q:A:R")) != -1) {
+        switch (opt) {
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'C':
+                coalesce_us = atol(optarg);
+                break;
+            case 'P':
+                if (sscanf(optarg, "%ld,%ld", &pool_users, &pool_channels) != 2) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'H':
+                hugepages = 1;
+                break;
+            case 'T':
+                tree_mode = 1;
+                break;
+            case 'U':
+                uring = 1;
+                break;
+            case 'R':
+                core_mode = 1;
+                break;
+            case 'S':
+                send_threads = atoi(optarg);
+                break;
+            case 'Q':
+                switch (sscanf(optarg, "%d,%15s", &backlog_depth, policy_name)) {
+                    case 2:
+                        backlog_policy = backlog_policy_from_name(policy_name);
+                        break;
+                    case 1:
+                        break;
+                    default:
+                        usage(argv[0]);
+                }
+                break;
+            case 'A':
+                switch (sscanf(optarg, "%lf,%lf,%d", &say_rate, &say_burst, &watermark)) {
+                    case 1:
+                        //one second's worth
+                        say_burst = say_rate;
+                        break;
+                    case 2:
+                    case 3:
+                        break;
+                    default:
+                        usage(argv[0]);
+                }
+                break;
+            case 'l':
+                log_level = log_level_from_name(optarg);
+                break;
+            case 'b':
+                binary_log = optarg;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'B':
+                batch_size = atoi(optarg);
+                break;
+            case 'W':
+                dedup_window = atoi(optarg);
+                break;
+            case 'M':
+                dedup_capacity = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    //shift the options away so the positional arguments keep their old indexes
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    if (argc < 3 || (argc % 2 != 1) || dedup_window <= 0 || dedup_capacity <= 0 || batch_size <= 0 || workers < 1 || workers > SHARD_MAX || log_level < 0 || coalesce_us < 0 || pool_users < 0 || pool_channels < 0 || send_threads < 0 || send_threads > PIPELINE_MAX_SENDERS || backlog_depth < 0 || backlog_policy < 0 || say_rate < 0 || say_burst < 0 || watermark < 1 || watermark > 100) {
+        usage(argv[0]);
+    }
+    if (dedup_init((size_t)dedup_capacity, dedup_window) < 0) {
+        perror("dedup table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (net_init(batch_size) < 0) {
+        perror("batch allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    backlog_init(backlog_depth, backlog_policy, backlog_keep);
+    admit_init(say_rate, say_burst, watermark);
+    net_set_writable_callback(watch_writable);
+
+    //every worker sets up its own socket and event loop from here on
+    if (workers > 1) {
+        //workers share stdout, keep their lines from interleaving
+        setvbuf(stdout, NULL, _IOLBF, 0);
+    }
+    //SIGINT and SIGTERM are read from a signalfd by the event loop, so they are blocked
+    //before the workers and any threads start and inherit the mask
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &stop_signals, NULL) < 0) {
+        perror("signal setup failed");
+        exit(EXIT_FAILURE);
+    }
+    if (workers > 1 && shard_spawn(workers) < 0) {
+        perror("worker fork failed");
+        exit(EXIT_FAILURE);
+    }
+
+    //from here on nothing on the packet path writes to stdio directly
+    if (log_init(log_level, binary_log, shard_index()) < 0) {
+        perror("log setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    msgid_init(msgid_node(argv[1], atoi(argv[2]), shard_index()));
+
+    //each worker maps its own pools; members are user records too, so users get twice the room
+    pool_use_hugepages(hugepages);
+    if (pool_init(&user_pool, "users", sizeof(User), 2 * pool_users) < 0 ||
+        pool_init(&channel_pool, "channels", sizeof(Channel), pool_channels) < 0 ||
+        pool_init(&sub_pool, "subscriptions", sizeof(channel_sub), pool_channels) < 0 ||
+        pool_init(&neighbor_pool, "neighbors", sizeof(Neighbor), (argc - 3) / 2) < 0) {
+        perror("pool allocation failed");
         exit(EXIT_FAILURE);
     }
 
     int sockfd;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
 
     //Create socket 
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -823,6 +2362,14 @@ int main(int argc, char *argv[]){
     int flags = fcntl(sockfd, F_GETFL, 0);
     fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
 
+    if (workers > 1) {
+        int reuse = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+            perror("SO_REUSEPORT failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     char arg[10];
@@ -833,6 +2380,7 @@ int main(int argc, char *argv[]){
         server_addr_for_ip_display.sin_addr.s_addr = inet_addr(arg);
     }else{
         server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+        server_addr_for_ip_display.sin_addr.s_addr = inet_addr(argv[1]);
     }
     
     server_addr.sin_port = htons(atoi(argv[2]));
@@ -847,8 +2395,34 @@ int main(int argc, char *argv[]){
         close(sockfd);
         exit(EXIT_FAILURE);
     }
+    server_sockfd = sockfd;
+    //each worker sets up its own rings and threads, they cannot be shared across the fork
+    if (send_threads > 0) {
+        if (uring) {
+            log_warn("-U is ignored with -S, the pipeline threads use recvmmsg/sendmmsg");
+        }
+        if (net_use_pipeline(sockfd, send_threads) < 0) {
+            log_warn("pipeline threads failed to start (%s), staying in the event loop", strerror(errno));
+        }
+    } else if (uring && net_use_uring(sockfd) < 0) {
+        log_warn("io_uring unavailable (%s), using recvmmsg/sendmmsg", strerror(errno));
+    }
+
+    if (core_mode && tree_mode) {
+        log_warn("-T is ignored with -R, channel trees grow toward their cores instead");
+        tree_mode = 0;
+    }
 
-    printf("Server started on %s:%s\n", argv[1], argv[2]);
+    //trace lines show the configured address, not INADDR_ANY
+    struct sockaddr_in local_addr = server_addr_for_ip_display;
+    local_addr.sin_port = server_addr.sin_port;
+    log_set_local(&local_addr);
+
+    if (workers > 1) {
+        log_info("Server started on %s:%s (worker %d of %d)", argv[1], argv[2], shard_index() + 1, workers);
+    } else {
+        log_info("Server started on %s:%s", argv[1], argv[2]);
+    }
 
     //add neighbors 
     for(int i = 3; i< argc; i+= 2){
@@ -857,70 +2431,52 @@ int main(int argc, char *argv[]){
         add_neighbor(n_ip, n_port);
     }
 
-    fd_set read_fds;
-    struct timeval timeout;
-    time_t last_renewal = 0;
-
-     while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(sockfd, &read_fds);
-        timeout.tv_sec = 1; // 1-second timeout
-        timeout.tv_usec = 0;
+    //neighbors know this server by the address they were given, so the routes use that one
+    if (core_mode && reach_init(&local_addr, neighbor_count) < 0) {
+        perror("route table allocation failed");
+        exit(EXIT_FAILURE);
+    }
 
-         time_t now = time(NULL);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (event_init() < 0 || signal_fd < 0 ||
+        event_add_fd(signal_fd, EPOLLIN, stop_on_signal, NULL) < 0 ||
+        event_add_fd(net_poll_fd(sockfd), EPOLLIN, receive_datagrams, &sockfd) < 0 ||
+        event_add_timer(STATS_INTERVAL * 1000L, STATS_INTERVAL * 1000L, report_stats, NULL) < 0 ||
+        (core_mode && event_add_timer(REACH_INTERVAL * 1000L, REACH_INTERVAL * 1000L, reach_tick, NULL) < 0) ||
+        wheel_init(WHEEL_DEFAULT_TICK_MS, flush_timer_output) < 0) {
+        perror("event loop setup failed");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+    if (coalesce_init(sockfd, coalesce_us) < 0) {
+        perror("coalescing timer setup failed");
+        exit(EXIT_FAILURE);
+    }
+    if (metrics_path && metrics_init(metrics_path, shard_index(), render_metrics) < 0) {
+        perror("metrics socket setup failed");
+        exit(EXIT_FAILURE);
+    }
+    if (shard_inbox_fd() >= 0 && event_add_fd(shard_inbox_fd(), EPOLLIN, receive_handoffs, &sockfd) < 0) {
+        perror("worker hand-off setup failed");
+        exit(EXIT_FAILURE);
+    }
 
-        //send join every 60 seconds.
-        if (difftime(now,last_renewal) >= 60) {
-            channel_sub *current = subscriptions;
-            while (current) {
-                subscribe_all_neighbors(current->name);
-                broadcast_s2s_join(sockfd, NULL, current->name, 1);
-                current = current->next;
-            }
-            last_renewal = now;
-        }
-        
-        channel_sub * current = subscriptions;
-        // Check for expired subscriptions
-        while (current) {
-            
-            if (difftime(now,current->last_renewed) > 120) {
-                printf("now - current %f", difftime(now, current->last_renewed));
-                
-                //loop through every neighbor, check if it is subscribed and if it is send a leave
-                Neighbor *neighbor = neighbors;
-                while (neighbor) {
-                    if (is_subscribed(neighbor, current->name)) { 
-                        send_s2s_leave(sockfd, &neighbor->addr, current->name); //send leave 
-                        leave_channel(sockfd, neighbor, current->name); //remove locally in forwarding table 
-                    }
-                    neighbor = neighbor->next; 
-                }
-                remove_channel_sub(current->name); //channel did not receive soft join so remove it from subscriptions list
-            }
-            current = current->next;
+    //offer v2 to every neighbor; v1 servers drop the HELLO and stay v1.
+    //one worker is enough, the answer is shared with the others
+    if (shard_index() == 0) {
+        for (Neighbor *neighbor = neighbors; neighbor; neighbor = neighbor->next) {
+            send_hello(sockfd, &neighbor->addr, 0);
         }
+        net_flush();
+    }
 
-        int activity = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
-        if (activity < 0 && errno != EINTR) {
-            perror("select error");
-            break;
-        }else if(activity > 0){
-            if (FD_ISSET(sockfd, &read_fds)) {
-                int bytes_recieved = recvfrom(sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&client_addr, &client_len);
-                if  (bytes_recieved > 0){
-                    handle_request(sockfd, &client_addr, client_len, buffer);
-                }
-                if (bytes_recieved < 0) {
-                    perror("recvfrom failed");
-                    continue;
-                }
-            }else{
-                printf("Waiting for client data...\n");
-            }
-        }
+    if (event_run() < 0) {
+        log_error("epoll_wait failed: %s", strerror(errno));
     }
 
+    metrics_shutdown();
+    log_shutdown();
+    close(signal_fd);
     close(sockfd);
     return 0;
 }
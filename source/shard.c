@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "shard.h"
+#include "index.h"
+
+/* See shard.h for usage information */
+
+//unix datagram queues hold only max_dgram_qlen messages, seqpacket links are bounded by buffer size.
+//every sibling sends through the same end of a worker's inbox, so they share this much queue
+#define SHARD_LINK_BUFFER (4 * 1024 * 1024)
+
+static int workers = 1;
+static int self = 0;
+//inbox[i] is the end the other workers send to worker i through, -1 for this worker's own
+static int inbox[SHARD_MAX];
+static int inbox_fd = -1;
+static unsigned long dropped = 0;
+
+//undoes a shard_spawn() that failed partway: closes both ends of every inbox made so far
+//and stops the workers already forked
+static void spawn_failed(int (*ends)[2], int made, const pid_t *children, int forked) {
+    int saved = errno;
+    for (int i = 0; i < made; i++) {
+        close(ends[i][0]);
+        close(ends[i][1]);
+    }
+    for (int i = 0; i < forked; i++) {
+        kill(children[i], SIGTERM);
+        waitpid(children[i], NULL, 0);
+    }
+    errno = saved;
+}
+
+int shard_spawn(int count) {
+    if (count < 1 || count > SHARD_MAX) {
+        return -1;
+    }
+
+    //ends[i][0] is read by worker i, ends[i][1] is written by everyone else,
+    //so each process keeps count descriptors instead of one per pair of workers
+    static int ends[SHARD_MAX][2];
+    for (int i = 0; i < count; i++) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, ends[i]) < 0) {
+            spawn_failed(ends, i, NULL, 0);
+            return -1;
+        }
+        int size = SHARD_LINK_BUFFER;
+        setsockopt(ends[i][1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(ends[i][0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+
+    static pid_t children[SHARD_MAX];
+    pid_t parent = getpid();
+    int index = 0;
+    for (int i = 1; i < count; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            spawn_failed(ends, count, children, i - 1);
+            return -1;
+        }
+        if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent) {
+                //parent died before prctl took effect
+                exit(EXIT_FAILURE);
+            }
+            index = i;
+            break;
+        }
+        children[i - 1] = pid;
+    }
+
+    //keep this worker's read end and everyone else's write end
+    workers = count;
+    self = index;
+    for (int i = 0; i < count; i++) {
+        if (i == self) {
+            inbox_fd = ends[i][0];
+            inbox[i] = -1;
+            close(ends[i][1]);
+        } else {
+            inbox[i] = ends[i][1];
+            close(ends[i][0]);
+        }
+    }
+    return self;
+}
+
+int shard_inbox_fd(void) {
+    return inbox_fd;
+}
+
+int shard_count(void) {
+    return workers;
+}
+
+int shard_index(void) {
+    return self;
+}
+
+int shard_owner(const char *channel_name) {
+    if (workers == 1) {
+        return 0;
+    }
+    return (int)(name_hash(channel_name) % (uint64_t)workers);
+}
+
+int shard_send(int worker, int kind, const struct sockaddr_in *origin,
+               const char *username, const void *payload, size_t len) {
+    struct shard_message message;
+    if (len > sizeof(message.payload)) {
+        len = sizeof(message.payload);
+    }
+    message.kind = kind;
+    if (origin) {
+        message.origin = *origin;
+    } else {
+        memset(&message.origin, 0, sizeof(message.origin));
+    }
+    memset(message.username, 0, USERNAME_MAX);
+    if (username) {
+        strncpy(message.username, username, USERNAME_MAX - 1);
+    }
+    if (len) {
+        memcpy(message.payload, payload, len);
+    }
+
+    //never block on a sibling, two full workers sending to each other would deadlock
+    if (send(inbox[worker], &message, SHARD_HEADER_SIZE + len, MSG_DONTWAIT) < 0) {
+        dropped++;
+        return -1;
+    }
+    return 0;
+}
+
+int shard_broadcast(int kind, const struct sockaddr_in *origin,
+                    const char *username, const void *payload, size_t len) {
+    int result = 0;
+    for (int i = 0; i < workers; i++) {
+        if (i != self && shard_send(i, kind, origin, username, payload, len) < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int shard_recv(int fd, struct shard_message *message) {
+    ssize_t n = recv(fd, message, sizeof(*message), MSG_DONTWAIT);
+    if (n < (ssize_t)SHARD_HEADER_SIZE) {
+        return -1;
+    }
+    return (int)(n - SHARD_HEADER_SIZE);
+}
+
+unsigned long shard_dropped(void) {
+    return dropped;
+}
@@ -0,0 +1,78 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+#include "netio.h"
+
+/* Multi-worker mode.
+ *
+ * With -w N the server forks N worker processes.  Each binds its own
+ * socket to the server port with SO_REUSEPORT, so the kernel spreads
+ * clients and neighbors across workers by address.  State is sharded:
+ *
+ *   - a user lives on the worker its packets land on (its home worker);
+ *   - a channel, its members and its S2S subscriptions live on the
+ *     worker that owns the channel name, name_hash(channel) % N.
+ *
+ * A channel request (JOIN, LEAVE, SAY, WHO and every S2S message) that
+ * lands on a worker which does not own the channel is handed off to the
+ * owner's inbox, a unix socket, with the sender's address and, for
+ * client requests, the username from the home worker.  The owner then
+ * runs the normal handler and replies straight from its own socket,
+ * which shares the server port.  LOGOUT is broadcast to every worker,
+ * and channel creation/deletion is announced to every worker so LIST can
+ * answer from any of them.
+ */
+
+#define SHARD_MAX 64
+
+#define SHARD_REQUEST 1
+#define SHARD_LOGOUT 2
+#define SHARD_CHANNEL_ADD 3
+#define SHARD_CHANNEL_DEL 4
+
+//never leaves the host, so it is left unpacked
+struct shard_message {
+    int kind;
+    struct sockaddr_in origin;
+    char username[USERNAME_MAX];
+    char payload[NET_RECV_BUFFER];
+};
+
+#define SHARD_HEADER_SIZE offsetof(struct shard_message, payload)
+
+/* Gives every worker an inbox, a SOCK_SEQPACKET socketpair whose other
+ * end all its siblings send through, and forks count - 1 more workers.
+ * Each worker ends up with count descriptors however many there are.
+ * Returns this process's worker index (0 in the original process), or
+ * -1 on failure, with every inbox closed and any forked workers stopped.
+ * Children exit if the original process dies. */
+int shard_spawn(int count);
+
+/* This worker's inbox, which the caller watches for incoming hand-offs,
+ * or -1 with a single worker. */
+int shard_inbox_fd(void);
+
+int shard_count(void);
+int shard_index(void);
+
+/* Worker that owns a channel name. */
+int shard_owner(const char *channel_name);
+
+/* Sends a hand-off message to one worker, or to every other worker.
+ * Returns -1 if it could not be delivered. */
+int shard_send(int worker, int kind, const struct sockaddr_in *origin,
+               const char *username, const void *payload, size_t len);
+int shard_broadcast(int kind, const struct sockaddr_in *origin,
+                    const char *username, const void *payload, size_t len);
+
+/* Receives one hand-off message.  Returns the payload length, or -1 if
+ * nothing was waiting. */
+int shard_recv(int fd, struct shard_message *message);
+
+/* Hand-offs dropped because a worker's queue was full. */
+unsigned long shard_dropped(void);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Lock-free single-producer/single-consumer ring of fixed-size slots,
+ * for handing packets between the pipeline threads (see pipeline.h).
+ *
+ * The producer claims slots in place, fills them and publishes them in
+ * one store; the consumer reads them in place and releases them when it
+ * is done, so nothing is copied in or out of the ring.  head is written
+ * only by the producer and tail only by the consumer, each on its own
+ * cache line.  Each side keeps a copy of the other's index and reloads
+ * it only when the copy says the ring is full (or empty).
+ *
+ * The caller owns the storage: capacity slots of slot_size bytes, with
+ * capacity a power of two.
+ */
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct Spsc {
+    char *slots;
+    size_t slot_size;
+    uint64_t mask;
+    //producer side
+    uint64_t head __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint64_t tail_seen;
+    uint64_t high_water; /* deepest the ring has been, as the producer saw it */
+    //consumer side
+    uint64_t tail __attribute__((aligned(SPSC_CACHE_LINE)));
+    uint64_t head_seen;
+} Spsc;
+
+static inline void spsc_init(Spsc *ring, void *slots, size_t slot_size, uint64_t capacity) {
+    ring->slots = (char *)slots;
+    ring->slot_size = slot_size;
+    ring->mask = capacity - 1;
+    ring->head = ring->tail_seen = ring->high_water = 0;
+    ring->tail = ring->head_seen = 0;
+}
+
+static inline void *spsc_slot(const Spsc *ring, uint64_t index) {
+    return ring->slots + (index & ring->mask) * ring->slot_size;
+}
+
+/* Producer: how many slots from spsc_slot(ring, ring->head) on are free,
+ * up to want. */
+static inline uint64_t spsc_free(Spsc *ring, uint64_t want) {
+    uint64_t capacity = ring->mask + 1;
+    if (capacity - (ring->head - ring->tail_seen) < want) {
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    }
+    uint64_t free = capacity - (ring->head - ring->tail_seen);
+    return free < want ? free : want;
+}
+
+/* Producer: hands the next count slots to the consumer. */
+static inline void spsc_publish(Spsc *ring, uint64_t count) {
+    uint64_t head = ring->head + count;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    if (head - ring->tail_seen > ring->high_water) {
+        __atomic_store_n(&ring->high_water, head - ring->tail_seen, __ATOMIC_RELAXED);
+    }
+}
+
+/* Consumer: how many slots from spsc_slot(ring, ring->tail) on are
+ * filled, up to want. */
+static inline uint64_t spsc_ready(Spsc *ring, uint64_t want) {
+    if (ring->head_seen - ring->tail < want) {
+        ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+    uint64_t ready = ring->head_seen - ring->tail;
+    return ready < want ? ready : want;
+}
+
+/* Consumer: gives the next count slots back to the producer. */
+static inline void spsc_release(Spsc *ring, uint64_t count) {
+    __atomic_store_n(&ring->tail, ring->tail + count, __ATOMIC_RELEASE);
+}
+
+/* Slots filled and not yet released, from any thread. */
+static inline uint64_t spsc_depth(const Spsc *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif
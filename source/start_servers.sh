@@ -1,37 +1,133 @@
 #!/usr/bin/bash
 
-#uncomment the topolgy you want. The simple two-server topology is uncommented here.
+# Starts a test topology of servers on localhost.
+#
+#   ./start_servers.sh [two|h|grid]
+#   ./start_servers.sh ring|tree <nodes>
+#   ./start_servers.sh random <nodes> [average_degree] [seed]
+#
+# With no arguments the simple two-server topology is started. Each
+# topology_* function prints one line per server: its port followed by
+# its neighbors' ports. bench_topology.sh sources this file to reuse them.
 
 # Change the SERVER variable below to point your server executable.
-SERVER=./server
+SERVER=${SERVER:-./server}
+# First port of the generated ring, tree and random topologies
+BASE_PORT=${BASE_PORT:-4050}
 
-SERVER_NAME=`echo $SERVER | sed 's#.*/\(.*\)#\1#g'`
+SERVER_PIDS=()
 
 # Generate a simple two-server topology
-$SERVER localhost 4050 localhost 4051 &
-$SERVER localhost 4051 localhost 4050 & 
+topology_two() {
+    echo "4050 4051"
+    echo "4051 4050"
+}
 
 # Generate a capital-H shaped topology
-#$SERVER localhost 4050 localhost 4051 &
-#$SERVER localhost 4051 localhost 4050 localhost 4052 localhost 4053 &
-#$SERVER localhost 4052 localhost 4051 & 
-#$SERVER localhost 4053 localhost 4051 localhost 4055 &
-#$SERVER localhost 4054 localhost 4055 &
-#$SERVER localhost 4055 localhost 4054 localhost 4053 localhost 4056 &
-#$SERVER localhost 4056 localhost 4055 &
+topology_h() {
+    echo "4050 4051"
+    echo "4051 4050 4052 4053"
+    echo "4052 4051"
+    echo "4053 4051 4055"
+    echo "4054 4055"
+    echo "4055 4054 4053 4056"
+    echo "4056 4055"
+}
 
 # Generate a 3x3 grid topology
-#$SERVER localhost 8100 localhost 8101 localhost 8103 &
-#$SERVER localhost 8101 localhost 8100 localhost 8102 localhost 8104 &
-#$SERVER localhost 8102 localhost 8101 localhost 8105 &
-#$SERVER localhost 8103 localhost 8100 localhost 8104 localhost 8106 &
-#$SERVER localhost 8104 localhost 8101 localhost 8103 localhost 8105 localhost 8107 &
-#$SERVER localhost 8105 localhost 8102 localhost 8104 localhost 8108 &
-#$SERVER localhost 8106 localhost 8103 localhost 8107 &
-#$SERVER localhost 8107 localhost 8106 localhost 8104 localhost 8108 &
-#$SERVER localhost 8108 localhost 8105 localhost 8107 &
-
-
-echo "Press ENTER to quit"
-read
-pkill $SERVER_NAME
+topology_grid() {
+    echo "8100 8101 8103"
+    echo "8101 8100 8102 8104"
+    echo "8102 8101 8105"
+    echo "8103 8100 8104 8106"
+    echo "8104 8101 8103 8105 8107"
+    echo "8105 8102 8104 8108"
+    echo "8106 8103 8107"
+    echo "8107 8106 8104 8108"
+    echo "8108 8105 8107"
+}
+
+# Generate a ring of N servers (N >= 3)
+topology_ring() {
+    local n=$1
+    for ((i = 0; i < n; i++)); do
+        echo "$((BASE_PORT + i)) $((BASE_PORT + (i + n - 1) % n)) $((BASE_PORT + (i + 1) % n))"
+    done
+}
+
+# Generate a binary tree of N servers, rooted at BASE_PORT
+topology_tree() {
+    local n=$1
+    for ((i = 0; i < n; i++)); do
+        local line="$((BASE_PORT + i))"
+        if ((i > 0)); then
+            line="$line $((BASE_PORT + (i - 1) / 2))"
+        fi
+        for child in $((2 * i + 1)) $((2 * i + 2)); do
+            if ((child < n)); then
+                line="$line $((BASE_PORT + child))"
+            fi
+        done
+        echo "$line"
+    done
+}
+
+# Generate a connected random graph of N servers with about the given
+# average degree (default 3). The same seed gives the same graph.
+topology_random() {
+    awk -v n="$1" -v degree="${2:-3}" -v seed="${3:-1}" -v base="$BASE_PORT" '
+    function connect(a, b) {
+        if (a == b || (a, b) in adj) return 0
+        adj[a, b] = 1
+        adj[b, a] = 1
+        return 1
+    }
+    BEGIN {
+        srand(seed)
+        # a random spanning tree keeps the graph connected
+        edges = 0
+        for (i = 1; i < n; i++) edges += connect(i, int(rand() * i))
+        target = int(n * degree / 2)
+        for (tries = 0; edges < target && tries < 100 * n; tries++) {
+            edges += connect(int(rand() * n), int(rand() * n))
+        }
+        for (i = 0; i < n; i++) {
+            line = base + i
+            for (j = 0; j < n; j++) if ((i, j) in adj) line = line " " (base + j)
+            print line
+        }
+    }'
+}
+
+# Starts one server per topology line read from stdin. Extra server
+# arguments may be given, with %p replaced by each server's port.
+start_topology() {
+    local extra=$1
+    while read -r port neighbors; do
+        local args="localhost $port"
+        for neighbor in $neighbors; do
+            args="$args localhost $neighbor"
+        done
+        $SERVER ${extra//%p/$port} $args &
+        SERVER_PIDS+=($!)
+    done
+}
+
+stop_topology() {
+    kill "${SERVER_PIDS[@]}" 2>/dev/null
+    wait "${SERVER_PIDS[@]}" 2>/dev/null
+    SERVER_PIDS=()
+}
+
+if [[ "${BASH_SOURCE[0]}" == "$0" ]]; then
+    topology=${1:-two}
+    if ! declare -F "topology_$topology" >/dev/null; then
+        echo "unknown topology $topology" >&2
+        exit 1
+    fi
+    start_topology < <("topology_$topology" "${@:2}")
+
+    echo "Press ENTER to quit"
+    read
+    stop_topology
+fi
@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+#include "log.h"
+
+/* See uring.h for usage information */
+
+#define URING_RECV_TAG 1
+//send SQEs carry this plus their index in the batch
+#define URING_SEND_TAG 2
+#define URING_BUFFER_GROUP 0
+#define URING_MIN_BUFFERS 64
+//the largest provided buffer ring the kernel takes
+#define URING_MAX_BUFFERS 32768
+//a multishot RECVMSG buffer starts with a header and the sender's address, then the datagram
+#define URING_BUFFER_SIZE (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + NET_RECV_BUFFER)
+
+typedef struct Ring {
+    int fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; //SQEs filled but not yet published
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} Ring;
+
+//receives and sends have a ring each, so reaping a send batch never meets a datagram
+static Ring recv_ring = {-1};
+static Ring send_ring = {-1};
+static int event_fd = -1;
+static int socket_fd = -1;
+static struct msghdr recv_template;
+static int armed = 0;
+
+static struct io_uring_buf_ring *buffer_ring = NULL;
+static size_t buffer_ring_size = 0;
+static char *buffers = NULL;
+static size_t buffers_size = 0;
+static unsigned buffer_count = 0;
+static unsigned short buffer_tail = 0;
+//buffers handed out by the last uring_recv()
+static unsigned short *held = NULL;
+static int held_count = 0;
+
+static int ring_setup(Ring *ring, unsigned entries, unsigned cq_entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | (cq_entries ? IORING_SETUP_CQSIZE : 0);
+    params.cq_entries = cq_entries;
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                             fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->rings, ring->rings_size);
+        close(fd);
+        return -1;
+    }
+    char *base = (char *)ring->rings;
+    ring->sq_head = (unsigned *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(base + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    ring->fd = fd;
+    return 0;
+}
+
+static void ring_free(Ring *ring) {
+    if (ring->fd < 0) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+//an empty SQE, or NULL if the submission queue is full
+static struct io_uring_sqe *ring_sqe(Ring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local_tail & ring->sq_mask;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//publishes the filled SQEs, submits them and waits for wait completions
+static int ring_enter(Ring *ring, unsigned wait) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        unsigned pending = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int n = (int)syscall(__NR_io_uring_enter, ring->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0 || errno != EINTR) {
+            return n < 0 ? -1 : 0;
+        }
+    }
+}
+
+//SQEs the kernel did not take must not be submitted later, their msghdrs will be gone
+static void ring_cancel_pending(Ring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    for (unsigned i = head; i != ring->sq_local_tail; i++) {
+        struct io_uring_sqe *sqe = &ring->sqes[i & ring->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_NOP;
+    }
+}
+
+static void give_buffer(unsigned short bid) {
+    //the ring is an array of io_uring_buf whose first entry holds the tail; not ->bufs, which
+    //C++ places after an empty struct
+    struct io_uring_buf *buf = (struct io_uring_buf *)buffer_ring + (buffer_tail & (buffer_count - 1));
+    buf->addr = (uint64_t)(uintptr_t)(buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    buffer_tail++;
+}
+
+static int arm_recv(void) {
+    struct io_uring_sqe *sqe = ring_sqe(&recv_ring);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socket_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&recv_template;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_RECV_TAG;
+    if (ring_enter(&recv_ring, 0) < 0) {
+        ring_cancel_pending(&recv_ring);
+        return -1;
+    }
+    armed = 1;
+    return 0;
+}
+
+static void uring_free(void) {
+    ring_free(&recv_ring);
+    ring_free(&send_ring);
+    if (event_fd >= 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
+    if (buffer_ring) {
+        munmap(buffer_ring, buffer_ring_size);
+        buffer_ring = NULL;
+    }
+    if (buffers) {
+        munmap(buffers, buffers_size);
+        buffers = NULL;
+    }
+    free(held);
+    held = NULL;
+    armed = 0;
+}
+
+int uring_init(int sockfd, int batch_size) {
+    //a batch may be held while the kernel fills the next one
+    buffer_count = URING_MIN_BUFFERS;
+    while (buffer_count < 2 * (unsigned)batch_size && buffer_count < URING_MAX_BUFFERS) {
+        buffer_count *= 2;
+    }
+    socket_fd = sockfd;
+    memset(&recv_template, 0, sizeof(recv_template));
+    recv_template.msg_namelen = sizeof(struct sockaddr_in);
+
+    if (ring_setup(&send_ring, NET_MAX_BATCH, 0) < 0 ||
+        ring_setup(&recv_ring, 4, 2 * buffer_count) < 0) {
+        goto fail;
+    }
+    buffers_size = (size_t)buffer_count * URING_BUFFER_SIZE;
+    buffers = (char *)mmap(NULL, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffer_ring_size = (size_t)buffer_count * sizeof(struct io_uring_buf);
+    buffer_ring = (struct io_uring_buf_ring *)mmap(NULL, buffer_ring_size, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    held = (unsigned short *)malloc(NET_MAX_BATCH * sizeof(unsigned short));
+    if (buffers == MAP_FAILED || buffer_ring == MAP_FAILED || !held) {
+        if (buffers == MAP_FAILED) buffers = NULL;
+        if (buffer_ring == MAP_FAILED) buffer_ring = NULL;
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buffer_ring;
+    reg.ring_entries = buffer_count;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, recv_ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        goto fail;
+    }
+    buffer_tail = 0;
+    for (unsigned i = 0; i < buffer_count; i++) {
+        give_buffer((unsigned short)i);
+    }
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || syscall(__NR_io_uring_register, recv_ring.fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+        goto fail;
+    }
+    if (arm_recv() < 0) {
+        goto fail;
+    }
+    //a kernel without multishot RECVMSG fails the request as soon as it is submitted
+    if (*recv_ring.cq_head != __atomic_load_n(recv_ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &recv_ring.cqes[*recv_ring.cq_head & recv_ring.cq_mask];
+        if (cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE)) {
+            errno = -cqe->res;
+            goto fail;
+        }
+    }
+    held_count = 0;
+    return 0;
+
+fail: {
+        int err = errno;
+        uring_free();
+        errno = err;
+        return -1;
+    }
+}
+
+int uring_event_fd(void) {
+    return event_fd;
+}
+
+int uring_recv(NetPacket *packets, int max, NetStats *stats) {
+    //clear the wakeup before looking, so anything posted from here on wakes the loop again
+    uint64_t wakeups;
+    stats->recv_calls++;
+    if (read(event_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        log_error("io_uring eventfd read failed: %s", strerror(errno));
+    }
+
+    //the previous batch has been dispatched and flushed, its buffers can be filled again
+    for (int i = 0; i < held_count; i++) {
+        give_buffer(held[i]);
+    }
+    if (held_count) {
+        __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+    }
+    held_count = 0;
+    if (!armed) {
+        stats->recv_calls++;
+        if (arm_recv() < 0) {
+            return -1;
+        }
+    }
+
+    int n = 0;
+    int ended = 0;
+    unsigned head = *recv_ring.cq_head;
+    unsigned tail = __atomic_load_n(recv_ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max) {
+        struct io_uring_cqe *cqe = &recv_ring.cqes[head & recv_ring.cq_mask];
+        head++;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            //out of buffers or failed, posted again on the next call
+            armed = 0;
+            ended = 1;
+        }
+        if (cqe->res < 0) {
+            if (cqe->res != -ENOBUFS) {
+                log_error("io_uring receive failed: %s", strerror(-cqe->res));
+            }
+            continue;
+        }
+        if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        char *buffer = buffers + (size_t)bid * URING_BUFFER_SIZE;
+        held[held_count++] = bid;
+
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+        //the address area has the template's size whatever the sender's address length
+        char *name = buffer + sizeof(*out);
+        NetPacket *packet = &packets[n++];
+        socklen_t name_len = out->namelen < sizeof(packet->addr) ? out->namelen : sizeof(packet->addr);
+        memset(&packet->addr, 0, sizeof(packet->addr));
+        memcpy(&packet->addr, name, name_len);
+        packet->addr_len = name_len;
+        packet->len = out->payloadlen < NET_RECV_BUFFER ? (int)out->payloadlen : NET_RECV_BUFFER;
+        packet->data = name + recv_template.msg_namelen + recv_template.msg_controllen;
+    }
+    __atomic_store_n(recv_ring.cq_head, head, __ATOMIC_RELEASE);
+
+    //the eventfd was read already, so a full batch or a receive to post again needs another wakeup
+    if (ended || head != __atomic_load_n(recv_ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) {
+            log_error("io_uring eventfd write failed: %s", strerror(errno));
+        }
+    }
+    return n;
+}
+
+int uring_rx_fill(void) {
+    unsigned waiting = __atomic_load_n(recv_ring.cq_tail, __ATOMIC_ACQUIRE) - *recv_ring.cq_head;
+    return (int)((uint64_t)(held_count + waiting) * 100 / buffer_count);
+}
+
+int uring_sendmmsg(int sockfd, struct mmsghdr *msgs, int count) {
+    //linked, so a failure cancels everything after it and what went out is a prefix, as with sendmmsg()
+    unsigned batch = 0;
+    struct io_uring_sqe *sqe = NULL;
+    while ((int)batch < count && (sqe = ring_sqe(&send_ring)) != NULL) {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t)(uintptr_t)&msgs[batch].msg_hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = URING_SEND_TAG + batch;
+        batch++;
+    }
+    if (!batch) {
+        errno = EBUSY;
+        return -1;
+    }
+    sqe->flags = 0;
+    if (ring_enter(&send_ring, batch) < 0) {
+        int err = errno;
+        ring_cancel_pending(&send_ring);
+        errno = err;
+        return -1;
+    }
+
+    int sent = 0;
+    int error = 0;
+    unsigned head = *send_ring.cq_head;
+    unsigned tail = __atomic_load_n(send_ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &send_ring.cqes[head & send_ring.cq_mask];
+        if (cqe->user_data < URING_SEND_TAG || cqe->user_data >= URING_SEND_TAG + batch) {
+            continue;
+        }
+        if (cqe->res >= 0) {
+            msgs[cqe->user_data - URING_SEND_TAG].msg_len = (unsigned)cqe->res;
+            sent++;
+        } else if (cqe->res != -ECANCELED) {
+            error = -cqe->res;
+        }
+    }
+    __atomic_store_n(send_ring.cq_head, head, __ATOMIC_RELEASE);
+    if (!sent && error) {
+        errno = error;
+        return -1;
+    }
+    return sent;
+}
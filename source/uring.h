@@ -0,0 +1,47 @@
+#ifndef URING_H
+#define URING_H
+
+#include "netio.h"
+
+/* io_uring backend for netio, selected with net_use_uring().  It talks
+ * to the kernel with the raw syscalls, so it needs no liburing.
+ *
+ * Receiving: one multishot RECVMSG stays posted on the server socket and
+ * takes its buffers from a provided buffer ring, so datagrams land in
+ * memory without a syscall per batch.  The ring's eventfd is what the
+ * event loop polls instead of the socket.  Buffers handed out by one
+ * uring_recv() go back to the kernel at the start of the next call,
+ * which gives them the same lifetime as the recvmmsg batch.
+ *
+ * Sending: a flush becomes one SENDMSG SQE per queued datagram, pointing
+ * at netio's msghdrs, linked in order and submitted and reaped with a
+ * single io_uring_enter().  Sends use MSG_DONTWAIT, and a failure
+ * cancels the rest of the chain, so a full socket buffer ends the batch
+ * the way it ends a sendmmsg().
+ *
+ * Needs Linux 6.0 (multishot RECVMSG, provided buffer rings).
+ * uring_init() fails on anything older, and netio stays on recvmmsg.
+ */
+
+/* Sets up the rings for sockfd.  Returns -1 with errno set, leaving
+ * nothing behind. */
+int uring_init(int sockfd, int batch_size);
+
+/* Readable when datagrams are waiting. */
+int uring_event_fd(void);
+
+/* Fills up to max packets.  Returns the number filled, or -1 if the
+ * receive could not be posted again. */
+int uring_recv(NetPacket *packets, int max, NetStats *stats);
+
+/* Percent of the provided buffers in use: the batch uring_recv() handed
+ * out last and the datagrams completed behind it.  At 100 the kernel has
+ * nowhere to put the next one and the socket buffer starts to fill. */
+int uring_rx_fill(void);
+
+/* sendmmsg() on the ring: sends datagrams from msgs in order until one
+ * fails.  Returns how many went out, or -1 with errno set if the first
+ * one failed. */
+int uring_sendmmsg(int sockfd, struct mmsghdr *msgs, int count);
+
+#endif
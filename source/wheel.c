@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "wheel.h"
+#include "event.h"
+
+/* See wheel.h for usage information */
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_LEVELS * WHEEL_BITS))
+#define WHEEL_IDLE UINT64_MAX
+
+static WheelLink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+//bit s of occupied[l] is set while slots[l][s] is not empty
+static uint64_t occupied[WHEEL_LEVELS];
+//the next tick to run; every tick before it has been run
+static uint64_t next_tick = 0;
+static long tick_ms = WHEEL_DEFAULT_TICK_MS;
+static uint64_t start_ms = 0;
+static int timer_fd = -1;
+//tick the timerfd is armed for, WHEEL_IDLE if it is not armed
+static uint64_t armed_tick = WHEEL_IDLE;
+static int advancing = 0;
+static void (*after_run)(void) = NULL;
+static WheelStats stats;
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static uint64_t current_tick(void) {
+    return (monotonic_ms() - start_ms) / tick_ms;
+}
+
+static void list_init(WheelLink *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_unlink(WheelLink *link) {
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->next = NULL;
+    link->prev = NULL;
+}
+
+static void list_append(WheelLink *head, WheelLink *link) {
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+//moves every entry of from onto the empty list to
+static void list_take(WheelLink *from, WheelLink *to) {
+    if (from->next == from) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+static void place(WheelTimer *timer) {
+    if (timer->expires < next_tick) {
+        timer->expires = next_tick;
+    }
+    uint64_t delta = timer->expires - next_tick;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        timer->expires = next_tick + delta;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << ((level + 1) * WHEEL_BITS))) {
+        level++;
+    }
+    int slot = (int)((timer->expires >> (level * WHEEL_BITS)) & WHEEL_MASK);
+    timer->level = level;
+    timer->slot = slot;
+    list_append(&slots[level][slot], &timer->link);
+    occupied[level] |= 1ULL << slot;
+}
+
+static void unplace(WheelTimer *timer) {
+    list_unlink(&timer->link);
+    if (timer->level >= 0) {
+        WheelLink *head = &slots[timer->level][timer->slot];
+        if (head->next == head) {
+            occupied[timer->level] &= ~(1ULL << timer->slot);
+        }
+    }
+}
+
+//offset of the first set bit at or after bit from, wrapping around, or -1
+static int first_from(uint64_t bits, int from) {
+    if (!bits) {
+        return -1;
+    }
+    uint64_t rotated = from ? (bits >> from) | (bits << (WHEEL_SLOTS - from)) : bits;
+    return __builtin_ctzll(rotated);
+}
+
+//earliest tick with a due slot or a cascade to do, WHEEL_IDLE if none
+static uint64_t next_work(void) {
+    uint64_t best = WHEEL_IDLE;
+    int offset = first_from(occupied[0], (int)(next_tick & WHEEL_MASK));
+    if (offset >= 0) {
+        best = next_tick + offset;
+    }
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (!occupied[level]) {
+            continue;
+        }
+        //a slot on this level cascades on the tick where every lower index is 0
+        uint64_t unit = (uint64_t)1 << (level * WHEEL_BITS);
+        uint64_t boundary = (next_tick + unit - 1) & ~(unit - 1);
+        int index = (int)((boundary >> (level * WHEEL_BITS)) & WHEEL_MASK);
+        uint64_t due = boundary + (uint64_t)first_from(occupied[level], index) * unit;
+        if (due < best) {
+            best = due;
+        }
+    }
+    return best;
+}
+
+//a timer that fires early finds nothing due and re-arms, so only moving it earlier matters
+static void rearm(int only_earlier) {
+    if (timer_fd < 0 || advancing) {
+        return;
+    }
+    uint64_t due = next_work();
+    if (due == armed_tick || (only_earlier && due > armed_tick)) {
+        return;
+    }
+    armed_tick = due;
+    if (due == WHEEL_IDLE) {
+        event_arm_timer(timer_fd, 0, 0);
+        return;
+    }
+    uint64_t due_ms = start_ms + due * tick_ms;
+    uint64_t now = monotonic_ms();
+    //0 would disarm, so an overdue tick fires after 1ms
+    event_arm_timer(timer_fd, due_ms > now ? (long)(due_ms - now) : 1, 0);
+}
+
+static void cascade(int level, int slot) {
+    WheelLink moving;
+    list_take(&slots[level][slot], &moving);
+    occupied[level] &= ~(1ULL << slot);
+    while (moving.next != &moving) {
+        WheelTimer *timer = (WheelTimer *)moving.next;
+        list_unlink(&timer->link);
+        place(timer);
+        stats.cascaded++;
+    }
+}
+
+void wheel_advance(void) {
+    uint64_t now = current_tick();
+    advancing = 1;
+    while (next_tick <= now) {
+        int index = (int)(next_tick & WHEEL_MASK);
+        if (index == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; level++) {
+                int slot = (int)((next_tick >> (level * WHEEL_BITS)) & WHEEL_MASK);
+                cascade(level, slot);
+                if (slot != 0) {
+                    break;
+                }
+            }
+        }
+        //callbacks may schedule into this slot again, run a detached copy
+        WheelLink due;
+        list_take(&slots[0][index], &due);
+        occupied[0] &= ~(1ULL << index);
+        next_tick++;
+        while (due.next != &due) {
+            WheelTimer *timer = (WheelTimer *)due.next;
+            timer->level = -1;
+            list_unlink(&timer->link);
+            stats.pending--;
+            stats.fired++;
+            timer->callback(timer, timer->arg);
+        }
+    }
+    advancing = 0;
+}
+
+static void wheel_wakeup(int fd, uint32_t expirations, void *arg) {
+    stats.wakeups++;
+    armed_tick = WHEEL_IDLE;
+    wheel_advance();
+    rearm(0);
+    if (after_run) {
+        after_run();
+    }
+}
+
+int wheel_init(long tick, void (*run_hook)(void)) {
+    if (tick <= 0) {
+        return -1;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            list_init(&slots[level][slot]);
+        }
+        occupied[level] = 0;
+    }
+    memset(&stats, 0, sizeof(stats));
+    tick_ms = tick;
+    start_ms = monotonic_ms();
+    next_tick = 0;
+    after_run = run_hook;
+    armed_tick = WHEEL_IDLE;
+    timer_fd = event_add_timer(0, 0, wheel_wakeup, NULL);
+    return timer_fd < 0 ? -1 : 0;
+}
+
+void wheel_timer_init(WheelTimer *timer, wheel_callback callback, void *arg) {
+    timer->link.next = NULL;
+    timer->link.prev = NULL;
+    timer->expires = 0;
+    timer->level = -1;
+    timer->slot = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+int wheel_pending(const WheelTimer *timer) {
+    return timer->link.next != NULL;
+}
+
+void wheel_schedule(WheelTimer *timer, long delay_ms) {
+    if (wheel_pending(timer)) {
+        unplace(timer);
+    } else {
+        stats.pending++;
+    }
+    stats.scheduled++;
+    uint64_t now = current_tick();
+    if (stats.pending == 1 && !advancing) {
+        //the wheel was empty, skip the idle ticks instead of running them later
+        next_tick = now;
+    }
+    uint64_t ticks = delay_ms > 0 ? ((uint64_t)delay_ms + tick_ms - 1) / tick_ms : 0;
+    timer->expires = now + ticks;
+    place(timer);
+    rearm(1);
+}
+
+void wheel_cancel(WheelTimer *timer) {
+    if (!wheel_pending(timer)) {
+        return;
+    }
+    unplace(timer);
+    timer->level = -1;
+    stats.pending--;
+    stats.cancelled++;
+}
+
+void wheel_get_stats(WheelStats *out) {
+    *out = stats;
+}
@@ -0,0 +1,73 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Hierarchical timer wheel for soft-state timers: subscription renewals
+ * and expiries, and anything else that needs a lot of long, often
+ * rescheduled timeouts (per-user idle timeouts, for example).
+ *
+ * There are four levels of 64 slots.  Level 0 holds timers due within
+ * 64 ticks, with one slot per tick.  Each higher level holds timers 64
+ * times further out, and its slots are cascaded down one level when the
+ * lower level wraps.  Scheduling, rescheduling and cancelling are O(1).
+ * A tick only touches the timers that are due, plus, once every 64
+ * ticks, the timers in one slot of the next level.  Delays longer than
+ * the wheel's span (2^24 ticks) are clamped to it.
+ *
+ * Timers are embedded in the caller's own structures, so the wheel
+ * never allocates.  The wheel is driven by one timerfd on the event
+ * loop.  It is armed for the next tick that has work (a due slot or a
+ * cascade), so an idle wheel does not wake the server.
+ */
+
+#define WHEEL_DEFAULT_TICK_MS 100
+
+typedef struct WheelLink {
+    struct WheelLink *next;
+    struct WheelLink *prev;
+} WheelLink;
+
+struct WheelTimer;
+typedef void (*wheel_callback)(struct WheelTimer *timer, void *arg);
+
+typedef struct WheelTimer {
+    WheelLink link;     /* must stay first */
+    uint64_t expires;   /* absolute tick */
+    int level;
+    int slot;
+    wheel_callback callback;
+    void *arg;
+} WheelTimer;
+
+typedef struct WheelStats {
+    size_t pending;
+    uint64_t scheduled;
+    uint64_t fired;
+    uint64_t cancelled;
+    uint64_t cascaded;  /* timers moved down a level */
+    uint64_t wakeups;
+} WheelStats;
+
+/* Registers the wheel's timerfd with the event loop, so call it after
+ * event_init().  after_run, if not NULL, is called once after each
+ * batch of due timers, e.g. to flush the packets they queued.  Returns
+ * -1 on error. */
+int wheel_init(long tick_ms, void (*after_run)(void));
+
+void wheel_timer_init(WheelTimer *timer, wheel_callback callback, void *arg);
+/* Runs the timer's callback after delay_ms, rounded up to whole ticks.
+ * A pending timer is moved.  The timer is no longer pending when its
+ * callback runs, so the callback may reschedule it or free it. */
+void wheel_schedule(WheelTimer *timer, long delay_ms);
+/* Does nothing if the timer is not pending. */
+void wheel_cancel(WheelTimer *timer);
+int wheel_pending(const WheelTimer *timer);
+
+/* Runs every timer that is due.  The event loop calls this itself. */
+void wheel_advance(void);
+
+void wheel_get_stats(WheelStats *stats);
+
+#endif
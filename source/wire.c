@@ -0,0 +1,655 @@
+#include <stdlib.h>
+#include <string.h>
+#include "wire.h"
+
+/* See wire.h for usage information */
+
+#define NAME_MAX_LEN (CHANNEL_MAX - 1)
+
+//bounds-checked reader over one datagram
+typedef struct Reader {
+    const unsigned char *p;
+    const unsigned char *end;
+    int bad;
+} Reader;
+
+static unsigned read_u8(Reader *r) {
+    if (r->p + 1 > r->end) {
+        r->bad = 1;
+        return 0;
+    }
+    return *r->p++;
+}
+
+static unsigned read_u16(Reader *r) {
+    unsigned high = read_u8(r);
+    return (high << 8) | read_u8(r);
+}
+
+static uint64_t read_u64(Reader *r) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | read_u8(r);
+    }
+    return value;
+}
+
+static void read_name(Reader *r, char name[CHANNEL_MAX]) {
+    unsigned len = read_u8(r);
+    if (len > NAME_MAX_LEN || r->p + len > r->end) {
+        r->bad = 1;
+        name[0] = '\0';
+        return;
+    }
+    memcpy(name, r->p, len);
+    name[len] = '\0';
+    r->p += len;
+}
+
+static void read_text(Reader *r, WireMessage *msg) {
+    unsigned len = read_u16(r);
+    if (len > WIRE_TEXT_MAX || r->p + len > r->end) {
+        r->bad = 1;
+        return;
+    }
+    msg->text = (const char *)r->p;
+    msg->text_len = len;
+    r->p += len;
+}
+
+static void read_entries(Reader *r, WireMessage *msg) {
+    unsigned count = read_u16(r);
+    msg->count = count & ~WIRE_LIST_MORE;
+    msg->more = (count & WIRE_LIST_MORE) != 0;
+    msg->entries = (const char *)r->p;
+    msg->entries_len = r->end - r->p;
+    r->p = r->end;
+}
+
+//v1 names may fill their field without a terminator
+static void copy_name(char name[CHANNEL_MAX], const char *field) {
+    memcpy(name, field, NAME_MAX_LEN);
+    name[NAME_MAX_LEN] = '\0';
+}
+
+static int decode_v1_request(const char *buf, size_t len, WireMessage *msg) {
+    switch (msg->type) {
+        case REQ_LOGIN:
+            if (len < sizeof(struct request_login)) return -1;
+            copy_name(msg->username, ((const struct request_login *)buf)->req_username);
+            return 0;
+        case REQ_LOGOUT:
+        case REQ_LIST:
+        case REQ_KEEP_ALIVE:
+            return 0;
+        case REQ_JOIN:
+        case REQ_LEAVE:
+        case REQ_WHO:
+        case S2S_JOIN:
+        case S2S_LEAVE:
+            if (len < sizeof(struct request_join)) return -1;
+            copy_name(msg->channel, ((const struct request_join *)buf)->req_channel);
+            return 0;
+        case REQ_SAY: {
+            if (len < sizeof(struct request_say)) return -1;
+            const struct request_say *say = (const struct request_say *)buf;
+            copy_name(msg->channel, say->req_channel);
+            msg->text = say->req_text;
+            msg->text_len = strnlen(say->req_text, SAY_MAX);
+            return 0;
+        }
+        case S2S_SAY: {
+            if (len < sizeof(struct s2s_say)) return -1;
+            const struct s2s_say *say = (const struct s2s_say *)buf;
+            msg->id = say->id;
+            copy_name(msg->channel, say->txt_channel);
+            copy_name(msg->username, say->txt_username);
+            msg->text = say->txt_text;
+            msg->text_len = strnlen(say->txt_text, SAY_MAX);
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+static int decode_v1_text(const char *buf, size_t len, WireMessage *msg) {
+    msg->type |= WIRE_TEXT;
+    switch (msg->type) {
+        case WIRE_TEXT | TXT_SAY: {
+            if (len < sizeof(struct text_say)) return -1;
+            const struct text_say *say = (const struct text_say *)buf;
+            copy_name(msg->channel, say->txt_channel);
+            copy_name(msg->username, say->txt_username);
+            msg->text = say->txt_text;
+            msg->text_len = strnlen(say->txt_text, SAY_MAX);
+            return 0;
+        }
+        case WIRE_TEXT | TXT_LIST: {
+            if (len < sizeof(struct text_list)) return -1;
+            const struct text_list *list = (const struct text_list *)buf;
+            msg->count = list->txt_nchannels;
+            msg->entries = (const char *)list->txt_channels;
+            msg->entries_len = len - sizeof(struct text_list);
+            return 0;
+        }
+        case WIRE_TEXT | TXT_WHO: {
+            if (len < sizeof(struct text_who)) return -1;
+            const struct text_who *who = (const struct text_who *)buf;
+            copy_name(msg->channel, who->txt_channel);
+            msg->count = who->txt_nusernames;
+            msg->entries = (const char *)who->txt_users;
+            msg->entries_len = len - sizeof(struct text_who);
+            return 0;
+        }
+        case WIRE_TEXT | TXT_ERROR: {
+            if (len < sizeof(struct text_error)) return -1;
+            const struct text_error *error = (const struct text_error *)buf;
+            msg->text = error->txt_error;
+            msg->text_len = strnlen(error->txt_error, SAY_MAX);
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+static int decode_v2(const unsigned char *buf, size_t len, WireMessage *msg) {
+    Reader r = {buf + WIRE_V2_HEADER, buf + len, 0};
+    msg->type = buf[1];
+    switch (msg->type) {
+        case REQ_LOGIN:
+            read_name(&r, msg->username);
+            break;
+        case REQ_LOGOUT:
+        case REQ_LIST:
+        case REQ_KEEP_ALIVE:
+            break;
+        case REQ_JOIN:
+        case REQ_LEAVE:
+        case REQ_WHO:
+        case S2S_JOIN:
+        case S2S_LEAVE:
+            read_name(&r, msg->channel);
+            break;
+        case REQ_SAY:
+            read_name(&r, msg->channel);
+            read_text(&r, msg);
+            break;
+        case S2S_SAY:
+            msg->id = read_u64(&r);
+            read_name(&r, msg->channel);
+            read_name(&r, msg->username);
+            read_text(&r, msg);
+            break;
+        case WIRE_HELLO:
+            msg->hello_version = read_u8(&r);
+            msg->hello_flags = read_u8(&r);
+            break;
+        case WIRE_TREE:
+            msg->id = read_u64(&r);
+            msg->tree_flags = read_u8(&r);
+            read_name(&r, msg->channel);
+            break;
+        case WIRE_BUNDLE:
+            msg->entries = (const char *)r.p;
+            msg->entries_len = r.end - r.p;
+            r.p = r.end;
+            break;
+        case WIRE_REACH:
+            msg->entries = (const char *)r.p;
+            msg->entries_len = r.end - r.p;
+            msg->count = (int)(msg->entries_len / WIRE_REACH_ENTRY);
+            if (msg->entries_len % WIRE_REACH_ENTRY) {
+                r.bad = 1;
+            }
+            r.p = r.end;
+            break;
+        case WIRE_TEXT | TXT_SAY:
+            read_name(&r, msg->channel);
+            read_name(&r, msg->username);
+            read_text(&r, msg);
+            break;
+        case WIRE_TEXT | TXT_LIST:
+            read_entries(&r, msg);
+            break;
+        case WIRE_TEXT | TXT_WHO:
+            read_name(&r, msg->channel);
+            read_entries(&r, msg);
+            break;
+        case WIRE_TEXT | TXT_ERROR:
+            read_text(&r, msg);
+            break;
+        default:
+            return -1;
+    }
+    //servers forward the tail of a datagram as is, so nothing may follow the last field
+    return r.bad || r.p != r.end ? -1 : 0;
+}
+
+void wire_message(WireMessage *msg, int type) {
+    memset(msg, 0, sizeof(*msg));
+    msg->type = type;
+    msg->text = "";
+}
+
+int wire_decode(const void *buf, size_t len, int from_server, WireMessage *msg) {
+    const unsigned char *bytes = (const unsigned char *)buf;
+    if (len >= WIRE_V2_HEADER && bytes[0] == WIRE_MAGIC) {
+        wire_message(msg, 0);
+        msg->version = WIRE_V2;
+        return decode_v2(bytes, len, msg);
+    }
+    if (len < sizeof(request_t)) {
+        return -1;
+    }
+    wire_message(msg, ((const struct request *)buf)->req_type);
+    msg->version = WIRE_V1;
+    return from_server ? decode_v1_text((const char *)buf, len, msg)
+                       : decode_v1_request((const char *)buf, len, msg);
+}
+
+int wire_peek_type(const void *buf, size_t len) {
+    const unsigned char *bytes = (const unsigned char *)buf;
+    if (len >= WIRE_V2_HEADER && bytes[0] == WIRE_MAGIC) {
+        return bytes[1];
+    }
+    if (len < sizeof(request_t)) {
+        return -1;
+    }
+    return ((const struct request *)buf)->req_type;
+}
+
+int wire_next_entry(const WireMessage *msg, size_t *offset, char name[CHANNEL_MAX]) {
+    if (msg->version == WIRE_V1) {
+        //v1 entries are fixed CHANNEL_MAX (== USERNAME_MAX) fields
+        if (*offset / CHANNEL_MAX >= (size_t)msg->count || *offset + CHANNEL_MAX > msg->entries_len) {
+            return -1;
+        }
+        copy_name(name, msg->entries + *offset);
+        *offset += CHANNEL_MAX;
+        return 0;
+    }
+    Reader r = {(const unsigned char *)msg->entries + *offset,
+                (const unsigned char *)msg->entries + msg->entries_len, 0};
+    if (r.p >= r.end) {
+        return -1;
+    }
+    read_name(&r, name);
+    if (r.bad) {
+        return -1;
+    }
+    *offset = (const char *)r.p - msg->entries;
+    return 0;
+}
+
+int wire_next_bundled(const WireMessage *msg, size_t *offset, const char **data, size_t *len) {
+    Reader r = {(const unsigned char *)msg->entries + *offset,
+                (const unsigned char *)msg->entries + msg->entries_len, 0};
+    if (r.p >= r.end) {
+        return -1;
+    }
+    size_t entry_len = read_u16(&r);
+    if (r.bad || entry_len == 0 || r.p + entry_len > r.end) {
+        return -1;
+    }
+    *data = (const char *)r.p;
+    *len = entry_len;
+    *offset = (const char *)r.p + entry_len - msg->entries;
+    return 0;
+}
+
+int wire_next_reach(const WireMessage *msg, size_t *offset, struct sockaddr_in *server, int *hops) {
+    if (*offset / WIRE_REACH_ENTRY >= (size_t)msg->count) {
+        return -1;
+    }
+    //address and port are copied as they are, both already in network byte order
+    const char *entry = msg->entries + *offset;
+    memset(server, 0, sizeof(*server));
+    server->sin_family = AF_INET;
+    memcpy(&server->sin_addr.s_addr, entry, 4);
+    memcpy(&server->sin_port, entry + 4, 2);
+    *hops = (unsigned char)entry[6];
+    *offset += WIRE_REACH_ENTRY;
+    return 0;
+}
+
+//bounds-checked writer, ok stays 0 once anything did not fit
+typedef struct Writer {
+    unsigned char *p;
+    unsigned char *end;
+    int ok;
+} Writer;
+
+static void put_u8(Writer *w, unsigned value) {
+    if (w->p + 1 > w->end) {
+        w->ok = 0;
+        return;
+    }
+    *w->p++ = (unsigned char)value;
+}
+
+static void put_u16(Writer *w, unsigned value) {
+    put_u8(w, value >> 8);
+    put_u8(w, value & 0xff);
+}
+
+static void put_u64(Writer *w, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        put_u8(w, (unsigned)(value >> shift) & 0xff);
+    }
+}
+
+static void put_bytes(Writer *w, const void *data, size_t len) {
+    if (w->p + len > w->end) {
+        w->ok = 0;
+        return;
+    }
+    memcpy(w->p, data, len);
+    w->p += len;
+}
+
+static void put_name(Writer *w, const char *name) {
+    size_t len = strnlen(name, NAME_MAX_LEN);
+    put_u8(w, (unsigned)len);
+    put_bytes(w, name, len);
+}
+
+static void put_text(Writer *w, const char *text, size_t len) {
+    if (len > WIRE_TEXT_MAX) {
+        len = WIRE_TEXT_MAX;
+    }
+    put_u16(w, (unsigned)len);
+    put_bytes(w, text, len);
+}
+
+static size_t encode_v2(const WireMessage *msg, void *buf, size_t size) {
+    Writer w = {(unsigned char *)buf, (unsigned char *)buf + size, 1};
+    put_u8(&w, WIRE_MAGIC);
+    put_u8(&w, (unsigned)msg->type);
+    switch (msg->type) {
+        case REQ_LOGIN:
+            put_name(&w, msg->username);
+            break;
+        case REQ_LOGOUT:
+        case REQ_LIST:
+        case REQ_KEEP_ALIVE:
+            break;
+        case REQ_JOIN:
+        case REQ_LEAVE:
+        case REQ_WHO:
+        case S2S_JOIN:
+        case S2S_LEAVE:
+            put_name(&w, msg->channel);
+            break;
+        case REQ_SAY:
+            put_name(&w, msg->channel);
+            put_text(&w, msg->text, msg->text_len);
+            break;
+        case S2S_SAY:
+            put_u64(&w, msg->id);
+            //fall through, the rest is a TXT_SAY
+        case WIRE_TEXT | TXT_SAY:
+            put_name(&w, msg->channel);
+            put_name(&w, msg->username);
+            put_text(&w, msg->text, msg->text_len);
+            break;
+        case WIRE_HELLO:
+            put_u8(&w, (unsigned)msg->hello_version);
+            put_u8(&w, (unsigned)msg->hello_flags);
+            break;
+        case WIRE_TREE:
+            put_u64(&w, msg->id);
+            put_u8(&w, (unsigned)msg->tree_flags);
+            put_name(&w, msg->channel);
+            break;
+        case WIRE_TEXT | TXT_ERROR:
+            put_text(&w, msg->text, msg->text_len);
+            break;
+        default:
+            return 0;
+    }
+    return w.ok ? (size_t)(w.p - (unsigned char *)buf) : 0;
+}
+
+//v1 fields are zero padded; text is cut so it stays terminated
+static void fill_field(char *field, size_t field_size, const char *data, size_t len) {
+    if (len > field_size - 1) {
+        len = field_size - 1;
+    }
+    memcpy(field, data, len);
+    memset(field + len, 0, field_size - len);
+}
+
+static size_t encode_v1(const WireMessage *msg, void *buf, size_t size) {
+    size_t len;
+    switch (msg->type) {
+        case REQ_LOGIN: len = sizeof(struct request_login); break;
+        case REQ_LOGOUT:
+        case REQ_LIST:
+        case REQ_KEEP_ALIVE: len = sizeof(struct request); break;
+        case REQ_JOIN:
+        case REQ_LEAVE:
+        case REQ_WHO:
+        case S2S_JOIN:
+        case S2S_LEAVE: len = sizeof(struct request_join); break;
+        case REQ_SAY: len = sizeof(struct request_say); break;
+        case S2S_SAY: len = sizeof(struct s2s_say); break;
+        case WIRE_TEXT | TXT_SAY: len = sizeof(struct text_say); break;
+        case WIRE_TEXT | TXT_ERROR: len = sizeof(struct text_error); break;
+        default: return 0;
+    }
+    if (len > size) {
+        return 0;
+    }
+    char *out = (char *)buf;
+    switch (msg->type) {
+        case REQ_LOGIN: {
+            struct request_login *login = (struct request_login *)out;
+            login->req_type = REQ_LOGIN;
+            fill_field(login->req_username, USERNAME_MAX, msg->username, strnlen(msg->username, USERNAME_MAX));
+            break;
+        }
+        case REQ_SAY: {
+            struct request_say *say = (struct request_say *)out;
+            say->req_type = REQ_SAY;
+            fill_field(say->req_channel, CHANNEL_MAX, msg->channel, strnlen(msg->channel, CHANNEL_MAX));
+            fill_field(say->req_text, SAY_MAX, msg->text, msg->text_len);
+            break;
+        }
+        case S2S_SAY: {
+            struct s2s_say *say = (struct s2s_say *)out;
+            say->req_type = S2S_SAY;
+            say->id = msg->id;
+            fill_field(say->txt_channel, CHANNEL_MAX, msg->channel, strnlen(msg->channel, CHANNEL_MAX));
+            fill_field(say->txt_username, USERNAME_MAX, msg->username, strnlen(msg->username, USERNAME_MAX));
+            fill_field(say->txt_text, SAY_MAX, msg->text, msg->text_len);
+            break;
+        }
+        case WIRE_TEXT | TXT_SAY: {
+            struct text_say *say = (struct text_say *)out;
+            say->txt_type = TXT_SAY;
+            fill_field(say->txt_channel, CHANNEL_MAX, msg->channel, strnlen(msg->channel, CHANNEL_MAX));
+            fill_field(say->txt_username, USERNAME_MAX, msg->username, strnlen(msg->username, USERNAME_MAX));
+            fill_field(say->txt_text, SAY_MAX, msg->text, msg->text_len);
+            break;
+        }
+        case WIRE_TEXT | TXT_ERROR: {
+            struct text_error *error = (struct text_error *)out;
+            error->txt_type = TXT_ERROR;
+            fill_field(error->txt_error, SAY_MAX, msg->text, msg->text_len);
+            break;
+        }
+        case REQ_LOGOUT:
+        case REQ_LIST:
+        case REQ_KEEP_ALIVE:
+            ((struct request *)out)->req_type = msg->type;
+            break;
+        default: {
+            struct request_join *join = (struct request_join *)out;
+            join->req_type = msg->type;
+            fill_field(join->req_channel, CHANNEL_MAX, msg->channel, strnlen(msg->channel, CHANNEL_MAX));
+            break;
+        }
+    }
+    return len;
+}
+
+size_t wire_encode(int version, const WireMessage *msg, void *buf, size_t size) {
+    return version == WIRE_V2 ? encode_v2(msg, buf, size) : encode_v1(msg, buf, size);
+}
+
+static int pages_reserve(WirePages *pages, size_t len) {
+    if (pages->len + len <= pages->capacity) {
+        return 0;
+    }
+    size_t capacity = pages->capacity ? pages->capacity * 2 : WIRE_PAGE_MAX;
+    while (capacity < pages->len + len) {
+        capacity *= 2;
+    }
+    char *data = (char *)realloc(pages->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    pages->data = data;
+    pages->capacity = capacity;
+    return 0;
+}
+
+static int page_begin(WirePages *pages) {
+    if (pages_reserve(pages, WIRE_PAGE_MAX) < 0) {
+        pages->bad = 1;
+        return -1;
+    }
+    char *buf = pages->data + pages->len;
+    pages->page_start = pages->len;
+    pages->entries = 0;
+    if (pages->version == WIRE_V2) {
+        Writer w = {(unsigned char *)buf, (unsigned char *)buf + WIRE_PAGE_MAX, 1};
+        put_u8(&w, WIRE_MAGIC);
+        put_u8(&w, (unsigned)pages->type);
+        if (pages->type == (WIRE_TEXT | TXT_WHO)) {
+            put_name(&w, pages->channel);
+        }
+        pages->count_at = pages->len + (w.p - (unsigned char *)buf);
+        pages->len = pages->count_at + 2;
+    } else if (pages->type == (WIRE_TEXT | TXT_WHO)) {
+        struct text_who *who = (struct text_who *)buf;
+        who->txt_type = TXT_WHO;
+        fill_field(who->txt_channel, CHANNEL_MAX, pages->channel, strnlen(pages->channel, CHANNEL_MAX));
+        pages->count_at = pages->len + offsetof(struct text_who, txt_nusernames);
+        pages->len += sizeof(struct text_who);
+    } else {
+        struct text_list *channels = (struct text_list *)buf;
+        channels->txt_type = TXT_LIST;
+        pages->count_at = pages->len + offsetof(struct text_list, txt_nchannels);
+        pages->len += sizeof(struct text_list);
+    }
+    return 0;
+}
+
+static int page_end(WirePages *pages, int more) {
+    if (pages->count == pages->ends_capacity) {
+        int capacity = pages->ends_capacity ? pages->ends_capacity * 2 : 4;
+        size_t *ends = (size_t *)realloc(pages->ends, capacity * sizeof(size_t));
+        if (!ends) {
+            pages->bad = 1;
+            return -1;
+        }
+        pages->ends = ends;
+        pages->ends_capacity = capacity;
+    }
+    char *count = pages->data + pages->count_at;
+    if (pages->version == WIRE_V2) {
+        unsigned value = pages->entries | (more ? WIRE_LIST_MORE : 0);
+        count[0] = (char)(value >> 8);
+        count[1] = (char)(value & 0xff);
+    } else {
+        memcpy(count, &pages->entries, sizeof(int));
+    }
+    pages->ends[pages->count++] = pages->len;
+    return 0;
+}
+
+void wire_pages_begin(WirePages *pages, int version, int type, const char *channel) {
+    pages->version = version;
+    pages->type = type;
+    memset(pages->channel, 0, CHANNEL_MAX);
+    if (channel) {
+        strncpy(pages->channel, channel, CHANNEL_MAX - 1);
+    }
+    pages->len = 0;
+    pages->count = 0;
+    pages->bad = 0;
+    page_begin(pages);
+}
+
+int wire_pages_add(WirePages *pages, const char *name) {
+    if (pages->bad) {
+        return -1;
+    }
+    //each entry is at most CHANNEL_MAX bytes, and begin reserved a whole page
+    size_t entry = pages->version == WIRE_V2 ? 1 + strnlen(name, NAME_MAX_LEN) : CHANNEL_MAX;
+    if (pages->len - pages->page_start + entry > WIRE_PAGE_MAX || pages->entries == (int)(WIRE_LIST_MORE - 1)) {
+        if (page_end(pages, 1) < 0 || page_begin(pages) < 0) {
+            return -1;
+        }
+    }
+    if (pages->version == WIRE_V2) {
+        Writer w = {(unsigned char *)pages->data + pages->len, (unsigned char *)pages->data + pages->len + entry, 1};
+        put_name(&w, name);
+    } else {
+        fill_field(pages->data + pages->len, CHANNEL_MAX, name, strnlen(name, CHANNEL_MAX));
+    }
+    pages->len += entry;
+    pages->entries++;
+    return 0;
+}
+
+int wire_pages_end(WirePages *pages) {
+    if (pages->bad) {
+        return -1;
+    }
+    return page_end(pages, 0);
+}
+
+const char *wire_page(const WirePages *pages, int i, size_t *len) {
+    size_t start = i > 0 ? pages->ends[i - 1] : 0;
+    *len = pages->ends[i] - start;
+    return pages->data + start;
+}
+
+size_t wire_pages_bytes(const WirePages *pages) {
+    return pages->capacity + pages->ends_capacity * sizeof(size_t);
+}
+
+void wire_pages_free(WirePages *pages) {
+    free(pages->data);
+    free(pages->ends);
+    memset(pages, 0, sizeof(*pages));
+}
+
+void wire_bundle_begin(void *buf) {
+    unsigned char *header = (unsigned char *)buf;
+    header[0] = WIRE_MAGIC;
+    header[1] = WIRE_BUNDLE;
+}
+
+void wire_bundle_entry(void *buf, size_t len) {
+    unsigned char *entry = (unsigned char *)buf;
+    entry[0] = (unsigned char)(len >> 8);
+    entry[1] = (unsigned char)(len & 0xff);
+}
+
+void wire_reach_begin(void *buf) {
+    unsigned char *header = (unsigned char *)buf;
+    header[0] = WIRE_MAGIC;
+    header[1] = WIRE_REACH;
+}
+
+void wire_reach_entry(void *buf, const struct sockaddr_in *server, int hops) {
+    unsigned char *entry = (unsigned char *)buf;
+    memcpy(entry, &server->sin_addr.s_addr, 4);
+    memcpy(entry + 4, &server->sin_port, 2);
+    entry[6] = (unsigned char)hops;
+}
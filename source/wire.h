@@ -0,0 +1,181 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+
+/* Encoding and decoding of both wire protocol versions.
+ *
+ * Version 1 is the packed structs in duckchat.h: fixed 32-byte names,
+ * a 64-byte text field and a 4-byte type in host byte order.
+ *
+ * Version 2 starts every datagram with WIRE_MAGIC and a one-byte type
+ * tag.  Names are a length byte followed by the name (at most
+ * CHANNEL_MAX - 1 bytes, no terminator), text is a big-endian 16-bit
+ * length followed by up to WIRE_TEXT_MAX bytes, and integers are
+ * big-endian.  After the tag:
+ *
+ *   LOGIN                      username
+ *   LOGOUT, LIST, KEEP_ALIVE   -
+ *   JOIN, LEAVE, WHO           channel
+ *   S2S_JOIN, S2S_LEAVE        channel
+ *   SAY                        channel, text
+ *   S2S_SAY                    id (8 bytes), channel, username, text
+ *   HELLO                      version (1 byte), flags (1 byte)
+ *   TREE                       tree (8 bytes), flags (1 byte), channel
+ *   BUNDLE                     any number of (length (2 bytes), datagram)
+ *   REACH                      any number of (address (4 bytes),
+ *                              port (2 bytes), hops (1 byte))
+ *   TXT_SAY                    channel, username, text
+ *   TXT_LIST                   count (2 bytes), count channels
+ *   TXT_WHO                    channel, count (2 bytes), count usernames
+ *   TXT_ERROR                  text
+ *
+ * LIST and WHO replies longer than WIRE_PAGE_MAX are split into pages,
+ * each a complete TXT_LIST or TXT_WHO with its own count.  In v2 every
+ * page but the last has WIRE_LIST_MORE set in its count; v1 has no
+ * room for the flag, so v1 clients just see several replies.
+ *
+ * Requests keep their v1 type numbers as tags.  Texts are tagged
+ * WIRE_TEXT | TXT_*, so a v2 datagram can be decoded without knowing
+ * which way it travels.  TREE builds per-channel distribution trees
+ * between servers that both set WIRE_HELLO_TREE; see handle_tree() in
+ * server.c.  A BUNDLE carries several S2S datagrams to one neighbor;
+ * it is only sent to servers whose HELLO had WIRE_HELLO_BUNDLES and
+ * never nests.  A REACH lists the servers that can be reached through
+ * its sender, for core-based trees; see reach.h.  A v2 TXT_SAY is a v2
+ * S2S_SAY without the id, so a server can deliver a received S2S_SAY
+ * to its users by sending the bytes after the id behind a new header.
+ *
+ * A v1 datagram starts with a small type in host byte order, so its
+ * first byte can never be WIRE_MAGIC.  Servers that only know v1 drop
+ * v2 datagrams as unknown types, which is what negotiation relies on:
+ * a v2 peer sends HELLO, and only v2 peers answer it.
+ */
+
+#define WIRE_V1 1
+#define WIRE_V2 2
+
+#define WIRE_MAGIC 0xD2
+#define WIRE_V2_HEADER 2
+#define WIRE_V2_ID_SIZE 8
+
+#define WIRE_HELLO 0x20
+#define WIRE_BUNDLE 0x21
+#define WIRE_TREE 0x22
+#define WIRE_REACH 0x23
+#define WIRE_TEXT 0x40
+/* HELLO flags */
+#define WIRE_HELLO_ACK 0x01
+#define WIRE_HELLO_BUNDLES 0x02   /* the sender unpacks BUNDLEs */
+#define WIRE_HELLO_TREE 0x04      /* the sender builds channel trees with TREE */
+/* TREE flags */
+#define WIRE_TREE_LINK 0x01       /* the sender keeps the link, else an offer */
+/* Length prefix of each datagram in a BUNDLE. */
+#define WIRE_BUNDLE_ENTRY 2
+/* One server in a REACH. */
+#define WIRE_REACH_ENTRY 7
+
+/* Longest v2 text.  Every v2 datagram but a BUNDLE then fits in the
+ * client's 1024-byte receive buffer (an S2S_SAY, the largest, is at
+ * most 976 bytes).  BUNDLEs only go between servers and are filled up
+ * to COALESCE_MTU, 1472 bytes, which is also NET_RECV_BUFFER: one UDP
+ * datagram in a 1500-byte Ethernet frame, so not under IPv6's 1280. */
+#define WIRE_TEXT_MAX 900
+/* Largest TXT_LIST / TXT_WHO page; fits the client's receive buffer. */
+#define WIRE_PAGE_MAX 1024
+#define WIRE_LIST_MORE 0x8000
+/* Bytes a v2 SAY-family datagram adds to its text, at most. */
+#define WIRE_V2_SAY_OVERHEAD (WIRE_V2_HEADER + WIRE_V2_ID_SIZE + CHANNEL_MAX + USERNAME_MAX + 2)
+
+/* A decoded datagram of either version. */
+typedef struct WireMessage {
+    int version;
+    int type;                     /* REQ_*, S2S_*, WIRE_HELLO or WIRE_TEXT | TXT_* */
+    uint64_t id;                  /* S2S_SAY, and the tree of a TREE */
+    char channel[CHANNEL_MAX];    /* always terminated */
+    char username[USERNAME_MAX];  /* LOGIN, S2S_SAY, TXT_SAY */
+    const char *text;             /* points into the datagram, not terminated */
+    size_t text_len;
+    int hello_version;
+    int hello_flags;
+    int tree_flags;
+    int count;                    /* TXT_LIST and TXT_WHO entries, REACH servers */
+    int more;                     /* v2 TXT_LIST/TXT_WHO: more pages follow */
+    const char *entries;          /* read with the wire_next_*() functions */
+    size_t entries_len;
+} WireMessage;
+
+/* Decodes a datagram.  from_server tells a v1 text from a v1 request
+ * with the same type number.  Returns -1 if the datagram is short or
+ * malformed. */
+int wire_decode(const void *buf, size_t len, int from_server, WireMessage *msg);
+
+/* The type wire_decode() would report for a request, read from the
+ * header alone.  Returns -1 if the datagram is too short to have one. */
+int wire_peek_type(const void *buf, size_t len);
+
+/* Copies the next TXT_LIST/TXT_WHO entry into name.  *offset starts at
+ * 0.  Returns 0, or -1 after the last entry. */
+int wire_next_entry(const WireMessage *msg, size_t *offset, char name[CHANNEL_MAX]);
+
+/* Points *data at the next datagram of a BUNDLE.  *offset starts at 0.
+ * Returns 0, or -1 after the last one or if the bundle is cut short. */
+int wire_next_bundled(const WireMessage *msg, size_t *offset, const char **data, size_t *len);
+
+/* Reads the next server of a REACH.  *offset starts at 0.  Returns 0,
+ * or -1 after the last one. */
+int wire_next_reach(const WireMessage *msg, size_t *offset, struct sockaddr_in *server, int *hops);
+
+/* Encodes msg->type with the fields it uses.  v1 text is cut to
+ * SAY_MAX - 1 bytes.  TXT_LIST and TXT_WHO are built with WirePages
+ * (wire_pages_begin()) instead.  Returns the length, or 0 if it does
+ * not fit in size. */
+size_t wire_encode(int version, const WireMessage *msg, void *buf, size_t size);
+
+/* Fills in a message of the given type with no fields set. */
+void wire_message(WireMessage *msg, int type);
+
+/* TXT_LIST / TXT_WHO builder.  Pages are laid out back to back in one
+ * buffer that is kept across wire_pages_begin() calls, so rebuilding a
+ * reply reuses its memory. */
+typedef struct WirePages {
+    int version;
+    int type;                   /* WIRE_TEXT | TXT_LIST or WIRE_TEXT | TXT_WHO */
+    char channel[CHANNEL_MAX];
+    char *data;
+    size_t len;
+    size_t capacity;
+    size_t *ends;               /* end offset of each finished page */
+    int count;                  /* finished pages */
+    int ends_capacity;
+    size_t page_start;          /* page being filled */
+    size_t count_at;
+    int entries;
+    int bad;                    /* memory ran out, no page may be sent */
+} WirePages;
+
+void wire_pages_begin(WirePages *pages, int version, int type, const char *channel);
+/* Both return -1 once memory has run out. */
+int wire_pages_add(WirePages *pages, const char *name);
+/* Finishes the last page; there is always at least one. */
+int wire_pages_end(WirePages *pages);
+const char *wire_page(const WirePages *pages, int i, size_t *len);
+/* Memory held, for the metrics report. */
+size_t wire_pages_bytes(const WirePages *pages);
+void wire_pages_free(WirePages *pages);
+
+/* BUNDLE builder: wire_bundle_begin() writes the WIRE_V2_HEADER bytes,
+ * then each datagram follows WIRE_BUNDLE_ENTRY bytes written by
+ * wire_bundle_entry(). */
+void wire_bundle_begin(void *buf);
+void wire_bundle_entry(void *buf, size_t len);
+
+/* REACH builder: wire_reach_begin() writes the WIRE_V2_HEADER bytes,
+ * then wire_reach_entry() writes each WIRE_REACH_ENTRY-byte server. */
+void wire_reach_begin(void *buf);
+void wire_reach_entry(void *buf, const struct sockaddr_in *server, int hops);
+
+#endif